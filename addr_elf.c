@@ -0,0 +1,580 @@
+#include <elf.h>
+#include <sys/mman.h>
+
+#include "phpspy.h"
+
+typedef struct elf_file_s {
+  const char *data;
+  size_t size;
+  struct stat st;
+  const Elf64_Ehdr *ehdr;
+  const Elf64_Shdr *shdrs;
+} elf_file_t;
+
+/* Binaries are identified by the file they were mapped from and, when it
+ * has one, their GNU build-id. Size and mtime catch in-place overwrites of
+ * binaries without a build-id */
+typedef struct elf_image_key_s {
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  time_t mtime;
+  unsigned char build_id[PHPSPY_BUILD_ID_SIZE];
+  size_t build_id_len;
+} elf_image_key_t;
+
+typedef struct elf_symbol_s {
+  char *name;
+  uint64_t offset;
+  UT_hash_handle hh;
+} elf_symbol_t;
+
+typedef struct elf_image_s {
+  elf_image_key_t key;
+  uint64_t load_vaddr;
+  elf_symbol_t *symbols;
+  UT_hash_handle hh;
+} elf_image_t;
+
+static elf_image_t *image_cache = NULL;
+static uint64_t image_cache_hits = 0;
+static uint64_t image_cache_misses = 0;
+static uint64_t image_cache_opens = 0;
+static pthread_mutex_t image_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int get_php_bin_path(pid_t pid, char *path_root, char *path);
+static int get_symbol_offset(elf_image_t *image, elf_file_t *elf,
+                             const char *symbol, uint64_t *raddr);
+static void set_symbol_addr(addr_memo_t *memo, elf_image_t *image,
+                            uint64_t start_addr, uint64_t addr_offset,
+                            uint64_t *raddr);
+static elf_image_t *image_cache_find(struct stat *st);
+static elf_image_t *image_cache_get(elf_file_t *elf);
+static void image_free(elf_image_t *image);
+static int maps_parse_line(char *line, uint64_t *start_addr, char **path);
+static int elf_open(const char *path, elf_file_t *elf);
+static void elf_close(elf_file_t *elf);
+static const void *elf_at(elf_file_t *elf, uint64_t offset, uint64_t size);
+static int elf_load_vaddr(elf_file_t *elf, uint64_t *vaddr);
+static void elf_build_id(elf_file_t *elf, unsigned char *build_id,
+                         size_t *build_id_len);
+static int elf_find_symbol(elf_file_t *elf, const char *symbol,
+                           uint64_t *value);
+static int elf_find_symbol_gnu_hash(elf_file_t *elf, const Elf64_Shdr *hash,
+                                    const Elf64_Shdr *symtab,
+                                    const char *symbol, uint64_t *value);
+static int elf_find_symbol_linear(elf_file_t *elf, const Elf64_Shdr *symtab,
+                                  const char *symbol, uint64_t *value);
+
+int get_symbol_addr(addr_memo_t *memo, pid_t pid, const char *symbol,
+                    uint64_t *raddr) {
+  char *php_bin_path, *php_bin_path_root;
+  uint64_t *php_base_addr;
+  uint64_t start_addr;
+  uint64_t addr_offset;
+  elf_image_t *image;
+  elf_symbol_t *entry;
+  elf_file_t elf;
+  struct stat st;
+  int rv;
+  php_bin_path = memo->php_bin_path;
+  php_bin_path_root = memo->php_bin_path_root;
+  php_base_addr = &memo->php_base_addr;
+  start_addr = 0;
+  if (*php_bin_path == '\0' &&
+      get_php_bin_path(pid, php_bin_path_root, php_bin_path) != 0) {
+    return 1;
+  } else if (*php_base_addr == 0 &&
+             get_php_start_addr(pid, php_bin_path, &start_addr) != 0) {
+    return 1;
+  }
+
+  /* A symbol already resolved for an image still on disk unchanged needs
+   * only a stat, not the file opened and mapped again */
+  entry = NULL;
+  if (stat(php_bin_path_root, &st) == 0) {
+    pthread_mutex_lock(&image_cache_lock);
+    if ((image = image_cache_find(&st)) != NULL) {
+      HASH_FIND_STR(image->symbols, symbol, entry);
+    }
+    if (entry != NULL) {
+      image_cache_hits += 1;
+      set_symbol_addr(memo, image, start_addr, entry->offset, raddr);
+    }
+    pthread_mutex_unlock(&image_cache_lock);
+  }
+  if (entry != NULL) {
+    return 0;
+  } else if (elf_open(php_bin_path_root, &elf) != 0) {
+    return 1;
+  }
+
+  /* Only the pid's own start address is per-process, the rest comes from
+   * the process-wide image cache */
+  rv = 1;
+  pthread_mutex_lock(&image_cache_lock);
+  image_cache_opens += 1;
+  if ((image = image_cache_get(&elf)) == NULL) {
+    log_error("get_symbol_addr: Failed to get virt_addr\n");
+  } else if (get_symbol_offset(image, &elf, symbol, &addr_offset) == 0) {
+    set_symbol_addr(memo, image, start_addr, addr_offset, raddr);
+    rv = 0;
+  }
+  pthread_mutex_unlock(&image_cache_lock);
+  elf_close(&elf);
+  return rv;
+}
+
+void symbol_cache_stats(uint64_t *hits, uint64_t *misses, uint64_t *opens) {
+  pthread_mutex_lock(&image_cache_lock);
+  *hits = image_cache_hits;
+  *misses = image_cache_misses;
+  *opens = image_cache_opens;
+  pthread_mutex_unlock(&image_cache_lock);
+}
+
+void symbol_cache_clear(void) {
+  elf_image_t *image, *tmp;
+  pthread_mutex_lock(&image_cache_lock);
+  HASH_ITER(hh, image_cache, image, tmp) {
+    HASH_DEL(image_cache, image);
+    image_free(image);
+  }
+  pthread_mutex_unlock(&image_cache_lock);
+}
+
+static int get_php_bin_path(pid_t pid, char *path_root, char *path) {
+  char buf[PATH_MAX];
+  char line[PATH_MAX + 128];
+  char *map_path, *base_name;
+  uint64_t start_addr;
+  ssize_t buf_len;
+  FILE *fp;
+
+  /* Prefer a mapped libphp (e.g. apache mod_php), otherwise the exe */
+  buf[0] = '\0';
+  snprintf(line, sizeof(line), "/proc/%d/maps", (int)pid);
+  if ((fp = fopen(line, "r")) != NULL) {
+    while (fgets(line, sizeof(line), fp) != NULL) {
+      if (maps_parse_line(line, &start_addr, &map_path) != 0) {
+        continue;
+      }
+      base_name = strrchr(map_path, '/');
+      if (base_name != NULL && strncmp(base_name + 1, "libphp", 6) == 0) {
+        snprintf(buf, sizeof(buf), "%s", map_path);
+        break;
+      }
+    }
+    fclose(fp);
+  }
+  if (buf[0] == '\0') {
+    snprintf(line, sizeof(line), "/proc/%d/exe", (int)pid);
+    if ((buf_len = readlink(line, buf, sizeof(buf) - 1)) < 1) {
+      log_error("get_php_bin_path: Failed; err=%s\n", strerror(errno));
+      return 1;
+    }
+    buf[buf_len] = '\0';
+  }
+  if (strlen(buf) > PHPSPY_STR_SIZE - 1) {
+    log_error("get_php_bin_path: Path too long: %s\n", buf);
+    return 1;
+  }
+  if (snprintf(path_root, PHPSPY_STR_SIZE, "/proc/%d/root/%s", (int)pid, buf) >
+      PHPSPY_STR_SIZE - 1) {
+    log_error("get_php_bin_path: snprintf overflow\n");
+    return 1;
+  }
+  if (access(path_root, F_OK) != 0) {
+    snprintf(path_root, PHPSPY_STR_SIZE, "/proc/%d/exe", (int)pid);
+  }
+  strcpy(path, buf);
+  return 0;
+}
+
+int get_php_start_addr(pid_t pid, char *path, uint64_t *raddr) {
+  char line[PATH_MAX + 128];
+  char *map_path;
+  FILE *fp;
+  int found;
+
+  snprintf(line, sizeof(line), "/proc/%d/maps", (int)pid);
+  if ((fp = fopen(line, "r")) == NULL) {
+    log_error("get_php_start_addr: Failed to open maps; err=%s\n",
+              strerror(errno));
+    return 1;
+  }
+  found = 0;
+  while (!found && fgets(line, sizeof(line), fp) != NULL) {
+    found = maps_parse_line(line, raddr, &map_path) == 0 &&
+            strcmp(map_path, path) == 0;
+  }
+  fclose(fp);
+  if (!found) {
+    log_error("get_php_start_addr: Failed to get start_addr\n");
+    return 1;
+  }
+  return 0;
+}
+
+static int get_symbol_offset(elf_image_t *image, elf_file_t *elf,
+                             const char *symbol, uint64_t *raddr) {
+  elf_symbol_t *entry;
+
+  HASH_FIND_STR(image->symbols, symbol, entry);
+  if (entry != NULL) {
+    *raddr = entry->offset;
+    return 0;
+  }
+
+  if (elf_find_symbol(elf, symbol, raddr) != 0) {
+    log_error("get_symbol_offset: Failed; symbol=%s\n", symbol);
+    return 1;
+  }
+  if ((entry = calloc(1, sizeof(elf_symbol_t))) != NULL &&
+      (entry->name = strdup(symbol)) != NULL) {
+    entry->offset = *raddr;
+    HASH_ADD_KEYPTR(hh, image->symbols, entry->name, strlen(entry->name),
+                    entry);
+  } else {
+    free(entry);
+  }
+  return 0;
+}
+
+static void set_symbol_addr(addr_memo_t *memo, elf_image_t *image,
+                            uint64_t start_addr, uint64_t addr_offset,
+                            uint64_t *raddr) {
+  /**
+   * This is very likely to be incorrect/incomplete. I thought the base
+   * address from `/proc/<pid>/maps` + the symbol address from `readelf` would
+   * lead to the actual memory address, but on at least one system I tested on
+   * this is not the case. On that system, working backwards from the address
+   * printed in `gdb`, it seems the missing piece was the 'virtual address' of
+   * the LOAD section in ELF headers. I suspect this may have to do with
+   * address relocation and/or a feature called 'prelinking', but not sure.
+   */
+  if (memo->php_base_addr == 0) {
+    memo->php_base_addr = start_addr - image->load_vaddr;
+    memo->php_start_addr = start_addr;
+  }
+  *raddr = memo->php_base_addr + addr_offset;
+}
+
+/* Looks an image up by its file alone. The build-id is only compared once
+ * the file is opened, a binary rewritten in place keeping its size and
+ * mtime goes unnoticed until then */
+static elf_image_t *image_cache_find(struct stat *st) {
+  elf_image_t *image;
+  for (image = image_cache; image != NULL; image = image->hh.next) {
+    if (image->key.dev == st->st_dev && image->key.ino == st->st_ino &&
+        image->key.size == st->st_size && image->key.mtime == st->st_mtime) {
+      return image;
+    }
+  }
+  return NULL;
+}
+
+static elf_image_t *image_cache_get(elf_file_t *elf) {
+  elf_image_key_t key;
+  elf_image_t *image;
+
+  memset(&key, 0, sizeof(key));
+  key.dev = elf->st.st_dev;
+  key.ino = elf->st.st_ino;
+  key.size = elf->st.st_size;
+  key.mtime = elf->st.st_mtime;
+  elf_build_id(elf, key.build_id, &key.build_id_len);
+
+  HASH_FIND(hh, image_cache, &key, sizeof(key), image);
+  if (image != NULL) {
+    image_cache_hits += 1;
+    return image;
+  }
+
+  image_cache_misses += 1;
+  if ((image = calloc(1, sizeof(elf_image_t))) == NULL) {
+    return NULL;
+  }
+  image->key = key;
+  if (elf_load_vaddr(elf, &image->load_vaddr) != 0) {
+    free(image);
+    return NULL;
+  }
+  if (HASH_COUNT(image_cache) >= PHPSPY_IMAGE_CACHE_SIZE) {
+    /* Evict the oldest image, e.g. a binary replaced by a deploy */
+    elf_image_t *oldest = image_cache;
+    HASH_DEL(image_cache, oldest);
+    image_free(oldest);
+  }
+  HASH_ADD(hh, image_cache, key, sizeof(key), image);
+  return image;
+}
+
+static void image_free(elf_image_t *image) {
+  elf_symbol_t *entry, *tmp;
+  HASH_ITER(hh, image->symbols, entry, tmp) {
+    HASH_DEL(image->symbols, entry);
+    free(entry->name);
+    free(entry);
+  }
+  free(image);
+}
+
+static int maps_parse_line(char *line, uint64_t *start_addr, char **path) {
+  /* start-end perms offset dev inode path */
+  char *cursor;
+  int path_len;
+  *start_addr = strtoull(line, &cursor, 16);
+  if (*cursor != '-') {
+    return 1;
+  }
+  cursor = strchr(cursor, '/');
+  if (cursor == NULL) {
+    return 1;
+  }
+  path_len = strlen(cursor);
+  while (path_len > 0 && cursor[path_len - 1] == '\n') {
+    cursor[--path_len] = '\0';
+  }
+  *path = cursor;
+  return 0;
+}
+
+static int elf_open(const char *path, elf_file_t *elf) {
+  int fd;
+  void *data;
+
+  memset(elf, 0, sizeof(elf_file_t));
+  if ((fd = open(path, O_RDONLY)) < 0) {
+    log_error("elf_open: Failed to open %s; err=%s\n", path, strerror(errno));
+    return 1;
+  }
+  if (fstat(fd, &elf->st) != 0 ||
+      (size_t)elf->st.st_size < sizeof(Elf64_Ehdr)) {
+    log_error("elf_open: Not an ELF file: %s\n", path);
+    close(fd);
+    return 1;
+  }
+  data = mmap(NULL, elf->st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    log_error("elf_open: Failed to mmap %s; err=%s\n", path, strerror(errno));
+    return 1;
+  }
+  elf->data = data;
+  elf->size = elf->st.st_size;
+  elf->ehdr = data;
+  if (memcmp(elf->ehdr->e_ident, ELFMAG, SELFMAG) != 0 ||
+      elf->ehdr->e_ident[EI_CLASS] != ELFCLASS64) {
+    log_error("elf_open: Not an ELF64 file: %s\n", path);
+    elf_close(elf);
+    return 1;
+  }
+  elf->shdrs = elf_at(elf, elf->ehdr->e_shoff,
+                      (uint64_t)elf->ehdr->e_shnum * sizeof(Elf64_Shdr));
+  return 0;
+}
+
+static void elf_close(elf_file_t *elf) {
+  if (elf->data != NULL) {
+    munmap((void *)elf->data, elf->size);
+  }
+  memset(elf, 0, sizeof(elf_file_t));
+}
+
+static const void *elf_at(elf_file_t *elf, uint64_t offset, uint64_t size) {
+  if (offset > elf->size || size > elf->size - offset) {
+    return NULL;
+  }
+  return elf->data + offset;
+}
+
+static int elf_load_vaddr(elf_file_t *elf, uint64_t *vaddr) {
+  const Elf64_Phdr *phdrs;
+  int i;
+  phdrs = elf_at(elf, elf->ehdr->e_phoff,
+                 (uint64_t)elf->ehdr->e_phnum * sizeof(Elf64_Phdr));
+  if (phdrs == NULL) {
+    return 1;
+  }
+  for (i = 0; i < elf->ehdr->e_phnum; i++) {
+    if (phdrs[i].p_type == PT_LOAD) {
+      *vaddr = phdrs[i].p_vaddr;
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static void elf_build_id(elf_file_t *elf, unsigned char *build_id,
+                         size_t *build_id_len) {
+  const Elf64_Phdr *phdrs;
+  const Elf64_Nhdr *note;
+  const char *notes;
+  uint64_t offset, name_size, desc_size;
+  int i;
+
+  *build_id_len = 0;
+  phdrs = elf_at(elf, elf->ehdr->e_phoff,
+                 (uint64_t)elf->ehdr->e_phnum * sizeof(Elf64_Phdr));
+  if (phdrs == NULL) {
+    return;
+  }
+  for (i = 0; i < elf->ehdr->e_phnum; i++) {
+    if (phdrs[i].p_type != PT_NOTE ||
+        (notes = elf_at(elf, phdrs[i].p_offset, phdrs[i].p_filesz)) == NULL) {
+      continue;
+    }
+    offset = 0;
+    while (offset + sizeof(Elf64_Nhdr) <= phdrs[i].p_filesz) {
+      note = (const Elf64_Nhdr *)(notes + offset);
+      name_size = (note->n_namesz + 3) & ~3ULL;
+      desc_size = (note->n_descsz + 3) & ~3ULL;
+      offset += sizeof(Elf64_Nhdr);
+      if (offset + name_size + desc_size > phdrs[i].p_filesz) {
+        break;
+      }
+      if (note->n_type == NT_GNU_BUILD_ID && note->n_namesz == 4 &&
+          memcmp(notes + offset, "GNU", 4) == 0) {
+        *build_id_len = PHPSPY_MIN(note->n_descsz, PHPSPY_BUILD_ID_SIZE);
+        memcpy(build_id, notes + offset + name_size, *build_id_len);
+        return;
+      }
+      offset += name_size + desc_size;
+    }
+  }
+}
+
+static int elf_find_symbol(elf_file_t *elf, const char *symbol,
+                           uint64_t *value) {
+  const Elf64_Shdr *dynsym, *gnu_hash, *symtab;
+  int i;
+
+  if (elf->shdrs == NULL) {
+    return 1;
+  }
+  dynsym = gnu_hash = symtab = NULL;
+  for (i = 0; i < elf->ehdr->e_shnum; i++) {
+    if (elf->shdrs[i].sh_type == SHT_DYNSYM) {
+      dynsym = &elf->shdrs[i];
+    } else if (elf->shdrs[i].sh_type == SHT_GNU_HASH) {
+      gnu_hash = &elf->shdrs[i];
+    } else if (elf->shdrs[i].sh_type == SHT_SYMTAB) {
+      symtab = &elf->shdrs[i];
+    }
+  }
+
+  if (dynsym != NULL && gnu_hash != NULL &&
+      gnu_hash->sh_link == (Elf64_Word)(dynsym - elf->shdrs)) {
+    if (elf_find_symbol_gnu_hash(elf, gnu_hash, dynsym, symbol, value) == 0) {
+      return 0;
+    }
+  } else if (dynsym != NULL &&
+             elf_find_symbol_linear(elf, dynsym, symbol, value) == 0) {
+    return 0;
+  }
+  /* Not exported; fall back to the full symbol table if not stripped */
+  if (symtab != NULL &&
+      elf_find_symbol_linear(elf, symtab, symbol, value) == 0) {
+    return 0;
+  }
+  return 1;
+}
+
+static int elf_find_symbol_gnu_hash(elf_file_t *elf, const Elf64_Shdr *hash,
+                                    const Elf64_Shdr *symtab,
+                                    const char *symbol, uint64_t *value) {
+  const uint32_t *header, *buckets, *chain;
+  const uint64_t *bloom;
+  const Elf64_Sym *syms;
+  const char *strtab;
+  const Elf64_Shdr *strtab_shdr;
+  uint32_t nbuckets, symoffset, bloom_size, bloom_shift, nsyms, h, h2, i;
+  uint64_t word, mask;
+  const unsigned char *c;
+
+  if (symtab->sh_link >= elf->ehdr->e_shnum) {
+    return 1;
+  }
+  strtab_shdr = &elf->shdrs[symtab->sh_link];
+  header = elf_at(elf, hash->sh_offset, hash->sh_size);
+  syms = elf_at(elf, symtab->sh_offset, symtab->sh_size);
+  strtab = elf_at(elf, strtab_shdr->sh_offset, strtab_shdr->sh_size);
+  if (header == NULL || syms == NULL || strtab == NULL ||
+      hash->sh_size < 4 * sizeof(uint32_t)) {
+    return 1;
+  }
+  nbuckets = header[0];
+  symoffset = header[1];
+  bloom_size = header[2];
+  bloom_shift = header[3];
+  nsyms = symtab->sh_size / sizeof(Elf64_Sym);
+  bloom = (const uint64_t *)(header + 4);
+  buckets = (const uint32_t *)(bloom + bloom_size);
+  chain = buckets + nbuckets;
+  if (nbuckets == 0 || bloom_size == 0 ||
+      (const char *)chain > (const char *)header + hash->sh_size) {
+    return 1;
+  }
+
+  h = 5381;
+  for (c = (const unsigned char *)symbol; *c; c++) {
+    h = (h << 5) + h + *c;
+  }
+
+  word = bloom[(h / 64) % bloom_size];
+  mask = ((uint64_t)1 << (h % 64)) | ((uint64_t)1 << ((h >> bloom_shift) % 64));
+  if ((word & mask) != mask) {
+    return 1;
+  }
+
+  i = buckets[h % nbuckets];
+  if (i < symoffset) {
+    return 1;
+  }
+  for (; i < nsyms; i++) {
+    if ((const char *)&chain[i - symoffset + 1] >
+        (const char *)header + hash->sh_size) {
+      return 1;
+    }
+    h2 = chain[i - symoffset];
+    if ((h | 1) == (h2 | 1) && syms[i].st_name < strtab_shdr->sh_size &&
+        strcmp(symbol, strtab + syms[i].st_name) == 0 &&
+        syms[i].st_shndx != SHN_UNDEF) {
+      *value = syms[i].st_value;
+      return 0;
+    }
+    if (h2 & 1) {
+      break;
+    }
+  }
+  return 1;
+}
+
+static int elf_find_symbol_linear(elf_file_t *elf, const Elf64_Shdr *symtab,
+                                  const char *symbol, uint64_t *value) {
+  const Elf64_Sym *syms;
+  const char *strtab;
+  const Elf64_Shdr *strtab_shdr;
+  uint64_t i, nsyms;
+
+  if (symtab->sh_link >= elf->ehdr->e_shnum) {
+    return 1;
+  }
+  strtab_shdr = &elf->shdrs[symtab->sh_link];
+  syms = elf_at(elf, symtab->sh_offset, symtab->sh_size);
+  strtab = elf_at(elf, strtab_shdr->sh_offset, strtab_shdr->sh_size);
+  if (syms == NULL || strtab == NULL) {
+    return 1;
+  }
+  nsyms = symtab->sh_size / sizeof(Elf64_Sym);
+  for (i = 0; i < nsyms; i++) {
+    if (syms[i].st_name < strtab_shdr->sh_size &&
+        syms[i].st_shndx != SHN_UNDEF &&
+        strcmp(symbol, strtab + syms[i].st_name) == 0) {
+      *value = syms[i].st_value;
+      return 0;
+    }
+  }
+  return 1;
+}
@@ -0,0 +1,396 @@
+#include "phpspy.h"
+
+/* Samples are merged into a prefix tree: node 0 is the root, every other
+ * node is a frame on the path to it. Frames are resolved into the tree's own
+ * strings once, so the tree outlives resets of the context's intern table */
+
+static uint32_t node_hash(uint32_t parent, uint32_t frame) {
+  uint32_t key[2] = {parent, frame};
+  return phpspy_hash(key, sizeof(key));
+}
+
+/* Keeps an index at most half full; when it had to grow, *rehash tells the
+ * caller to put its entries back */
+static int index_grow(uint32_t **index, uint32_t *cap, uint32_t len,
+                      int *rehash) {
+  uint32_t *grown;
+  *rehash = 0;
+  if ((len + 1) * 2 <= *cap) {
+    return PHPSPY_OK;
+  }
+  if ((grown = calloc(PHPSPY_MAX(*cap * 2, 64), sizeof(uint32_t))) == NULL) {
+    return PHPSPY_ERR;
+  }
+  free(*index);
+  *index = grown;
+  *cap = PHPSPY_MAX(*cap * 2, 64);
+  *rehash = 1;
+  return PHPSPY_OK;
+}
+
+static int array_grow(void **array, uint32_t *cap, uint32_t len, size_t size) {
+  void *grown;
+  if (len < *cap) {
+    return PHPSPY_OK;
+  }
+  if ((grown = realloc(*array, PHPSPY_MAX(*cap * 2, 64) * size)) == NULL) {
+    return PHPSPY_ERR;
+  }
+  *array = grown;
+  *cap = PHPSPY_MAX(*cap * 2, 64);
+  return PHPSPY_OK;
+}
+
+static void frames_put(call_tree_t *tree, uint32_t id) {
+  uint32_t i = phpspy_hash(&tree->frames[id], sizeof(call_tree_frame_t));
+  while (tree->frames_index[i & (tree->frames_index_cap - 1)] != 0) i++;
+  tree->frames_index[i & (tree->frames_index_cap - 1)] = id + 1;
+}
+
+static void nodes_put(call_tree_t *tree, uint32_t id) {
+  uint32_t i = node_hash(tree->nodes[id].parent, tree->nodes[id].frame);
+  while (tree->nodes_index[i & (tree->nodes_index_cap - 1)] != 0) i++;
+  tree->nodes_index[i & (tree->nodes_index_cap - 1)] = id;
+}
+
+static int frame_intern(call_tree_t *tree, call_tree_frame_t *frame,
+                        uint32_t *id) {
+  int rv, rehash;
+  uint32_t i, slot;
+
+  try
+    (rv, index_grow(&tree->frames_index, &tree->frames_index_cap,
+                    tree->frames_len, &rehash));
+  for (i = 0; rehash && i < tree->frames_len; i++) {
+    frames_put(tree, i);
+  }
+
+  i = phpspy_hash(frame, sizeof(*frame));
+  while ((slot = tree->frames_index[i & (tree->frames_index_cap - 1)]) != 0) {
+    if (memcmp(&tree->frames[slot - 1], frame, sizeof(*frame)) == 0) {
+      *id = slot - 1;
+      return PHPSPY_OK;
+    }
+    i++;
+  }
+  if (array_grow((void **)&tree->frames, &tree->frames_cap, tree->frames_len,
+                 sizeof(call_tree_frame_t)) != PHPSPY_OK) {
+    return PHPSPY_ERR;
+  }
+  *id = tree->frames_len++;
+  tree->frames[*id] = *frame;
+  frames_put(tree, *id);
+  return PHPSPY_OK;
+}
+
+static int frame_resolve(call_tree_t *tree, trace_context_t *context,
+                         trace_loc_t *loc, const char *app_root_dir,
+                         uint32_t *id) {
+  int rv;
+  uint32_t i, slot;
+  size_t root_len;
+  char *name;
+  const char *file, *func, *class_name;
+  call_tree_frame_t frame;
+  trace_strings_t *strings = &context->strings;
+
+  /* Locs are only meaningful within one generation of the context's
+   * strings, the cache of resolved locs starts over with each */
+  if (tree->locs_generation != strings->generation ||
+      tree->locs_len >= PHPSPY_CALL_TREE_LOCS) {
+    tree->locs_generation = strings->generation;
+    tree->locs_len = 0;
+    if (tree->locs != NULL) {
+      memset(tree->locs, 0, tree->locs_cap * sizeof(call_tree_loc_t));
+    }
+  }
+  if (tree->locs == NULL) {
+    tree->locs_cap = PHPSPY_CALL_TREE_LOCS * 2;
+    if ((tree->locs = calloc(tree->locs_cap, sizeof(call_tree_loc_t))) ==
+        NULL) {
+      tree->locs_cap = 0;
+      return PHPSPY_ERR;
+    }
+  }
+  i = phpspy_hash(loc, sizeof(*loc));
+  while ((slot = tree->locs[i & (tree->locs_cap - 1)].frame) != 0) {
+    if (memcmp(&tree->locs[i & (tree->locs_cap - 1)].loc, loc,
+               sizeof(*loc)) == 0) {
+      *id = slot - 1;
+      return PHPSPY_OK;
+    }
+    i++;
+  }
+
+  /* Frames are labelled the way formulate_output prints them */
+  func = strings_get(strings, loc->func);
+  class_name = strings_get(strings, loc->class_name);
+  file = strings_get(strings, loc->file);
+  root_len = strlen(app_root_dir);
+  if (root_len > 0 && strncmp(file, app_root_dir, root_len) == 0 &&
+      file[root_len] != '\0') {
+    file += root_len + 1;
+  }
+  try
+    (rv, strings_scratch(&tree->strings,
+                         strings_len(strings, loc->class_name) +
+                             strings_len(strings, loc->func) + 3,
+                         &name));
+  memset(&frame, 0, sizeof(frame));
+  frame.lineno = loc->lineno;
+  try
+    (rv, strings_intern(&tree->strings, name,
+                        sprintf(name, "%s%s%s", class_name,
+                                class_name[0] != '\0' ? "::" : "", func),
+                        &frame.name));
+  try
+    (rv, strings_intern(&tree->strings, file, strlen(file), &frame.file));
+  try
+    (rv, frame_intern(tree, &frame, id));
+
+  tree->locs[i & (tree->locs_cap - 1)].loc = *loc;
+  tree->locs[i & (tree->locs_cap - 1)].frame = *id + 1;
+  tree->locs_len += 1;
+  return PHPSPY_OK;
+}
+
+static int node_child(call_tree_t *tree, uint32_t parent, uint32_t frame,
+                      uint32_t *id) {
+  int rv, rehash;
+  uint32_t i, slot;
+  call_tree_node_t *node;
+
+  try
+    (rv, index_grow(&tree->nodes_index, &tree->nodes_index_cap,
+                    tree->nodes_len, &rehash));
+  for (i = 1; rehash && i < tree->nodes_len; i++) {
+    nodes_put(tree, i);
+  }
+
+  i = node_hash(parent, frame);
+  while ((slot = tree->nodes_index[i & (tree->nodes_index_cap - 1)]) != 0) {
+    if (tree->nodes[slot].parent == parent &&
+        tree->nodes[slot].frame == frame) {
+      *id = slot;
+      return PHPSPY_OK;
+    }
+    i++;
+  }
+
+  if (tree->nodes_len >= PHPSPY_CALL_TREE_NODES) {
+    return PHPSPY_ERR_BUF_FULL;
+  }
+  if (array_grow((void **)&tree->nodes, &tree->nodes_cap, tree->nodes_len,
+                 sizeof(call_tree_node_t)) != PHPSPY_OK) {
+    return PHPSPY_ERR;
+  }
+  *id = tree->nodes_len++;
+  node = &tree->nodes[*id];
+  memset(node, 0, sizeof(*node));
+  node->parent = parent;
+  node->frame = frame;
+  node->next_sibling = tree->nodes[parent].first_child;
+  tree->nodes[parent].first_child = *id;
+  nodes_put(tree, *id);
+  return PHPSPY_OK;
+}
+
+static void call_tree_relink(call_tree_t *tree) {
+  uint32_t i;
+  call_tree_node_t *node;
+
+  memset(tree->nodes_index, 0, tree->nodes_index_cap * sizeof(uint32_t));
+  for (i = 0; i < tree->nodes_len; i++) {
+    tree->nodes[i].first_child = 0;
+  }
+  for (i = 1; i < tree->nodes_len; i++) {
+    node = &tree->nodes[i];
+    node->next_sibling = tree->nodes[node->parent].first_child;
+    tree->nodes[node->parent].first_child = i;
+    nodes_put(tree, i);
+  }
+}
+
+void call_tree_prune(call_tree_t *tree, uint32_t max_nodes) {
+  uint32_t i, j, *remap;
+  uint64_t cutoff;
+  call_tree_node_t *node;
+
+  if (tree->nodes_len <= max_nodes ||
+      (remap = malloc(tree->nodes_len * sizeof(uint32_t))) == NULL) {
+    return;
+  }
+
+  /* Fold the coldest leaves into their parents until the tree fits. Children
+   * come after their parents, so walking backwards sees a parent only once
+   * its pruned children are gone. Frames right below the root are kept */
+  for (cutoff = 2; tree->nodes_len > max_nodes; cutoff *= 2) {
+    for (i = tree->nodes_len - 1; i > 0; i--) {
+      node = &tree->nodes[i];
+      if (node->first_child == 0 && node->parent != 0 &&
+          node->total < cutoff) {
+        tree->nodes[node->parent].self += node->self;
+        tree->pruned += 1;
+        node->parent = UINT32_MAX;
+        node->first_child = UINT32_MAX;
+      }
+    }
+    for (i = 0, j = 0; i < tree->nodes_len; i++) {
+      remap[i] = j;
+      if (tree->nodes[i].parent == UINT32_MAX) continue;
+      tree->nodes[j] = tree->nodes[i];
+      tree->nodes[j].parent = remap[tree->nodes[j].parent];
+      j++;
+    }
+    tree->nodes_len = j;
+    call_tree_relink(tree);
+    if (cutoff > tree->nodes[0].total) break;
+  }
+  free(remap);
+}
+
+int call_tree_add(call_tree_t *tree, trace_context_t *context,
+                  trace_frame_t *frames, int depth, const char *app_root_dir) {
+  int rv, i;
+  uint32_t node, child, frame;
+  struct timespec ts;
+
+  if (depth < 1) {
+    return PHPSPY_OK;
+  }
+  if (tree->nodes_len == 0) {
+    clock_gettime(CLOCK_REALTIME, &ts);
+    tree->time_ns = (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+    try
+      (rv, array_grow((void **)&tree->nodes, &tree->nodes_cap, 0,
+                      sizeof(call_tree_node_t)));
+    memset(&tree->nodes[0], 0, sizeof(call_tree_node_t));
+    tree->nodes_len = 1;
+  }
+  if (tree->nodes_len + depth > PHPSPY_CALL_TREE_NODES) {
+    call_tree_prune(tree, PHPSPY_CALL_TREE_NODES * 3 / 4);
+  }
+
+  /* frames[0] is the innermost frame, walk from the outermost one down */
+  node = 0;
+  tree->nodes[0].total += 1;
+  for (i = depth - 1; i >= 0; i--) {
+    try
+      (rv, frame_resolve(tree, context, &frames[i].loc, app_root_dir, &frame));
+    rv = node_child(tree, node, frame, &child);
+    if (rv == PHPSPY_ERR_BUF_FULL) {
+      /* A new path into a full tree is dropped whole rather than charged to
+       * the frame it stopped at */
+      for (; node != 0; node = tree->nodes[node].parent) {
+        tree->nodes[node].total -= 1;
+      }
+      tree->nodes[0].total -= 1;
+      tree->dropped += 1;
+      return PHPSPY_OK;
+    } else if (rv != PHPSPY_OK) {
+      return rv;
+    }
+    node = child;
+    tree->nodes[node].total += 1;
+  }
+  tree->nodes[node].self += 1;
+  return PHPSPY_OK;
+}
+
+static int sprint_frame(call_tree_t *tree, uint32_t id, char *buf,
+                        size_t buf_size) {
+  call_tree_frame_t *frame = &tree->frames[id];
+  const char *file = strings_get(&tree->strings, frame->file);
+  const char *name = strings_get(&tree->strings, frame->name);
+  if (frame->lineno == -1) {
+    return snprintf(buf, buf_size, "%s - %s;", file, name);
+  }
+  return snprintf(buf, buf_size, "%s:%d - %s;", file, frame->lineno, name);
+}
+
+int call_tree_collapsed(call_tree_t *tree, char *ptr, int len) {
+  int written = 0, line_len, depth, i;
+  uint32_t node, iter, path[MAX_STACK_DEPTH];
+
+  /* Depth first, emitting one line per node with self samples. Emitted
+   * counts are zeroed, so a flush that runs out of space resumes later */
+  node = tree->nodes_len > 0 ? tree->nodes[0].first_child : 0;
+  while (node != 0) {
+    if (tree->nodes[node].self > 0) {
+      depth = 0;
+      for (iter = node; iter != 0 && depth < MAX_STACK_DEPTH;
+           iter = tree->nodes[iter].parent) {
+        path[depth++] = iter;
+      }
+      line_len = 0;
+      for (i = depth - 1; i >= 0; i--) {
+        line_len += sprint_frame(tree, tree->nodes[path[i]].frame,
+                                 ptr + written + line_len,
+                                 PHPSPY_MAX(len - written - line_len, 0));
+      }
+      line_len += snprintf(ptr + written + line_len,
+                           PHPSPY_MAX(len - written - line_len, 0), " %lu\n",
+                           (unsigned long)tree->nodes[node].self);
+      if (line_len >= len - written) {
+        return written;
+      }
+      written += line_len;
+      tree->nodes[node].self = 0;
+    }
+
+    if (tree->nodes[node].first_child != 0) {
+      node = tree->nodes[node].first_child;
+      continue;
+    }
+    while (node != 0 && tree->nodes[node].next_sibling == 0) {
+      node = tree->nodes[node].parent;
+    }
+    if (node != 0) {
+      node = tree->nodes[node].next_sibling;
+    }
+  }
+
+  call_tree_clear(tree);
+  return written;
+}
+
+void call_tree_clear(call_tree_t *tree) {
+  tree->nodes_len = 0;
+  if (tree->nodes_index != NULL) {
+    memset(tree->nodes_index, 0, tree->nodes_index_cap * sizeof(uint32_t));
+  }
+
+  /* Frames are kept across flushes, until their strings grow too large */
+  if (tree->strings.len > PHPSPY_STRINGS_MAX) {
+    strings_clear(&tree->strings);
+    tree->frames_len = 0;
+    tree->locs_len = 0;
+    if (tree->frames_index != NULL) {
+      memset(tree->frames_index, 0,
+             tree->frames_index_cap * sizeof(uint32_t));
+    }
+    if (tree->locs != NULL) {
+      memset(tree->locs, 0, tree->locs_cap * sizeof(call_tree_loc_t));
+    }
+  }
+}
+
+void call_tree_free(call_tree_t *tree) {
+  strings_free(&tree->strings);
+  free(tree->frames);
+  free(tree->frames_index);
+  free(tree->locs);
+  free(tree->nodes);
+  free(tree->nodes_index);
+  memset(tree, 0, sizeof(*tree));
+}
+
+size_t call_tree_footprint(call_tree_t *tree) {
+  return tree->strings.cap + tree->strings.index_cap * sizeof(uint32_t) +
+         tree->strings.scratch_cap +
+         tree->frames_cap * sizeof(call_tree_frame_t) +
+         tree->frames_index_cap * sizeof(uint32_t) +
+         tree->locs_cap * sizeof(call_tree_loc_t) +
+         tree->nodes_cap * sizeof(call_tree_node_t) +
+         tree->nodes_index_cap * sizeof(uint32_t);
+}
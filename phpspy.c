@@ -1,76 +1,554 @@
 #include "phpspy.h"
 
-#ifdef USE_DIRECT
-static int copy_proc_mem_direct(trace_target_t *target, const char *what,
-                                void *raddr, void *laddr, size_t size) {
-  if (lseek(target->mem_fd, (uint64_t)raddr, SEEK_SET) == -1) {
-    log_error(
-        "copy_proc_mem_direct: Failed to copy %s; err=%s raddr=%p size=%lu\n",
-        what, strerror(errno), raddr, size);
-    return PHPSPY_ERR;
+int opt_vm_stack_slurp = 1;
+int opt_opline_lineno = 0;
+
+int opt_read_backend = PHPSPY_READ_AUTO;
+int opt_lazy_uring = -1; /* -1 timed at first use, 0 never, 1 always */
+int opt_opcache_shm = 1;
+int opt_pools = 1;
+int opt_proc_connector = 1;
+
+/* A way of reading target memory. Each reads n iovecs and reports the
+ * first one it could not read in full */
+typedef struct read_backend_s {
+  const char *name;
+  int (*open)(trace_target_t *target);
+  int (*read)(trace_target_t *target, const struct iovec *local,
+              const struct iovec *remote, const char **what, int n);
+} read_backend_t;
+
+static int read_open_none(trace_target_t *target);
+static int read_vm(trace_target_t *target, const struct iovec *local,
+                   const struct iovec *remote, const char **what, int n);
+static int read_mem(trace_target_t *target, const struct iovec *local,
+                    const struct iovec *remote, const char **what, int n);
+static int read_ptrace(trace_target_t *target, const struct iovec *local,
+                       const struct iovec *remote, const char **what, int n);
+
+/* Indexed by PHPSPY_READ_*, a zeroed target reads with process_vm_readv */
+static const read_backend_t read_backends[] = {
+    {"process_vm_readv", read_open_none, read_vm},
+    {"/proc/pid/mem", open_proc_mem, read_mem},
+    {"ptrace", read_open_none, read_ptrace},
+};
+
+static int read_failed(trace_target_t *target, const char *what, void *raddr,
+                       size_t size, const char *err) {
+  /* Reads of a dead process fail in ways that differ by backend */
+  if (kill(target->pid, 0) == -1 && errno == ESRCH) {
+    return PHPSPY_ERR | PHPSPY_ERR_PID_DEAD;
   }
-  if (read(target->mem_fd, laddr, size) == -1) {
-    log_error(
-        "copy_proc_mem_direct: Failed to copy %s; err=%s raddr=%p size=%lu\n",
-        what, strerror(errno), raddr, size);
-    return PHPSPY_ERR;
+  log_error("copy_proc_mem: Failed to copy %s with %s; err=%s raddr=%p "
+            "size=%lu\n",
+            what, read_backends[target->read_backend].name, err, raddr, size);
+  return PHPSPY_ERR;
+}
+
+static int read_open_none(trace_target_t *target) {
+  return PHPSPY_OK;
+}
+
+int open_proc_mem(trace_target_t *target) {
+  char path[PATH_MAX];
+  if (target->mem_fd >= 0) {
+    return PHPSPY_OK;
+  }
+  snprintf(&path[0], PATH_MAX, "/proc/%d/mem", target->pid);
+  target->mem_fd = open(path, O_RDONLY);
+  if (target->mem_fd < 0) {
+    log_error("open_proc_mem: Failed to open %s; err=%s\n", path,
+              strerror(errno));
+    return errno == ENOENT ? PHPSPY_ERR | PHPSPY_ERR_PID_DEAD : PHPSPY_ERR;
+  }
+  return PHPSPY_OK;
+}
+
+static int read_vm(trace_target_t *target, const struct iovec *local,
+                   const struct iovec *remote, const char **what, int n) {
+  int i;
+  ssize_t want, got;
+
+  /* PHPSPY_READ_PLAN_SIZE stays well below the kernel's UIO_MAXIOV (1024) */
+  want = 0;
+  for (i = 0; i < n; i++) {
+    want += local[i].iov_len;
+  }
+
+  got = process_vm_readv(target->pid, local, n, remote, n, 0);
+  if (got == want) {
+    return PHPSPY_OK;
+  }
+  if (got == -1 && errno == ESRCH) { /* No such process */
+    return PHPSPY_ERR | PHPSPY_ERR_PID_DEAD;
+  }
+
+  /* Transfers stop at the first iovec that could not be read in full */
+  i = 0;
+  while (got > 0 && (size_t)got >= local[i].iov_len) {
+    got -= local[i].iov_len;
+    i += 1;
+  }
+  return read_failed(target, what[i], remote[i].iov_base, remote[i].iov_len,
+                     got == -1 ? strerror(errno) : "partial read");
+}
+
+static int read_mem(trace_target_t *target, const struct iovec *local,
+                    const struct iovec *remote, const char **what, int n) {
+  int i, j;
+  ssize_t want, got;
+
+  /* Remote neighbours are one region of the file, read with one preadv */
+  for (i = 0; i < n; i = j) {
+    want = remote[i].iov_len;
+    for (j = i + 1; j < n && (char *)remote[j].iov_base ==
+                                 (char *)remote[j - 1].iov_base +
+                                     remote[j - 1].iov_len;
+         j++) {
+      want += remote[j].iov_len;
+    }
+    got = preadv(target->mem_fd, &local[i], j - i,
+                 (off_t)(uintptr_t)remote[i].iov_base);
+    if (got == want) continue;
+    if (got == 0) { /* The address space is gone */
+      return PHPSPY_ERR | PHPSPY_ERR_PID_DEAD;
+    }
+    while (got > 0 && (size_t)got >= local[i].iov_len) {
+      got -= local[i].iov_len;
+      i += 1;
+    }
+    return read_failed(target, what[i], remote[i].iov_base, remote[i].iov_len,
+                       got == -1 ? strerror(errno) : "partial read");
+  }
+  return PHPSPY_OK;
+}
+
+static int peek_words(pid_t pid, const struct iovec *local,
+                      const struct iovec *remote) {
+  size_t done, size = local->iov_len;
+  char *raddr = remote->iov_base, *laddr = local->iov_base;
+  long word;
+
+  /* The last word is read flush with the end, so as not to read past it.
+   * Less than a word is the tail of the word ending with it */
+  if (size > 0 && size < sizeof(long)) {
+    errno = 0;
+    word = ptrace(PTRACE_PEEKDATA, pid, raddr + size - sizeof(long), NULL);
+    if (errno != 0) {
+      return PHPSPY_ERR;
+    }
+    memcpy(laddr, (char *)&word + sizeof(long) - size, size);
+    return PHPSPY_OK;
+  }
+  for (done = 0; done < size; done += sizeof(long)) {
+    if (done + sizeof(long) > size) {
+      done = size - sizeof(long);
+    }
+    errno = 0;
+    word = ptrace(PTRACE_PEEKDATA, pid, raddr + done, NULL);
+    if (errno != 0) {
+      return PHPSPY_ERR;
+    }
+    memcpy(laddr + done, &word, sizeof(long));
+  }
+  return PHPSPY_OK;
+}
+
+static int read_ptrace(trace_target_t *target, const struct iovec *local,
+                       const struct iovec *remote, const char **what, int n) {
+  int i, status, sig, err;
+  pid_t pid = target->pid;
+
+  /* Attaching for the length of a read keeps every ptrace request on the
+   * calling thread, which is the tracer, whichever thread that is */
+  if (ptrace(PTRACE_SEIZE, pid, NULL, NULL) == -1) {
+    return read_failed(target, what[0], remote[0].iov_base, remote[0].iov_len,
+                       strerror(errno));
+  }
+  if (ptrace(PTRACE_INTERRUPT, pid, NULL, NULL) == -1 ||
+      waitpid(pid, &status, __WALL) == -1) {
+    err = errno;
+    ptrace(PTRACE_DETACH, pid, NULL, NULL);
+    return read_failed(target, what[0], remote[0].iov_base, remote[0].iov_len,
+                       strerror(err));
+  }
+
+  /* The detach below clobbers errno, so the error of the failed peek is
+   * kept */
+  err = 0;
+  for (i = 0; i < n; i++) {
+    if (peek_words(pid, &local[i], &remote[i]) != PHPSPY_OK) {
+      err = errno;
+      break;
+    }
+  }
+
+  /* A signal that arrived instead of the interrupt is passed back on */
+  sig = WIFSTOPPED(status) && status >> 16 != PTRACE_EVENT_STOP
+            ? WSTOPSIG(status)
+            : 0;
+  ptrace(PTRACE_DETACH, pid, NULL, (void *)(uintptr_t)sig);
+  if (i < n) {
+    return read_failed(target, what[i], remote[i].iov_base, remote[i].iov_len,
+                       strerror(err));
   }
   return PHPSPY_OK;
 }
-#else
-static int copy_proc_mem_syscall(trace_target_t *target, const char *what,
-                                 void *raddr, void *laddr, size_t size) {
+
+int copy_proc_mem(trace_target_t *target, const char *what, void *raddr,
+                  void *laddr, size_t size) {
   struct iovec local;
   struct iovec remote;
+
+  if (raddr == NULL) {
+    log_error("copy_proc_mem: Not copying %s; raddr is NULL\n", what);
+    return PHPSPY_ERR;
+  }
+  if (shm_copy(target, raddr, laddr, size)) {
+    return PHPSPY_OK;
+  }
   local.iov_base = laddr;
   local.iov_len = size;
   remote.iov_base = raddr;
   remote.iov_len = size;
+  return read_backends[target->read_backend].read(target, &local, &remote,
+                                                  &what, 1);
+}
 
-  if (process_vm_readv(target->pid, &local, 1, &remote, 1, 0) == -1) {
-    if (errno == ESRCH) { /* No such process */
-      perror("process_vm_readv");
-      return PHPSPY_ERR | PHPSPY_ERR_PID_DEAD;
+void read_plan_reset(trace_read_plan_t *plan) { plan->len = 0; }
+
+int read_plan_add(trace_read_plan_t *plan, const char *what, void *raddr,
+                  void *laddr, size_t size) {
+  if (raddr == NULL) {
+    log_error("read_plan_add: Not copying %s; raddr is NULL\n", what);
+    return PHPSPY_ERR;
+  }
+  if (plan->len >= PHPSPY_READ_PLAN_SIZE) {
+    log_error("read_plan_add: Not copying %s; plan is full\n", what);
+    return PHPSPY_ERR;
+  }
+  plan->local[plan->len].iov_base = laddr;
+  plan->local[plan->len].iov_len = size;
+  plan->remote[plan->len].iov_base = raddr;
+  plan->remote[plan->len].iov_len = size;
+  plan->what[plan->len] = what;
+  plan->len += 1;
+  return PHPSPY_OK;
+}
+
+void projection_init(trace_projection_t *proj, const trace_field_t *fields,
+                     int nfields) {
+  int i, j;
+  trace_field_t sorted[PHPSPY_PROJECTION_SIZE * 4];
+  trace_field_t field, *span;
+
+  /* Sort fields by offset, then coalesce neighbours into spans so that
+   * nearby fields are read with one iovec */
+  nfields = PHPSPY_MIN(nfields, (int)(sizeof(sorted) / sizeof(sorted[0])));
+  for (i = 0; i < nfields; i++) {
+    field = fields[i];
+    for (j = i; j > 0 && sorted[j - 1].offset > field.offset; j--) {
+      sorted[j] = sorted[j - 1];
+    }
+    sorted[j] = field;
+  }
+
+  proj->len = 0;
+  for (i = 0; i < nfields; i++) {
+    span = proj->len > 0 ? &proj->spans[proj->len - 1] : NULL;
+    if (span == NULL || (proj->len < PHPSPY_PROJECTION_SIZE &&
+                         sorted[i].offset > span->offset + span->size +
+                                                PHPSPY_PROJECTION_GAP)) {
+      proj->spans[proj->len++] = sorted[i];
+    } else {
+      span->size = PHPSPY_MAX(span->size,
+                              sorted[i].offset + sorted[i].size - span->offset);
+    }
+  }
+}
+
+int read_plan_add_projection(trace_read_plan_t *plan, const char *what,
+                             void *raddr, void *laddr,
+                             const trace_projection_t *proj) {
+  int rv, i;
+  if (raddr == NULL) {
+    log_error("read_plan_add_projection: Not copying %s; raddr is NULL\n",
+              what);
+    return PHPSPY_ERR;
+  }
+  for (i = 0; i < proj->len; i++) {
+    try
+      (rv, read_plan_add(plan, what, ((char *)raddr) + proj->spans[i].offset,
+                         ((char *)laddr) + proj->spans[i].offset,
+                         proj->spans[i].size));
+  }
+  return PHPSPY_OK;
+}
+
+int copy_proc_mem_plan(trace_target_t *target, trace_read_plan_t *plan) {
+  int i, n;
+
+  /* Reads served from the opcache segment are dropped from the plan */
+  for (i = 0, n = 0; target->shm != NULL && i < plan->len; i++) {
+    if (shm_copy(target, plan->remote[i].iov_base, plan->local[i].iov_base,
+                 plan->local[i].iov_len)) {
+      continue;
+    }
+    plan->local[n] = plan->local[i];
+    plan->remote[n] = plan->remote[i];
+    plan->what[n++] = plan->what[i];
+  }
+  if (target->shm != NULL) {
+    plan->len = n;
+  }
+  if (plan->len < 1) {
+    return PHPSPY_OK;
+  }
+  return read_backends[target->read_backend].read(
+      target, plan->local, plan->remote, plan->what, plan->len);
+}
+
+static uint64_t calibrate_ns(trace_target_t *target) {
+  int i;
+  uint64_t ns, best = UINT64_MAX;
+  struct timespec start, end;
+  zend_executor_globals eg;
+
+  /* The best of a few reads of what every sample starts with */
+  for (i = 0; i < 4; i++) {
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (copy_proc_mem(target, "executor_globals",
+                      (void *)target->executor_globals_addr, &eg,
+                      sizeof(eg)) != PHPSPY_OK) {
+      return UINT64_MAX;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    ns = (end.tv_sec - start.tv_sec) * 1000000000ull + end.tv_nsec -
+         start.tv_nsec;
+    best = PHPSPY_MIN(best, ns);
+  }
+  return best;
+}
+
+int select_read_backend(trace_target_t *target, int backend) {
+  int i, best = -1;
+  uint64_t ns, best_ns = UINT64_MAX;
+
+  if (backend != PHPSPY_READ_AUTO) {
+    if (backend < PHPSPY_READ_VM || backend > PHPSPY_READ_PTRACE) {
+      log_error("select_read_backend: Unknown read backend %d\n", backend);
+      return PHPSPY_ERR;
+    }
+    target->read_backend = backend;
+    return read_backends[backend].open(target);
+  }
+
+  /* Seccomp, YAMA and the kernel decide which of these work and which is
+   * fastest, so time the ones that do. Ptrace stops the target on every
+   * read, it is only a last resort */
+  for (i = PHPSPY_READ_VM; i <= PHPSPY_READ_MEM; i++) {
+    target->read_backend = i;
+    if (read_backends[i].open(target) != PHPSPY_OK) continue;
+    ns = calibrate_ns(target);
+    if (ns < best_ns) {
+      best = i;
+      best_ns = ns;
     }
-    log_error(
-        "copy_proc_mem_syscall: Failed to copy %s; err=%s raddr=%p size=%lu\n",
-        what, strerror(errno), raddr, size);
+  }
+  if (best < 0) {
+    target->read_backend = PHPSPY_READ_PTRACE;
+    if (calibrate_ns(target) == UINT64_MAX) {
+      log_error("select_read_backend: No way to read memory of pid %d\n",
+                target->pid);
+      return kill(target->pid, 0) == -1 && errno == ESRCH
+                 ? PHPSPY_ERR | PHPSPY_ERR_PID_DEAD
+                 : PHPSPY_ERR;
+    }
+    best = PHPSPY_READ_PTRACE;
+  }
+  target->read_backend = best;
+  if (best != PHPSPY_READ_MEM && target->mem_fd >= 0) {
+    close(target->mem_fd);
+    target->mem_fd = -1;
+  }
+  return PHPSPY_OK;
+}
+
+uint32_t phpspy_hash(const void *key, size_t len) {
+  size_t i;
+  uint32_t hash = 2166136261u; /* FNV-1a */
+  for (i = 0; i < len; i++) {
+    hash = (hash ^ ((const unsigned char *)key)[i]) * 16777619u;
+  }
+  return hash;
+}
+
+static int strings_grow_index(trace_strings_t *strings) {
+  uint32_t i, j, id, cap;
+  uint32_t *index;
+
+  cap = PHPSPY_MAX(strings->index_cap * 2, 64);
+  if ((index = calloc(cap, sizeof(uint32_t))) == NULL) {
+    return PHPSPY_ERR;
+  }
+  for (i = 0; i < strings->index_cap; i++) {
+    if ((id = strings->index[i]) == 0) continue;
+    j = phpspy_hash(strings_get(strings, id), strings_len(strings, id));
+    while (index[j & (cap - 1)] != 0) j++;
+    index[j & (cap - 1)] = id;
+  }
+  free(strings->index);
+  strings->index = index;
+  strings->index_cap = cap;
+  return PHPSPY_OK;
+}
+
+int strings_intern(trace_strings_t *strings, const char *str, size_t len,
+                   uint32_t *id) {
+  uint32_t i, need, cap, slot;
+  char *arena;
+
+  *id = 0;
+  if (len < 1) {
+    return PHPSPY_OK;
+  }
+  if (len > PHPSPY_STR_MAX) {
+    len = PHPSPY_STR_MAX;
+  }
+  if ((strings->count + 1) * 2 > strings->index_cap &&
+      strings_grow_index(strings) != PHPSPY_OK) {
+    log_error("strings_intern: Failed to grow index\n");
     return PHPSPY_ERR;
   }
 
+  i = phpspy_hash(str, len);
+  while ((slot = strings->index[i & (strings->index_cap - 1)]) != 0) {
+    if (strings_len(strings, slot) == len &&
+        memcmp(strings_get(strings, slot), str, len) == 0) {
+      *id = slot;
+      return PHPSPY_OK;
+    }
+    i++;
+  }
+
+  /* Records stay 4-byte aligned; offset 0 is never used so that id 0 can
+   * stand for the empty string */
+  need = (sizeof(uint32_t) + len + 1 + 3) & ~3u;
+  if (strings->len == 0) {
+    strings->len = sizeof(uint32_t);
+  }
+  if (strings->len + need > strings->cap) {
+    cap = PHPSPY_MAX(strings->cap, 4096);
+    while (strings->len + need > cap) cap *= 2;
+    if ((arena = realloc(strings->arena, cap)) == NULL) {
+      log_error("strings_intern: Failed to grow arena\n");
+      return PHPSPY_ERR;
+    }
+    strings->arena = arena;
+    strings->cap = cap;
+  }
+  *id = strings->len;
+  *(uint32_t *)(strings->arena + *id) = len;
+  memcpy(strings->arena + *id + sizeof(uint32_t), str, len);
+  strings->arena[*id + sizeof(uint32_t) + len] = '\0';
+  strings->len += need;
+  strings->index[i & (strings->index_cap - 1)] = *id;
+  strings->count += 1;
   return PHPSPY_OK;
 }
-#endif
 
-int copy_proc_mem(trace_target_t *target, const char *what, void *raddr,
-                  void *laddr, size_t size) {
-  if (raddr == NULL) {
-    log_error("copy_proc_mem: Not copying %s; raddr is NULL\n", what);
+/* Makes dst hold the same strings under the same ids as src */
+int strings_copy(trace_strings_t *dst, const trace_strings_t *src) {
+  char *arena;
+  uint32_t *index;
+
+  arena = malloc(src->cap);
+  index = malloc(src->index_cap * sizeof(uint32_t));
+  if (arena == NULL || index == NULL) {
+    log_error("strings_copy: Failed to allocate\n");
+    free(arena);
+    free(index);
     return PHPSPY_ERR;
   }
+  memcpy(arena, src->arena, src->len);
+  memcpy(index, src->index, src->index_cap * sizeof(uint32_t));
+  free(dst->arena);
+  free(dst->index);
+  dst->arena = arena;
+  dst->len = src->len;
+  dst->cap = src->cap;
+  dst->index = index;
+  dst->index_cap = src->index_cap;
+  dst->count = src->count;
+  dst->generation += 1;
+  return PHPSPY_OK;
+}
+
+const char *strings_get(const trace_strings_t *strings, uint32_t id) {
+  return id == 0 ? "" : strings->arena + id + sizeof(uint32_t);
+}
+
+size_t strings_len(const trace_strings_t *strings, uint32_t id) {
+  return id == 0 ? 0 : *(uint32_t *)(strings->arena + id);
+}
+
+int strings_scratch(trace_strings_t *strings, size_t size, char **buf) {
+  char *scratch;
+  if (size > strings->scratch_cap) {
+    if ((scratch = realloc(strings->scratch, size)) == NULL) {
+      log_error("strings_scratch: Failed to allocate %lu bytes\n", size);
+      return PHPSPY_ERR;
+    }
+    strings->scratch = scratch;
+    strings->scratch_cap = size;
+  }
+  *buf = strings->scratch;
+  return PHPSPY_OK;
+}
 
-  // TODO: Check if pid is alive, otherwise: PHPSPY_ERR_PID_DEAD
+void strings_clear(trace_strings_t *strings) {
+  strings->len = 0;
+  strings->count = 0;
+  strings->generation += 1;
+  if (strings->index != NULL) {
+    memset(strings->index, 0, strings->index_cap * sizeof(uint32_t));
+  }
+}
+
+void strings_free(trace_strings_t *strings) {
+  free(strings->arena);
+  free(strings->index);
+  free(strings->scratch);
+  memset(strings, 0, sizeof(*strings));
+}
+
+void segments_clear(trace_segments_t *segments) {
+  strings_clear(&segments->text);
+  segments->len = 0;
+  if (segments->slots != NULL) {
+    memset(segments->slots, 0,
+           PHPSPY_SEGMENT_CACHE_SIZE * sizeof(trace_segment_t));
+  }
+}
 
-#ifdef USE_DIRECT
-  return copy_proc_mem_direct(target, what, raddr, laddr, size);
-#else
-  return copy_proc_mem_syscall(target, what, raddr, laddr, size);
-#endif
+void segments_free(trace_segments_t *segments) {
+  strings_free(&segments->text);
+  free(segments->slots);
+  memset(segments, 0, sizeof(*segments));
 }
 
-int find_addresses(trace_target_t *target) {
+int find_addresses(trace_target_t *target, addr_memo_t *memo) {
   int rv;
-  addr_memo_t memo;
 
-  memset(&memo, 0, sizeof(addr_memo_t));
+  memset(memo, 0, sizeof(addr_memo_t));
 
   try
-    (rv, get_symbol_addr(&memo, target->pid, "executor_globals",
+    (rv, get_symbol_addr(memo, target->pid, "executor_globals",
                          &target->executor_globals_addr));
 
   // TODO: Is this doing someting?
   /*
-      if (get_symbol_addr(&memo, target->pid, "basic_functions_module",
+      if (get_symbol_addr(memo, target->pid, "basic_functions_module",
      &target->basic_functions_module_addr) != 0) {
           target->basic_functions_module_addr = 0;
       }
@@ -81,36 +559,85 @@ int find_addresses(trace_target_t *target) {
 int initialize(pid_t pid, struct trace_context_s *context, void *event_udata,
                int (*event_handler)(struct trace_context_s *context,
                                     int event_type)) {
-  static const char path_fmt[] = "/proc/%d/mem";
-  char path[PATH_MAX];
-  snprintf(&path[0], PATH_MAX, &path_fmt[0], pid);
+  int rv;
+  addr_memo_t memo;
 
   context->event_udata = event_udata;
   context->target.pid = pid;
+  context->target.mem_fd = -1;
   context->event_handler = event_handler;
 
-#ifdef USE_DIRECT
-  context->target.mem_fd = open(path, O_RDONLY);
+  /* A sibling of a target already initialized needs none of the below */
+  if (opt_pools && pool_join(context) == PHPSPY_OK) {
+    return PHPSPY_OK;
+  }
+  try
+    (rv, find_addresses(&context->target, &memo));
+  try
+    (rv, select_read_backend(&context->target, opt_read_backend));
+  if (opt_opcache_shm) {
+    try
+      (rv, shm_attach(&context->target));
+  }
+  if (opt_pools) {
+    pool_publish(context, &memo);
+  }
+  return PHPSPY_OK;
+}
 
-  if (context->target.mem_fd < 0) {
-    log_error("initialize: Failed to initialize for pid %d; err=%s\n", pid,
-              strerror(errno));
-    if (errno == ESRCH) {
-      return PHPSPY_ERR | PHPSPY_ERR_PID_DEAD;
-    }
-    return PHPSPY_ERR;
+void deinitialize(struct trace_context_s *context) {
+  func_cache_clear(context);
+  strings_free(&context->strings);
+  segments_free(&context->segments);
+  free(context->last_stack);
+  context->last_stack = NULL;
+  free(context->linenos);
+  context->linenos = NULL;
+  free(context->raw.buf);
+  memset(&context->raw, 0, sizeof(context->raw));
+  if (context->target.mem_fd >= 0) {
+    close(context->target.mem_fd);
+    context->target.mem_fd = -1;
   }
-#endif
+  shm_detach(&context->target);
+  pool_leave(context);
+}
 
-  int rv = find_addresses(&context->target);
+/* Starts dst off with the names src has resolved so far. Both must be
+ * targets of one pool: functions in the opcache segment sit at the same
+ * address in each, and any entry that does not match in dst fails its
+ * signature check and is resolved again like a stale one */
+int context_inherit(struct trace_context_s *dst, struct trace_context_s *src) {
+  int rv;
 
+  if (dst->strings.count > 0 || src->strings.count == 0) {
+    return PHPSPY_OK;
+  }
+  try
+    (rv, strings_copy(&dst->strings, &src->strings));
+  rv = func_cache_copy(dst, src);
+  if (rv != PHPSPY_OK) {
+    func_cache_clear(dst);
+    strings_clear(&dst->strings);
+  }
   return rv;
 }
 
-void deinitialize(struct trace_context_s *context) {
-#ifdef USE_DIRECT
-  close(context->target.mem_fd);
-#endif
+size_t context_footprint(struct trace_context_s *context) {
+  return context->strings.cap + context->strings.index_cap * sizeof(uint32_t) +
+         context->strings.scratch_cap + context->segments.text.cap +
+         context->segments.text.index_cap * sizeof(uint32_t) +
+         context->segments.text.scratch_cap +
+         (context->segments.slots != NULL
+              ? PHPSPY_SEGMENT_CACHE_SIZE * sizeof(trace_segment_t)
+              : 0) +
+         (context->last_stack != NULL ? sizeof(trace_last_stack_t) : 0) +
+         context->raw.cap * sizeof(uint64_t) +
+         (context->linenos != NULL
+              ? PHPSPY_LINENO_CACHE_SIZE * sizeof(trace_lineno_t)
+              : 0) +
+         HASH_COUNT(context->func_cache) * sizeof(trace_func_cache_t) +
+         HASH_OVERHEAD(hh, context->func_cache);
 }
 
 void log_error(const char *fmt, ...) {
@@ -48,14 +48,37 @@
 #define PHPSPY_MIN(a, b) ((a) < (b) ? (a) : (b))
 #define PHPSPY_MAX(a, b) ((a) > (b) ? (a) : (b))
 #define PHPSPY_STR_SIZE 256
+#define PHPSPY_STR_MAX (64 * 1024)
+#define PHPSPY_STRINGS_MAX (1024 * 1024)
+#define PHPSPY_SEGMENT_CACHE_SIZE 4096
+#define PHPSPY_RAW_SIZE (128 * 1024)
+#define PHPSPY_LINENO_CACHE_SIZE 1024
+#define PHPSPY_CALL_TREE_NODES 4096
+#define PHPSPY_CALL_TREE_LOCS 4096
 #define PHPSPY_MAX_ARRAY_BUCKETS 128
 #define PHPSPY_MAX_ARRAY_TABLE_SIZE 512
+#define PHPSPY_READ_PLAN_SIZE (MAX_STACK_DEPTH * 4)
+#define PHPSPY_VM_STACK_WINDOW_SIZE (32 * 1024)
+#define PHPSPY_FUNC_CACHE_SIZE 512
+#define PHPSPY_IMAGE_CACHE_SIZE 16
+#define PHPSPY_BUILD_ID_SIZE 32
+#define PHPSPY_PROJECTION_SIZE 8
+#define PHPSPY_PROJECTION_GAP 64
+#define PHPSPY_SHM_MIN_SIZE (1024 * 1024)
+
+#define PHPSPY_FIELD(__type, __member) \
+  { offsetof(__type, __member), sizeof(((__type *)NULL)->__member) }
 
 #define PHPSPY_OK 0
 #define PHPSPY_ERR 1
 #define PHPSPY_ERR_PID_DEAD 2
 #define PHPSPY_ERR_BUF_FULL 4
 
+#define PHPSPY_READ_AUTO -1  /* calibrated per target at initialize */
+#define PHPSPY_READ_VM 0     /* process_vm_readv */
+#define PHPSPY_READ_MEM 1    /* preadv on /proc/pid/mem */
+#define PHPSPY_READ_PTRACE 2 /* PTRACE_PEEKDATA, stops the target */
+
 #define PHPSPY_TRACE_EVENT_INIT 0
 #define PHPSPY_TRACE_EVENT_STACK_BEGIN 1
 #define PHPSPY_TRACE_EVENT_FRAME 2
@@ -67,13 +90,11 @@
 #define PHPSPY_TRACE_EVENT_ERROR 8
 #define PHPSPY_TRACE_EVENT_DEINIT 9
 
+/* Names are ids into the context's trace_strings_t, 0 is the empty string */
 typedef struct trace_loc_s {
-  char func[PHPSPY_STR_SIZE];
-  char class_name[PHPSPY_STR_SIZE];
-  char file[PHPSPY_STR_SIZE];
-  size_t func_len;
-  size_t class_len;
-  size_t file_len;
+  uint32_t func;
+  uint32_t class_name;
+  uint32_t file;
   int lineno;
 } trace_loc_t;
 
@@ -82,41 +103,319 @@ typedef struct trace_frame_s {
   int depth;
 } trace_frame_t;
 
+/* An opcache segment mapped locally, shared by every target mapping it at
+ * the same address, see shm.c */
+typedef struct trace_shm_s {
+  char *raddr;
+  size_t len;
+  const char *laddr;
+  uint64_t offset;
+  dev_t dev;
+  ino_t ino;
+  int refs;
+  struct trace_shm_s *next;
+} trace_shm_t;
+
+/* What initialize found for one of several targets forked from the same
+ * parent after it loaded php, shared with the others, see pool.c */
+typedef struct trace_pool_s {
+  pid_t ppid;
+  char php_bin_path[PHPSPY_STR_SIZE];
+  uint64_t php_start_addr; /* of the binary's first mapping */
+  uint64_t executor_globals_addr;
+  int read_backend;
+  trace_shm_t *shm;
+  struct trace_context_s *donor; /* whose caches joining members copy */
+  pid_t donor_pid;
+  int refs;
+  struct trace_pool_s *next;
+} trace_pool_t;
+
 typedef struct trace_target_s {
   pid_t pid;
-  int mem_fd;
+  int mem_fd; /* /proc/pid/mem once the backend or a lazy batch reads it */
+  int read_backend; /* PHPSPY_READ_*, picked by select_read_backend */
+  trace_shm_t *shm; /* NULL without an opcache segment mapped */
+  uint64_t shm_reads; /* reads served from shm */
+  trace_pool_t *pool; /* NULL outside of a pool */
   uint64_t executor_globals_addr;
   // uint64_t sapi_globals_addr; // TODO: Needed?
   uint64_t basic_functions_module_addr;  // TODO: Needed?
 } trace_target_t;
 
+typedef struct trace_func_sig_s {
+  zend_string *function_name;
+  zend_class_entry *scope;
+  zend_string *filename;
+  uint32_t line_start;
+  uint32_t line_end;
+  zend_uchar type;
+} trace_func_sig_t;
+
+typedef struct trace_func_cache_s {
+  zend_function *raddr;
+  trace_func_sig_t sig;
+  trace_loc_t loc;
+  UT_hash_handle hh;
+} trace_func_cache_t;
+
+/* Intern table: each distinct string is stored once in the arena as a
+ * uint32_t length followed by the NUL terminated bytes, and is identified by
+ * the offset of that record */
+typedef struct trace_strings_s {
+  char *arena;
+  uint32_t len;
+  uint32_t cap;
+  uint32_t *index; /* open addressing over ids, 0 marks a free slot */
+  uint32_t index_cap;
+  uint32_t count;
+  uint32_t generation; /* bumped whenever ids are invalidated */
+  char *scratch; /* remote strings are copied here before interning */
+  size_t scratch_cap;
+} trace_strings_t;
+
+typedef struct trace_segment_s {
+  trace_loc_t loc;
+  uint32_t text; /* id in the segment strings, 0 marks a free slot */
+} trace_segment_t;
+
+/* Frames as formulate_output prints them, rendered once per loc */
+typedef struct trace_segments_s {
+  trace_strings_t text;
+  trace_segment_t *slots; /* PHPSPY_SEGMENT_CACHE_SIZE of them */
+  uint32_t len;
+  uint32_t generation; /* of the context strings the locs refer to */
+  const char *root;    /* app root dir stripped from the files */
+} trace_segments_t;
+
+/* A frame of the last stack walked, as read from the target */
+typedef struct trace_last_frame_s {
+  zend_execute_data *raddr;
+  zend_execute_data *prev;
+  zend_function *func;
+  const zend_op *opline;
+  trace_loc_t loc;
+} trace_last_frame_t;
+
+typedef struct trace_last_stack_s {
+  trace_last_frame_t frames[MAX_STACK_DEPTH];
+  int depth;           /* 0 when there is nothing to compare against */
+  int valid_from;      /* frames from here down were found unchanged */
+  uint32_t generation; /* of the context strings the locs refer to */
+} trace_last_stack_t;
+
+/* The line an opline of a function is on, the cache is direct mapped */
+typedef struct trace_lineno_s {
+  zend_function *func;
+  const zend_op *opline; /* NULL marks a free slot */
+  int lineno;
+} trace_lineno_t;
+
+typedef struct trace_stats_s {
+  uint64_t samples;
+  uint64_t unchanged; /* samples that re-emitted the last stack */
+  uint64_t spliced;   /* samples that reused the bottom of the last stack */
+  uint64_t lineno_reads; /* oplines read to find their line */
+  uint64_t frame_reads;  /* frames read outside the vm stack window */
+} trace_stats_t;
+
+/* Stacks recorded as remote pointers, for names to be resolved in a batch
+ * later. Each is its depth followed by a function and an opline per frame */
+typedef struct trace_raw_s {
+  uint64_t *buf; /* at most PHPSPY_RAW_SIZE words */
+  uint32_t len;
+  uint32_t cap;
+  uint32_t stacks;
+} trace_raw_t;
+
 typedef struct trace_context_s {
   trace_target_t target;
+  trace_func_cache_t *func_cache;
+  trace_strings_t strings;
+  trace_segments_t segments;
+  trace_last_stack_t *last_stack;
+  trace_lineno_t *linenos; /* PHPSPY_LINENO_CACHE_SIZE of them */
+  trace_raw_t raw;
+  trace_stats_t stats;
+  /* The pool's donor when this joined, to copy caches from. Only good for
+   * as long as it is found registered under sibling_pid */
+  struct trace_context_s *sibling;
+  pid_t sibling_pid;
   struct {
     trace_frame_t frame;
   } event;
   void *event_udata;
   int (*event_handler)(struct trace_context_s *context, int event_type);
-  char buf[PHPSPY_STR_SIZE];
-  size_t buf_len;
 } trace_context_t;
 
+typedef struct call_tree_frame_s {
+  uint32_t name; /* "class::func" in the tree's strings */
+  uint32_t file; /* relative to the app root dir when below it */
+  int lineno;
+} call_tree_frame_t;
+
+typedef struct call_tree_node_s {
+  uint32_t parent;
+  uint32_t frame;
+  uint32_t first_child; /* 0 for none, the root is nobody's child */
+  uint32_t next_sibling;
+  uint64_t self;
+  uint64_t total;
+} call_tree_node_t;
+
+typedef struct call_tree_loc_s {
+  trace_loc_t loc;
+  uint32_t frame; /* frame id + 1, 0 marks a free slot */
+} call_tree_loc_t;
+
+typedef struct call_tree_s {
+  trace_strings_t strings;
+  call_tree_frame_t *frames;
+  uint32_t frames_len;
+  uint32_t frames_cap;
+  uint32_t *frames_index; /* frame id + 1, 0 marks a free slot */
+  uint32_t frames_index_cap;
+  call_tree_loc_t *locs; /* locs of the context already resolved */
+  uint32_t locs_len;
+  uint32_t locs_cap;
+  uint32_t locs_generation;
+  call_tree_node_t *nodes;
+  uint32_t nodes_len;
+  uint32_t nodes_cap;
+  uint32_t *nodes_index; /* node id, 0 marks a free slot */
+  uint32_t nodes_index_cap;
+  uint64_t pruned;  /* leaves folded into their parents */
+  uint64_t dropped; /* samples whose new path did not fit a full tree */
+  uint64_t time_ns; /* CLOCK_REALTIME of the first sample in the tree */
+} call_tree_t;
+
+typedef struct trace_read_plan_s {
+  struct iovec local[PHPSPY_READ_PLAN_SIZE];
+  struct iovec remote[PHPSPY_READ_PLAN_SIZE];
+  const char *what[PHPSPY_READ_PLAN_SIZE];
+  int len;
+} trace_read_plan_t;
+
+/* An io_uring set up without liburing, see uring.c */
+typedef struct trace_uring_s {
+  int fd;
+  unsigned entries;
+  void *sq_ptr;
+  void *cq_ptr;
+  size_t sq_len;
+  size_t cq_len;
+  size_t sqes_len;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_array;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned sq_mask;
+  unsigned cq_mask;
+  uint64_t enters; /* io_uring_enter calls made */
+} trace_uring_t;
+
+typedef struct trace_uring_read_s {
+  struct iovec local;
+  uint64_t raddr;
+  int fd; /* /proc/pid/mem of the target */
+  int res; /* bytes read or -errno */
+} trace_uring_read_t;
+
+typedef struct trace_field_s {
+  size_t offset;
+  size_t size;
+} trace_field_t;
+
+typedef struct trace_projection_s {
+  trace_field_t spans[PHPSPY_PROJECTION_SIZE];
+  int len;
+} trace_projection_t;
+
 typedef struct addr_memo_s {
   char php_bin_path[PHPSPY_STR_SIZE];
   char php_bin_path_root[PHPSPY_STR_SIZE];
   uint64_t php_base_addr;
+  uint64_t php_start_addr;
 } addr_memo_t;
 
+extern int opt_vm_stack_slurp;
+extern int opt_opline_lineno;
+extern int opt_read_backend;
+extern int opt_lazy_uring;
+extern int opt_opcache_shm;
+extern int opt_pools;
+extern int opt_proc_connector;
+
 int get_symbol_addr(addr_memo_t *memo, pid_t pid, const char *symbol,
                     uint64_t *raddr);
-int find_addresses(trace_target_t *target);
+int get_php_start_addr(pid_t pid, char *path, uint64_t *raddr);
+void symbol_cache_stats(uint64_t *hits, uint64_t *misses, uint64_t *opens);
+void symbol_cache_clear(void);
+int find_addresses(trace_target_t *target, addr_memo_t *memo);
 int copy_proc_mem(trace_target_t *target, const char *what, void *raddr,
                   void *laddr, size_t size);
+void read_plan_reset(trace_read_plan_t *plan);
+int read_plan_add(trace_read_plan_t *plan, const char *what, void *raddr,
+                  void *laddr, size_t size);
+int copy_proc_mem_plan(trace_target_t *target, trace_read_plan_t *plan);
+int select_read_backend(trace_target_t *target, int backend);
+int open_proc_mem(trace_target_t *target);
+int shm_attach(trace_target_t *target);
+void shm_detach(trace_target_t *target);
+trace_shm_t *shm_ref(trace_shm_t *shm);
+int shm_mapped_by(trace_shm_t *shm, pid_t pid);
+void shm_unref(trace_shm_t *shm);
+int shm_copy(trace_target_t *target, void *raddr, void *laddr, size_t size);
+int get_ppid(pid_t pid, pid_t *ppid);
+int pool_join(struct trace_context_s *context);
+void pool_publish(struct trace_context_s *context, addr_memo_t *memo);
+void pool_leave(struct trace_context_s *context);
+int uring_init(trace_uring_t *ring, unsigned entries);
+void uring_free(trace_uring_t *ring);
+int uring_read(trace_uring_t *ring, trace_uring_read_t *reads, int n);
+void projection_init(trace_projection_t *proj, const trace_field_t *fields,
+                     int nfields);
+int read_plan_add_projection(trace_read_plan_t *plan, const char *what,
+                             void *raddr, void *laddr,
+                             const trace_projection_t *proj);
+uint32_t phpspy_hash(const void *key, size_t len);
+int strings_copy(trace_strings_t *dst, const trace_strings_t *src);
+int strings_intern(trace_strings_t *strings, const char *str, size_t len,
+                   uint32_t *id);
+const char *strings_get(const trace_strings_t *strings, uint32_t id);
+size_t strings_len(const trace_strings_t *strings, uint32_t id);
+int strings_scratch(trace_strings_t *strings, size_t size, char **buf);
+void strings_clear(trace_strings_t *strings);
+void strings_free(trace_strings_t *strings);
+void segments_clear(trace_segments_t *segments);
+void segments_free(trace_segments_t *segments);
+int call_tree_add(call_tree_t *tree, trace_context_t *context,
+                  trace_frame_t *frames, int depth, const char *app_root_dir);
+void call_tree_prune(call_tree_t *tree, uint32_t max_nodes);
+int call_tree_collapsed(call_tree_t *tree, char *ptr, int len);
+int call_tree_pprof(call_tree_t *tree, uint64_t period_ns, uint64_t now_ns,
+                    char *ptr, int len, int *size);
+void call_tree_clear(call_tree_t *tree);
+void call_tree_free(call_tree_t *tree);
+size_t call_tree_footprint(call_tree_t *tree);
 void log_error(const char *fmt, ...);
 int do_trace(trace_context_t *context);
+int do_trace_raw(trace_context_t *context);
+int do_trace_raw_many(trace_context_t **contexts, int n, int *statuses,
+                      trace_uring_t *ring);
+int trace_raw_resolve(trace_context_t *context,
+                      int (*on_stack)(trace_context_t *context, void *udata),
+                      void *udata);
+void func_cache_clear(trace_context_t *context);
+int func_cache_copy(trace_context_t *dst, trace_context_t *src);
 int initialize(pid_t pid, struct trace_context_s *context, void *event_udata,
                int (*event_handler)(struct trace_context_s *context,
                                     int event_type));
 void deinitialize(struct trace_context_s *context);
+int context_inherit(struct trace_context_s *dst, struct trace_context_s *src);
+size_t context_footprint(struct trace_context_s *context);
 
 #endif
@@ -5,11 +5,142 @@
   (rv,                                                      \
    copy_proc_mem(&context->target, (__what), (__raddr), (__laddr), (__size)))
 
+#define try_read_plan_add_projection(__what, __raddr, __laddr, __proj) \
+  try                                                                  \
+  (rv, read_plan_add_projection(&plan, (__what), (__raddr), (__laddr), \
+                                (__proj)))
+
+#define try_copy_proc_mem_plan() \
+  try                            \
+  (rv, copy_proc_mem_plan(&context->target, &plan))
+
+#define try_strings_intern(__str, __len, __id) \
+  try                                          \
+  (rv, strings_intern(&context->strings, (__str), (__len), (__id)))
+
+/* Only the fields below are copied from the target; the rest of the local
+ * structs is left uninitialized */
+static const trace_field_t executor_globals_fields[] = {
+    PHPSPY_FIELD(zend_executor_globals, current_execute_data),
+    PHPSPY_FIELD(zend_executor_globals, vm_stack_top),
+    PHPSPY_FIELD(zend_executor_globals, vm_stack_end),
+    PHPSPY_FIELD(zend_executor_globals, vm_stack),
+};
+static const trace_field_t execute_data_fields[] = {
+    PHPSPY_FIELD(zend_execute_data, opline),
+    PHPSPY_FIELD(zend_execute_data, func),
+    PHPSPY_FIELD(zend_execute_data, prev_execute_data),
+};
+static const trace_field_t zfunc_fields[] = {
+    PHPSPY_FIELD(zend_function, type),
+    PHPSPY_FIELD(zend_function, common.function_name),
+    PHPSPY_FIELD(zend_function, common.scope),
+    PHPSPY_FIELD(zend_function, op_array.filename),
+    PHPSPY_FIELD(zend_function, op_array.line_start),
+    PHPSPY_FIELD(zend_function, op_array.line_end),
+    PHPSPY_FIELD(zend_function, op_array.last),
+    PHPSPY_FIELD(zend_function, op_array.opcodes),
+};
+static const trace_field_t zce_fields[] = {
+    PHPSPY_FIELD(zend_class_entry, name),
+};
+static const trace_field_t zstring_fields[] = {
+    PHPSPY_FIELD(zend_string, len),
+};
+
+#define PHPSPY_FIELDS_LEN(__fields) \
+  ((int)(sizeof(__fields) / sizeof(__fields[0])))
+
+static trace_projection_t executor_globals_proj;
+static trace_projection_t execute_data_proj;
+static trace_projection_t zfunc_proj;
+static trace_projection_t zce_proj;
+static trace_projection_t zstring_proj;
+static pthread_once_t projections_once = PTHREAD_ONCE_INIT;
+
+/* The oplines of a user function as read when it was resolved. A frame
+ * sampled earlier whose opline is not among them ran another function that
+ * was freed since, its memory now holding this one */
+typedef struct op_span_s {
+  const zend_op *opcodes;
+  uint32_t last;
+} op_span_t;
+
+/* buf holds up to PHPSPY_VM_STACK_WINDOW_SIZE bytes copied from raddr */
+typedef struct vm_stack_window_s {
+  char *raddr;
+  size_t len;
+  char *buf;
+} vm_stack_window_t;
+
+/* A lazy sample of one target in do_trace_raw_many, read a level of
+ * pointer indirection at a time along with every other target's */
+typedef struct raw_walk_s {
+  trace_context_t *context;
+  int status;
+  int active;
+  int reads;    /* first read asked for at this level */
+  int nreads;   /* reads asked for at this level */
+  int nframes;
+  const char *what;
+  zend_executor_globals executor_globals;
+  vm_stack_window_t window;
+  zend_execute_data *next; /* the frame to walk next */
+  zend_execute_data execute_data;
+  int have_next; /* execute_data holds next, as read at the last level */
+} raw_walk_t;
+
 static int trace_stack(trace_context_t *context,
-                       zend_execute_data *remote_execute_data, int *depth);
+                       zend_executor_globals *executor_globals, int *depth);
+static int copy_vm_stack(trace_context_t *context,
+                         zend_executor_globals *executor_globals,
+                         vm_stack_window_t *window);
+static int vm_stack_range(zend_executor_globals *executor_globals, char **lo,
+                          char **hi);
+static int copy_execute_data(trace_context_t *context,
+                             vm_stack_window_t *window,
+                             zend_execute_data *remote_execute_data,
+                             zend_execute_data *execute_data);
+static int raw_reserve(trace_raw_t *raw, uint32_t words);
+static void raw_walk_add_projection(raw_walk_t *walk, trace_uring_read_t *reads,
+                                    int *nreads, const char *what, void *raddr,
+                                    void *laddr,
+                                    const trace_projection_t *proj);
+static void raw_walk_advance(raw_walk_t *walk, trace_uring_read_t *reads,
+                             int *nreads);
+static void raw_walks_read(raw_walk_t *walks, int n, trace_uring_t *ring,
+                           trace_uring_read_t *reads, int nreads,
+                           int required);
+static int resolve_funcs(trace_context_t *context, zend_function **rfuncs,
+                         int nframes, trace_loc_t *locs, op_span_t *spans);
+static int resolve_unknown(trace_context_t *context, trace_loc_t *loc);
+static int resolve_linenos(trace_context_t *context, zend_function **rfuncs,
+                           const zend_op **oplines, int nframes,
+                           trace_loc_t *locs);
+static trace_lineno_t *lineno_entry(trace_context_t *context,
+                                    zend_function *rfunc,
+                                    const zend_op *opline);
+static size_t zstring_len(zend_string *lzstring);
+static int plan_zstring_body(trace_read_plan_t *plan, const char *what,
+                             zend_string *rzstring, zend_string *lzstring,
+                             char *buf);
+
+static void func_sig_init(trace_func_sig_t *sig, zend_function *lfunc);
+static trace_func_cache_t *func_cache_find(trace_context_t *context,
+                                           zend_function *rfunc,
+                                           zend_function *lfunc);
+static void func_cache_store(trace_context_t *context, zend_function *rfunc,
+                             zend_function *lfunc, trace_loc_t *loc,
+                             zend_function **keep, int nkeep);
 
 static int copy_executor_globals(trace_context_t *context,
-                                 zend_executor_globals *executor_globals);
+                                 zend_executor_globals *executor_globals,
+                                 trace_last_stack_t *last, int *unchanged);
+static int last_stack_find(trace_last_stack_t *last,
+                           zend_execute_data *raddr);
+static int emit_last_stack(trace_context_t *context, int *depth);
+
+static void projections_init(void);
 
 static int sprint_zstring(trace_context_t *context, const char *what,
                           zend_string *lzstring, char *buf, size_t buf_size,
@@ -22,11 +153,15 @@ static int sprint_zarray_bucket(trace_context_t *context, Bucket *lbucket,
                                 char *buf, size_t buf_size, size_t *buf_len);
 
 int do_trace(trace_context_t *context) {
-  int rv, depth;
+  int rv, depth, unchanged;
   zend_executor_globals executor_globals;
 
+  pthread_once(&projections_once, projections_init);
+
+  context->stats.samples += 1;
   try
-    (rv, copy_executor_globals(context, &executor_globals));
+    (rv, copy_executor_globals(context, &executor_globals, context->last_stack,
+                               &unchanged));
   try
     (rv, context->event_handler(context, PHPSPY_TRACE_EVENT_STACK_BEGIN));
 
@@ -43,7 +178,14 @@ int do_trace(trace_context_t *context) {
     }                                             \
   } while (0)
 
-    rv |= trace_stack(context, executor_globals.current_execute_data, &depth);
+    if (unchanged) {
+      /* Nothing moved since the last sample, its frames are emitted again */
+      context->stats.unchanged += 1;
+      rv |= emit_last_stack(context, &depth);
+      break;
+    }
+
+    rv |= trace_stack(context, &executor_globals, &depth);
     maybe_break_on_err();
     if (depth < 1) break;
 
@@ -58,81 +200,996 @@ int do_trace(trace_context_t *context) {
   return PHPSPY_OK;
 }
 
-static int trace_stack(trace_context_t *context,
-                       zend_execute_data *remote_execute_data, int *depth) {
+int do_trace_raw(trace_context_t *context) {
+  int rv, nframes, unchanged;
+  zend_executor_globals executor_globals;
+  zend_execute_data *remote_execute_data;
+  zend_execute_data execute_data;
+  vm_stack_window_t window;
+  char window_buf[PHPSPY_VM_STACK_WINDOW_SIZE];
+  trace_raw_t *raw = &context->raw;
+  uint64_t *stack;
+
+  pthread_once(&projections_once, projections_init);
+
+  if (raw_reserve(raw, 1 + 2 * MAX_STACK_DEPTH) != PHPSPY_OK) {
+    return PHPSPY_ERR_BUF_FULL;
+  }
+  context->stats.samples += 1;
+  try
+    (rv, copy_executor_globals(context, &executor_globals, NULL, &unchanged));
+  window.buf = window_buf;
+  try
+    (rv, copy_vm_stack(context, &executor_globals, &window));
+
+  /* Only the chain itself is read, names wait for trace_raw_resolve */
+  stack = raw->buf + raw->len;
+  nframes = 0;
+  remote_execute_data = executor_globals.current_execute_data;
+  while (remote_execute_data && nframes != MAX_STACK_DEPTH) {
+    try
+      (rv, copy_execute_data(context, &window, remote_execute_data,
+                             &execute_data));
+    stack[1 + 2 * nframes] = (uintptr_t)execute_data.func;
+    stack[2 + 2 * nframes] = (uintptr_t)execute_data.opline;
+    nframes += 1;
+    remote_execute_data = execute_data.prev_execute_data;
+  }
+  if (nframes > 0) {
+    stack[0] = nframes;
+    raw->len += 1 + 2 * nframes;
+    raw->stacks += 1;
+  }
+  return PHPSPY_OK;
+}
+
+/* Takes a lazy sample of every context like do_trace_raw does, with the
+ * reads of all of them going through one io_uring: a batch for the executor
+ * globals, one for the vm stack windows, then one per level of frames that
+ * fall outside of them. Contexts that cannot be read through /proc/pid/mem
+ * are sampled on their own. The fd stays open for the next batch whatever
+ * the read backend of the context is */
+int do_trace_raw_many(trace_context_t **contexts, int n, int *statuses,
+                      trace_uring_t *ring) {
+  int i, nreads;
+  size_t arena_len;
+  char *lo, *hi, *arena;
+  raw_walk_t *walks, *walk;
+  trace_uring_read_t *reads;
+  trace_raw_t *raw;
+
+  pthread_once(&projections_once, projections_init);
+
+  walks = calloc(n, sizeof(raw_walk_t));
+  reads = calloc((size_t)n * PHPSPY_PROJECTION_SIZE,
+                 sizeof(trace_uring_read_t));
+  if (walks == NULL || reads == NULL) {
+    free(walks);
+    free(reads);
+    for (i = 0; i < n; i++) {
+      statuses[i] = do_trace_raw(contexts[i]);
+    }
+    return PHPSPY_OK;
+  }
+
+  nreads = 0;
+  for (i = 0; i < n; i++) {
+    walk = &walks[i];
+    walk->context = contexts[i];
+    if (raw_reserve(&walk->context->raw, 1 + 2 * MAX_STACK_DEPTH) !=
+        PHPSPY_OK) {
+      walk->status = PHPSPY_ERR_BUF_FULL;
+    } else if (open_proc_mem(&walk->context->target) != PHPSPY_OK) {
+      walk->status = do_trace_raw(walk->context);
+    } else {
+      walk->context->stats.samples += 1;
+      walk->active = 1;
+      raw_walk_add_projection(
+          walk, reads, &nreads, "executor_globals",
+          (void *)walk->context->target.executor_globals_addr,
+          &walk->executor_globals, &executor_globals_proj);
+    }
+  }
+  raw_walks_read(walks, n, ring, reads, nreads, 1);
+
+  /* Windows share an arena sized for what is in use of each vm stack */
+  arena_len = 0;
+  for (i = 0; i < n; i++) {
+    if (walks[i].active &&
+        vm_stack_range(&walks[i].executor_globals, &lo, &hi)) {
+      arena_len += hi - lo;
+    }
+  }
+  arena = arena_len > 0 ? malloc(arena_len) : NULL;
+  arena_len = 0;
+  nreads = 0;
+  for (i = 0; i < n; i++) {
+    walk = &walks[i];
+    if (!walk->active) continue;
+    walk->next = walk->executor_globals.current_execute_data;
+    if (arena == NULL || !vm_stack_range(&walk->executor_globals, &lo, &hi)) {
+      continue;
+    }
+    walk->window.raddr = lo;
+    walk->window.len = hi - lo;
+    walk->window.buf = arena + arena_len;
+    arena_len += hi - lo;
+    walk->reads = nreads;
+    walk->nreads = 1;
+    walk->what = "vm_stack";
+    reads[nreads].local.iov_base = walk->window.buf;
+    reads[nreads].local.iov_len = walk->window.len;
+    reads[nreads].raddr = (uintptr_t)lo;
+    reads[nreads].fd = walk->context->target.mem_fd;
+    nreads += 1;
+  }
+  raw_walks_read(walks, n, ring, reads, nreads, 0);
+
+  do {
+    nreads = 0;
+    for (i = 0; i < n; i++) {
+      if (walks[i].active) {
+        raw_walk_advance(&walks[i], reads, &nreads);
+      }
+    }
+    raw_walks_read(walks, n, ring, reads, nreads, 1);
+  } while (nreads > 0);
+
+  for (i = 0; i < n; i++) {
+    walk = &walks[i];
+    raw = &walk->context->raw;
+    if (walk->active && walk->nframes > 0) {
+      raw->buf[raw->len] = walk->nframes;
+      raw->len += 1 + 2 * walk->nframes;
+      raw->stacks += 1;
+    }
+    statuses[i] = walk->status;
+  }
+
+  free(arena);
+  free(walks);
+  free(reads);
+  return PHPSPY_OK;
+}
+
+static void raw_walk_add_projection(raw_walk_t *walk, trace_uring_read_t *reads,
+                                    int *nreads, const char *what, void *raddr,
+                                    void *laddr,
+                                    const trace_projection_t *proj) {
+  int i;
+  trace_uring_read_t *read;
+
+  walk->reads = *nreads;
+  walk->nreads = proj->len;
+  walk->what = what;
+  for (i = 0; i < proj->len; i++) {
+    read = &reads[(*nreads)++];
+    read->local.iov_base = (char *)laddr + proj->spans[i].offset;
+    read->local.iov_len = proj->spans[i].size;
+    read->raddr = (uintptr_t)raddr + proj->spans[i].offset;
+    read->fd = walk->context->target.mem_fd;
+  }
+}
+
+/* Records frames until one is outside the window, which is then asked for
+ * and recorded at the next level */
+static void raw_walk_advance(raw_walk_t *walk, trace_uring_read_t *reads,
+                             int *nreads) {
+  char *raddr;
+  vm_stack_window_t *window = &walk->window;
+  trace_raw_t *raw = &walk->context->raw;
+  uint64_t *stack = raw->buf + raw->len;
+
+  while (walk->next != NULL && walk->nframes != MAX_STACK_DEPTH) {
+    raddr = (char *)walk->next;
+    if (walk->have_next) {
+      walk->have_next = 0;
+    } else if (raddr >= window->raddr &&
+               raddr + sizeof(zend_execute_data) <=
+                   window->raddr + window->len) {
+      memcpy(&walk->execute_data, window->buf + (raddr - window->raddr),
+             sizeof(zend_execute_data));
+    } else {
+      walk->context->stats.frame_reads += 1;
+      raw_walk_add_projection(walk, reads, nreads, "execute_data", raddr,
+                              &walk->execute_data, &execute_data_proj);
+      walk->have_next = 1;
+      return;
+    }
+    stack[1 + 2 * walk->nframes] = (uintptr_t)walk->execute_data.func;
+    stack[2 + 2 * walk->nframes] = (uintptr_t)walk->execute_data.opline;
+    walk->nframes += 1;
+    walk->next = walk->execute_data.prev_execute_data;
+  }
+}
+
+static int raw_walk_failed(raw_walk_t *walk, trace_uring_read_t *read) {
+  if (read->res == 0 || read->res == -ESRCH ||
+      (kill(walk->context->target.pid, 0) == -1 && errno == ESRCH)) {
+    return PHPSPY_ERR | PHPSPY_ERR_PID_DEAD;
+  }
+  log_error("do_trace_raw_many: Failed to copy %s; err=%s raddr=%p "
+            "size=%lu\n",
+            walk->what, read->res < 0 ? strerror(-read->res) : "partial read",
+            (void *)(uintptr_t)read->raddr, read->local.iov_len);
+  return PHPSPY_ERR;
+}
+
+/* Reads what the walks asked for at this level. A walk stops at a read
+ * that fails, unless it was not required and the target is alive. If the
+ * ring itself fails the walks are started over on their own */
+static void raw_walks_read(raw_walk_t *walks, int n, trace_uring_t *ring,
+                           trace_uring_read_t *reads, int nreads,
+                           int required) {
+  int i, j, rv;
+  raw_walk_t *walk;
+
+  if (nreads < 1) {
+    return;
+  }
+  if (uring_read(ring, reads, nreads) != PHPSPY_OK) {
+    for (i = 0; i < n; i++) {
+      walk = &walks[i];
+      if (!walk->active) continue;
+      walk->active = 0;
+      walk->context->stats.samples -= 1;
+      walk->status = do_trace_raw(walk->context);
+    }
+    return;
+  }
+  for (i = 0; i < n; i++) {
+    walk = &walks[i];
+    for (j = walk->reads; walk->active && j < walk->reads + walk->nreads;
+         j++) {
+      if (reads[j].res == (int)reads[j].local.iov_len) continue;
+      rv = raw_walk_failed(walk, &reads[j]);
+      if (!required && (rv & PHPSPY_ERR_PID_DEAD) == 0) {
+        walk->window.len = 0;
+        break;
+      }
+      walk->status = rv;
+      walk->active = 0;
+    }
+    walk->nreads = 0;
+  }
+}
+
+static int raw_reserve(trace_raw_t *raw, uint32_t words) {
+  uint32_t cap;
+  uint64_t *buf;
+
+  if (raw->len + words <= raw->cap) {
+    return PHPSPY_OK;
+  }
+  cap = PHPSPY_MAX(raw->cap * 2, 4096);
+  while (cap < raw->len + words) cap *= 2;
+  if (cap > PHPSPY_RAW_SIZE ||
+      (buf = realloc(raw->buf, cap * sizeof(uint64_t))) == NULL) {
+    return PHPSPY_ERR;
+  }
+  raw->buf = buf;
+  raw->cap = cap;
+  return PHPSPY_OK;
+}
+
+static int func_ptr_cmp(const void *a, const void *b) {
+  uintptr_t x = (uintptr_t)(*(zend_function *const *)a);
+  uintptr_t y = (uintptr_t)(*(zend_function *const *)b);
+  return x < y ? -1 : x > y;
+}
+
+/* Resolves functions a batch at a time. A batch that cannot be read as a
+ * whole, say because one of them was freed since it was sampled, is retried
+ * one by one and what still fails becomes <unknown> */
+static int resolve_funcs_batched(trace_context_t *context,
+                                 zend_function **rfuncs, int nfuncs,
+                                 trace_loc_t *locs, op_span_t *spans) {
+  int rv, i, j, n;
+
+  for (i = 0; i < nfuncs; i += MAX_STACK_DEPTH) {
+    n = PHPSPY_MIN(nfuncs - i, MAX_STACK_DEPTH);
+    rv = resolve_funcs(context, rfuncs + i, n, locs + i, spans + i);
+    if ((rv & PHPSPY_ERR_PID_DEAD) != 0) {
+      return rv;
+    }
+    for (j = 0; rv != PHPSPY_OK && j < n; j++) {
+      if (resolve_funcs(context, rfuncs + i + j, 1, locs + i + j,
+                        spans + i + j) == PHPSPY_OK) {
+        continue;
+      }
+      try
+        (rv, resolve_unknown(context, &locs[i + j]));
+    }
+  }
+  return PHPSPY_OK;
+}
+
+static int resolve_unknown(trace_context_t *context, trace_loc_t *loc) {
   int rv;
+  loc->class_name = 0;
+  loc->lineno = -1;
+  try_strings_intern("<unknown>", sizeof("<unknown>") - 1, &loc->func);
+  try_strings_intern("<internal>", sizeof("<internal>") - 1, &loc->file);
+  return PHPSPY_OK;
+}
+
+int trace_raw_resolve(trace_context_t *context,
+                      int (*on_stack)(trace_context_t *context, void *udata),
+                      void *udata) {
+  int rv = PHPSPY_OK, i, nfuncs, nframes;
+  uint32_t pos, n;
+  zend_function **rfuncs, **found;
+  zend_function *stack_funcs[MAX_STACK_DEPTH];
+  const zend_op *stack_oplines[MAX_STACK_DEPTH];
+  trace_loc_t *locs, stack_locs[MAX_STACK_DEPTH];
+  op_span_t *spans, *span;
+  uint64_t *stack;
+  trace_raw_t *raw = &context->raw;
+  trace_frame_t *frame = &context->event.frame;
+
+  if (raw->stacks < 1) {
+    return PHPSPY_OK;
+  }
+  if (context->strings.len > PHPSPY_STRINGS_MAX) {
+    func_cache_clear(context);
+    strings_clear(&context->strings);
+  }
+
+  /* Each distinct function is resolved once, however often it was seen */
+  n = raw->len - raw->stacks;
+  rfuncs = malloc(n / 2 * sizeof(zend_function *));
+  locs = malloc(n / 2 * sizeof(trace_loc_t));
+  spans = malloc(n / 2 * sizeof(op_span_t));
+  if (rfuncs == NULL || locs == NULL || spans == NULL) {
+    rv = PHPSPY_ERR;
+  }
+  nfuncs = 0;
+  for (pos = 0; rv == PHPSPY_OK && pos < raw->len; pos += 1 + 2 * nframes) {
+    nframes = raw->buf[pos];
+    for (i = 0; i < nframes; i++) {
+      rfuncs[nfuncs++] = (zend_function *)(uintptr_t)raw->buf[pos + 1 + 2 * i];
+    }
+  }
+  if (rv == PHPSPY_OK) {
+    qsort(rfuncs, nfuncs, sizeof(zend_function *), func_ptr_cmp);
+    for (i = 0, n = 0; i < nfuncs; i++) {
+      if (n == 0 || rfuncs[n - 1] != rfuncs[i]) rfuncs[n++] = rfuncs[i];
+    }
+    nfuncs = n;
+    rv = resolve_funcs_batched(context, rfuncs, nfuncs, locs, spans);
+  }
+
+  for (pos = 0; rv == PHPSPY_OK && pos < raw->len; pos += 1 + 2 * nframes) {
+    stack = raw->buf + pos;
+    nframes = stack[0];
+    for (i = 0; i < nframes; i++) {
+      stack_funcs[i] = (zend_function *)(uintptr_t)stack[1 + 2 * i];
+      stack_oplines[i] = (const zend_op *)(uintptr_t)stack[2 + 2 * i];
+      found = bsearch(&stack_funcs[i], rfuncs, nfuncs, sizeof(zend_function *),
+                      func_ptr_cmp);
+      stack_locs[i] = locs[found - rfuncs];
+      span = &spans[found - rfuncs];
+      if (stack_locs[i].lineno != -1 &&
+          (stack_oplines[i] < span->opcodes ||
+           stack_oplines[i] >= span->opcodes + span->last)) {
+        rv = resolve_unknown(context, &stack_locs[i]);
+      }
+    }
+    if (opt_opline_lineno) {
+      rv = resolve_linenos(context, stack_funcs, stack_oplines, nframes,
+                           stack_locs);
+    }
+    for (i = 0; rv == PHPSPY_OK && i < nframes; i++) {
+      memcpy(&frame->loc, &stack_locs[i], sizeof(frame->loc));
+      frame->depth = i;
+      rv = context->event_handler(context, PHPSPY_TRACE_EVENT_FRAME);
+    }
+    if (rv == PHPSPY_OK) {
+      rv = on_stack(context, udata);
+    }
+  }
+
+  free(rfuncs);
+  free(locs);
+  free(spans);
+  raw->len = 0;
+  raw->stacks = 0;
+  return rv;
+}
+
+static int trace_stack(trace_context_t *context,
+                       zend_executor_globals *executor_globals, int *depth) {
+  int rv, i, k, nframes, nspliced;
+  zend_execute_data *remote_execute_data;
   zend_execute_data execute_data;
-  zend_function zfunc;
-  zend_string zstring;
-  zend_class_entry zce;
-  zend_op zop;
+  vm_stack_window_t window;
+  char window_buf[PHPSPY_VM_STACK_WINDOW_SIZE];
+  zend_function *rfuncs[MAX_STACK_DEPTH];
+  const zend_op *oplines[MAX_STACK_DEPTH];
+  trace_loc_t locs[MAX_STACK_DEPTH];
   trace_frame_t *frame;
+  trace_last_stack_t *last;
+  trace_last_frame_t walked[MAX_STACK_DEPTH];
 
   frame = &context->event.frame;
   *depth = 0;
 
-  while (remote_execute_data && *depth != MAX_STACK_DEPTH) {
-    memset(&execute_data, 0, sizeof(execute_data));
-    memset(&zfunc, 0, sizeof(zfunc));
-    memset(&zstring, 0, sizeof(zstring));
-    memset(&zce, 0, sizeof(zce));
-    memset(&zop, 0, sizeof(zop));
-
-    /* TODO reduce number of copy calls */
-    try_copy_proc_mem("execute_data", remote_execute_data, &execute_data,
-                      sizeof(execute_data));
-    try_copy_proc_mem("zfunc", execute_data.func, &zfunc, sizeof(zfunc));
-    if (zfunc.common.function_name) {
+  if (context->strings.len > PHPSPY_STRINGS_MAX) {
+    /* Cached locs refer to interned strings, so both start over */
+    func_cache_clear(context);
+    strings_clear(&context->strings);
+  }
+
+  /* The frames walked are kept for the next sample to compare against; if
+   * there is no room for them every sample is simply walked */
+  last = context->last_stack;
+  if (last == NULL &&
+      (last = context->last_stack = calloc(1, sizeof(trace_last_stack_t))) !=
+          NULL) {
+    last->generation = context->strings.generation;
+  }
+  if (last != NULL && last->generation != context->strings.generation) {
+    last->depth = 0;
+    last->valid_from = 0;
+  }
+
+  window.buf = window_buf;
+  try
+    (rv, copy_vm_stack(context, executor_globals, &window));
+
+  /* The execute_data chain is inherently serial, everything else is read
+   * breadth-first: one batched copy per level of pointer indirection. Once
+   * the walk reaches a frame of the last stack that was found unchanged, the
+   * rest of that stack is spliced in instead of being walked again */
+  nframes = 0;
+  nspliced = 0;
+  remote_execute_data = executor_globals->current_execute_data;
+  while (remote_execute_data && nframes != MAX_STACK_DEPTH) {
+    if ((k = last_stack_find(last, remote_execute_data)) >= 0) {
+      nspliced = PHPSPY_MIN(last->depth - k, MAX_STACK_DEPTH - nframes);
+      memcpy(&walked[nframes], &last->frames[k],
+             nspliced * sizeof(trace_last_frame_t));
+      break;
+    }
+    try
+      (rv, copy_execute_data(context, &window, remote_execute_data,
+                             &execute_data));
+    walked[nframes].raddr = remote_execute_data;
+    walked[nframes].prev = execute_data.prev_execute_data;
+    walked[nframes].func = execute_data.func;
+    walked[nframes].opline = execute_data.opline;
+    rfuncs[nframes++] = execute_data.func;
+    remote_execute_data = execute_data.prev_execute_data;
+  }
+
+  try
+    (rv, resolve_funcs(context, rfuncs, nframes, locs, NULL));
+  if (opt_opline_lineno) {
+    for (i = 0; i < nframes; i++) {
+      oplines[i] = walked[i].opline;
+    }
+    try
+      (rv, resolve_linenos(context, rfuncs, oplines, nframes, locs));
+  }
+
+  for (i = 0; i < nframes; i++) {
+    walked[i].loc = locs[i];
+  }
+  if (nspliced > 0) {
+    context->stats.spliced += 1;
+  }
+  nframes += nspliced;
+  if (last != NULL) {
+    memcpy(last->frames, walked, nframes * sizeof(trace_last_frame_t));
+    last->depth = nframes;
+    last->valid_from = nframes;
+    last->generation = context->strings.generation;
+  }
+  for (i = 0; i < nframes; i++) {
+    locs[i] = walked[i].loc;
+  }
+
+  for (i = 0; i < nframes; i++) {
+    memcpy(&frame->loc, &locs[i], sizeof(frame->loc));
+    frame->depth = *depth;
+    try
+      (rv, context->event_handler(context, PHPSPY_TRACE_EVENT_FRAME));
+    *depth += 1;
+  }
+
+  return PHPSPY_OK;
+}
+
+/* Index of the frame at raddr among the frames of the last stack that were
+ * found unchanged, -1 if it is not one of them */
+static int last_stack_find(trace_last_stack_t *last,
+                           zend_execute_data *raddr) {
+  int i;
+  if (last == NULL) {
+    return -1;
+  }
+  for (i = last->valid_from; i < last->depth; i++) {
+    if (last->frames[i].raddr == raddr) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static int emit_last_stack(trace_context_t *context, int *depth) {
+  int rv, i;
+  trace_frame_t *frame = &context->event.frame;
+  trace_last_stack_t *last = context->last_stack;
+
+  *depth = 0;
+  for (i = 0; i < last->depth; i++) {
+    memcpy(&frame->loc, &last->frames[i].loc, sizeof(frame->loc));
+    frame->depth = *depth;
+    try
+      (rv, context->event_handler(context, PHPSPY_TRACE_EVENT_FRAME));
+    *depth += 1;
+  }
+  return PHPSPY_OK;
+}
+
+/* Reads the frame at raddr, from the vm stack window when it is in there */
+static int copy_execute_data(trace_context_t *context,
+                             vm_stack_window_t *window,
+                             zend_execute_data *remote_execute_data,
+                             zend_execute_data *execute_data) {
+  int rv;
+  trace_read_plan_t plan;
+  char *raddr = (char *)remote_execute_data;
+
+  if (raddr >= window->raddr &&
+      raddr + sizeof(*execute_data) <= window->raddr + window->len) {
+    memcpy(execute_data, window->buf + (raddr - window->raddr),
+           sizeof(*execute_data));
+    return PHPSPY_OK;
+  }
+  context->stats.frame_reads += 1;
+  read_plan_reset(&plan);
+  try_read_plan_add_projection("execute_data", remote_execute_data,
+                               execute_data, &execute_data_proj);
+  try_copy_proc_mem_plan();
+  return PHPSPY_OK;
+}
+
+/* Resolves the locs of up to MAX_STACK_DEPTH functions, reading what the
+ * func cache does not have breadth-first. spans, unless NULL, get the
+ * oplines of user functions as they are now */
+static int resolve_funcs(trace_context_t *context, zend_function **rfuncs,
+                         int nframes, trace_loc_t *locs, op_span_t *spans) {
+  int rv, i;
+  zend_function zfuncs[MAX_STACK_DEPTH];
+  trace_func_cache_t *cached[MAX_STACK_DEPTH];
+  zend_class_entry zces[MAX_STACK_DEPTH];
+  zend_string zfunction_names[MAX_STACK_DEPTH];
+  zend_string zclass_names[MAX_STACK_DEPTH];
+  zend_string zfilenames[MAX_STACK_DEPTH];
+  size_t func_offs[MAX_STACK_DEPTH] = {0}; /* zeroed to keep gcc quiet */
+  size_t file_offs[MAX_STACK_DEPTH] = {0};
+  size_t class_offs[MAX_STACK_DEPTH] = {0};
+  size_t scratch_len;
+  char *scratch;
+  trace_read_plan_t plan;
+
+  read_plan_reset(&plan);
+  for (i = 0; i < nframes; i++) {
+    try_read_plan_add_projection("zfunc", rfuncs[i], &zfuncs[i], &zfunc_proj);
+  }
+  try_copy_proc_mem_plan();
+
+  /* Names of cached functions are reused, everything else is resolved */
+  for (i = 0; i < nframes; i++) {
+    cached[i] = func_cache_find(context, rfuncs[i], &zfuncs[i]);
+    if (spans != NULL) {
+      spans[i].opcodes = zfuncs[i].type == 2 ? zfuncs[i].op_array.opcodes : 0;
+      spans[i].last = zfuncs[i].type == 2 ? zfuncs[i].op_array.last : 0;
+    }
+  }
+
+  read_plan_reset(&plan);
+  for (i = 0; i < nframes; i++) {
+    if (cached[i]) continue;
+    if (zfuncs[i].common.scope) {
+      try_read_plan_add_projection("zce", zfuncs[i].common.scope, &zces[i],
+                                   &zce_proj);
+    }
+    if (zfuncs[i].common.function_name) {
+      try_read_plan_add_projection("function_name",
+                                   zfuncs[i].common.function_name,
+                                   &zfunction_names[i], &zstring_proj);
+    }
+    if (zfuncs[i].type == 2 && zfuncs[i].op_array.filename != NULL) {
+      try_read_plan_add_projection("filename", zfuncs[i].op_array.filename,
+                                   &zfilenames[i], &zstring_proj);
+    }
+  }
+  try_copy_proc_mem_plan();
+
+  /* Name bodies are copied into scratch space and interned from there */
+  scratch_len = 0;
+  for (i = 0; i < nframes; i++) {
+    if (cached[i]) continue;
+    if (zfuncs[i].common.function_name) {
+      func_offs[i] = scratch_len;
+      scratch_len += zstring_len(&zfunction_names[i]);
+    }
+    if (zfuncs[i].type == 2 && zfuncs[i].op_array.filename != NULL) {
+      file_offs[i] = scratch_len;
+      scratch_len += zstring_len(&zfilenames[i]);
+    }
+  }
+  try
+    (rv, strings_scratch(&context->strings, scratch_len, &scratch));
+
+  read_plan_reset(&plan);
+  for (i = 0; i < nframes; i++) {
+    if (cached[i]) continue;
+    if (zfuncs[i].common.scope) {
+      try_read_plan_add_projection("class_name", zces[i].name,
+                                   &zclass_names[i], &zstring_proj);
+    }
+    if (zfuncs[i].common.function_name) {
       try
-        (rv, sprint_zstring(context, "function_name",
-                            zfunc.common.function_name, frame->loc.func,
-                            sizeof(frame->loc.func), &frame->loc.func_len));
-    } else {
-      frame->loc.func_len =
-          snprintf(frame->loc.func, sizeof(frame->loc.func), "<main>");
+        (rv, plan_zstring_body(&plan, "function_name",
+                               zfuncs[i].common.function_name,
+                               &zfunction_names[i], scratch + func_offs[i]));
     }
-    if (zfunc.common.scope) {
-      try_copy_proc_mem("zce", zfunc.common.scope, &zce, sizeof(zce));
+    if (zfuncs[i].type == 2 && zfuncs[i].op_array.filename != NULL) {
       try
-        (rv,
-         sprint_zstring(context, "class_name", zce.name, frame->loc.class_name,
-                        sizeof(frame->loc.class_name), &frame->loc.class_len));
+        (rv, plan_zstring_body(&plan, "filename", zfuncs[i].op_array.filename,
+                               &zfilenames[i], scratch + file_offs[i]));
+    }
+  }
+  try_copy_proc_mem_plan();
+
+  for (i = 0; i < nframes; i++) {
+    trace_loc_t *loc = &locs[i];
+    if (cached[i]) continue;
+    if (zfuncs[i].common.function_name) {
+      try_strings_intern(scratch + func_offs[i],
+                         zstring_len(&zfunction_names[i]), &loc->func);
     } else {
-      frame->loc.class_name[0] = '\0';
-      frame->loc.class_len = 0;
+      try_strings_intern("<main>", sizeof("<main>") - 1, &loc->func);
     }
-    if (zfunc.type == 2 && zfunc.op_array.filename != NULL) {
-      try
-        (rv, sprint_zstring(context, "filename", zfunc.op_array.filename,
-                            frame->loc.file, sizeof(frame->loc.file),
-                            &frame->loc.file_len));
-      frame->loc.lineno = zfunc.op_array.line_start;
-      /* TODO add comments */
+    if (zfuncs[i].type == 2 && zfuncs[i].op_array.filename != NULL) {
+      try_strings_intern(scratch + file_offs[i], zstring_len(&zfilenames[i]),
+                         &loc->file);
+      loc->lineno = zfuncs[i].op_array.line_start;
     } else {
-      frame->loc.file_len =
-          snprintf(frame->loc.file, sizeof(frame->loc.file), "<internal>");
-      frame->loc.lineno = -1;
+      try_strings_intern("<internal>", sizeof("<internal>") - 1, &loc->file);
+      loc->lineno = -1;
+    }
+  }
+
+  scratch_len = 0;
+  for (i = 0; i < nframes; i++) {
+    if (cached[i]) continue;
+    if (zfuncs[i].common.scope) {
+      class_offs[i] = scratch_len;
+      scratch_len += zstring_len(&zclass_names[i]);
+    }
+  }
+  try
+    (rv, strings_scratch(&context->strings, scratch_len, &scratch));
+
+  read_plan_reset(&plan);
+  for (i = 0; i < nframes; i++) {
+    if (cached[i]) continue;
+    if (zfuncs[i].common.scope) {
+      try
+        (rv, plan_zstring_body(&plan, "class_name", zces[i].name,
+                               &zclass_names[i], scratch + class_offs[i]));
+    }
+  }
+  try_copy_proc_mem_plan();
+
+  for (i = 0; i < nframes; i++) {
+    trace_loc_t *loc = &locs[i];
+    if (cached[i]) continue;
+    loc->class_name = 0;
+    if (zfuncs[i].common.scope) {
+      try_strings_intern(scratch + class_offs[i], zstring_len(&zclass_names[i]),
+                         &loc->class_name);
+    }
+  }
+
+  /* Storing may evict entries, so every cached loc is copied out first */
+  for (i = 0; i < nframes; i++) {
+    if (cached[i]) {
+      memcpy(&locs[i], &cached[i]->loc, sizeof(locs[i]));
+    }
+  }
+  for (i = 0; i < nframes; i++) {
+    if (!cached[i]) {
+      func_cache_store(context, rfuncs[i], &zfuncs[i], &locs[i], rfuncs,
+                       nframes);
+    }
+  }
+
+  return PHPSPY_OK;
+}
+
+static trace_lineno_t *lineno_entry(trace_context_t *context,
+                                    zend_function *rfunc,
+                                    const zend_op *opline) {
+  uint64_t key = (uintptr_t)rfunc ^ ((uintptr_t)opline * 0x9e3779b97f4a7c15ull);
+  return &context->linenos[(key >> 32) & (PHPSPY_LINENO_CACHE_SIZE - 1)];
+}
+
+/* Replaces the declaration line of user functions with the line of the
+ * opline they are executing. Lines are cached per function and opline, so
+ * each opline is read once and every miss of a stack in the same batch */
+static int resolve_linenos(trace_context_t *context, zend_function **rfuncs,
+                           const zend_op **oplines, int nframes,
+                           trace_loc_t *locs) {
+  int rv, i, nmisses;
+  int misses[MAX_STACK_DEPTH];
+  uint32_t linenos[MAX_STACK_DEPTH];
+  trace_lineno_t *entry;
+  trace_read_plan_t plan;
+
+  if (context->linenos == NULL &&
+      (context->linenos = calloc(PHPSPY_LINENO_CACHE_SIZE,
+                                 sizeof(trace_lineno_t))) == NULL) {
+    return PHPSPY_OK; /* declaration lines it is */
+  }
+
+  nmisses = 0;
+  read_plan_reset(&plan);
+  for (i = 0; i < nframes; i++) {
+    if (locs[i].lineno == -1 || oplines[i] == NULL) continue;
+    entry = lineno_entry(context, rfuncs[i], oplines[i]);
+    if (entry->func == rfuncs[i] && entry->opline == oplines[i]) {
+      locs[i].lineno = entry->lineno;
+      continue;
     }
-    frame->depth = *depth;
     try
-      (rv, context->event_handler(context, PHPSPY_TRACE_EVENT_FRAME));
-    remote_execute_data = execute_data.prev_execute_data;
-    *depth += 1;
+      (rv, read_plan_add(&plan, "opline",
+                         (char *)oplines[i] + offsetof(zend_op, lineno),
+                         &linenos[nmisses], sizeof(uint32_t)));
+    misses[nmisses++] = i;
+  }
+  if (nmisses < 1) {
+    return PHPSPY_OK;
   }
 
+  /* An opline that cannot be read leaves the declaration lines in place */
+  rv = copy_proc_mem_plan(&context->target, &plan);
+  if (rv != PHPSPY_OK) {
+    return rv & PHPSPY_ERR_PID_DEAD ? rv : PHPSPY_OK;
+  }
+  context->stats.lineno_reads += nmisses;
+  for (i = 0; i < nmisses; i++) {
+    entry = lineno_entry(context, rfuncs[misses[i]], oplines[misses[i]]);
+    entry->func = rfuncs[misses[i]];
+    entry->opline = oplines[misses[i]];
+    entry->lineno = linenos[i];
+    locs[misses[i]].lineno = linenos[i];
+  }
   return PHPSPY_OK;
 }
 
-static int copy_executor_globals(trace_context_t *context,
-                                 zend_executor_globals *executor_globals) {
+static size_t zstring_len(zend_string *lzstring) {
+  return PHPSPY_MIN(lzstring->len, PHPSPY_STR_MAX);
+}
+
+static int plan_zstring_body(trace_read_plan_t *plan, const char *what,
+                             zend_string *rzstring, zend_string *lzstring,
+                             char *buf) {
+  if (zstring_len(lzstring) < 1) {
+    return PHPSPY_OK;
+  }
+  return read_plan_add(plan, what,
+                       ((char *)rzstring) + offsetof(zend_string, val), buf,
+                       zstring_len(lzstring));
+}
+
+static void func_sig_init(trace_func_sig_t *sig, zend_function *lfunc) {
+  memset(sig, 0, sizeof(*sig));
+  sig->function_name = lfunc->common.function_name;
+  sig->scope = lfunc->common.scope;
+  sig->type = lfunc->type;
+  if (lfunc->type == 2) {
+    sig->filename = lfunc->op_array.filename;
+    sig->line_start = lfunc->op_array.line_start;
+    sig->line_end = lfunc->op_array.line_end;
+  }
+}
+
+static trace_func_cache_t *func_cache_find(trace_context_t *context,
+                                           zend_function *rfunc,
+                                           zend_function *lfunc) {
+  trace_func_cache_t *entry;
+  trace_func_sig_t sig;
+
+  HASH_FIND_PTR(context->func_cache, &rfunc, entry);
+  if (entry == NULL) {
+    return NULL;
+  }
+
+  /* The zend_function is re-read every sample anyway. If it no longer
+   * matches what the names were resolved from (e.g. after an opcache reset
+   * reused the address) the entry is stale and gets re-resolved */
+  func_sig_init(&sig, lfunc);
+  if (memcmp(&sig, &entry->sig, sizeof(sig)) != 0) {
+    return NULL;
+  }
+  return entry;
+}
+
+/* When full the oldest entry makes room, unless a function of the batch
+ * being resolved (keep) uses it: those are hot whatever their age */
+static void func_cache_store(trace_context_t *context, zend_function *rfunc,
+                             zend_function *lfunc, trace_loc_t *loc,
+                             zend_function **keep, int nkeep) {
+  int i;
+  trace_func_cache_t *entry, *evict;
+
+  HASH_FIND_PTR(context->func_cache, &rfunc, entry);
+  if (entry == NULL) {
+    if (HASH_COUNT(context->func_cache) >= PHPSPY_FUNC_CACHE_SIZE) {
+      for (evict = context->func_cache; evict != NULL;
+           evict = (trace_func_cache_t *)evict->hh.next) {
+        for (i = 0; i < nkeep && keep[i] != evict->raddr; i++);
+        if (i == nkeep) break;
+      }
+      if (evict == NULL) {
+        return;
+      }
+      HASH_DEL(context->func_cache, evict);
+      free(evict);
+    }
+    if ((entry = malloc(sizeof(trace_func_cache_t))) == NULL) {
+      return;
+    }
+    entry->raddr = rfunc;
+    HASH_ADD_PTR(context->func_cache, raddr, entry);
+  } else if (context->linenos != NULL) {
+    /* A stale function was replaced, its oplines may be another's now */
+    memset(context->linenos, 0,
+           PHPSPY_LINENO_CACHE_SIZE * sizeof(trace_lineno_t));
+  }
+  func_sig_init(&entry->sig, lfunc);
+  memcpy(&entry->loc, loc, sizeof(entry->loc));
+}
+
+void func_cache_clear(trace_context_t *context) {
+  trace_func_cache_t *entry, *tmp;
+  HASH_ITER(hh, context->func_cache, entry, tmp) {
+    HASH_DEL(context->func_cache, entry);
+    free(entry);
+  }
+  if (context->linenos != NULL) {
+    memset(context->linenos, 0,
+           PHPSPY_LINENO_CACHE_SIZE * sizeof(trace_lineno_t));
+  }
+}
+
+/* Copies the entries of src into dst, whose strings must be a copy of the
+ * ones of src for the locs to stay valid */
+int func_cache_copy(trace_context_t *dst, trace_context_t *src) {
+  trace_func_cache_t *entry, *tmp, *copy;
+  HASH_ITER(hh, src->func_cache, entry, tmp) {
+    if ((copy = malloc(sizeof(trace_func_cache_t))) == NULL) {
+      log_error("func_cache_copy: Failed to allocate entry\n");
+      return PHPSPY_ERR;
+    }
+    copy->raddr = entry->raddr;
+    memcpy(&copy->sig, &entry->sig, sizeof(copy->sig)); /* padding too */
+    copy->loc = entry->loc;
+    HASH_ADD_PTR(dst->func_cache, raddr, copy);
+  }
+  return PHPSPY_OK;
+}
+
+/* Frames are pushed contiguously onto the current vm_stack chunk, so its
+ * used part holds most of the execute_data chain. The top of it is copied
+ * in one go; frames below the window or in older chunks are read one by
+ * one */
+static int vm_stack_range(zend_executor_globals *executor_globals, char **lo,
+                          char **hi) {
+  *lo = (char *)executor_globals->vm_stack;
+  *hi = (char *)executor_globals->vm_stack_top;
+  if (!opt_vm_stack_slurp || *lo == NULL || *hi <= *lo ||
+      *hi > (char *)executor_globals->vm_stack_end) {
+    return 0;
+  }
+  if ((size_t)(*hi - *lo) > PHPSPY_VM_STACK_WINDOW_SIZE) {
+    *lo = *hi - PHPSPY_VM_STACK_WINDOW_SIZE;
+  }
+  return 1;
+}
+
+static int copy_vm_stack(trace_context_t *context,
+                         zend_executor_globals *executor_globals,
+                         vm_stack_window_t *window) {
   int rv;
+  char *lo, *hi;
+
+  window->raddr = NULL;
+  window->len = 0;
+  if (!vm_stack_range(executor_globals, &lo, &hi)) {
+    return PHPSPY_OK;
+  }
+
+  rv = copy_proc_mem(&context->target, "vm_stack", lo, window->buf,
+                     (size_t)(hi - lo));
+  if (rv != PHPSPY_OK) {
+    return rv & PHPSPY_ERR_PID_DEAD ? rv : PHPSPY_OK;
+  }
+  window->raddr = lo;
+  window->len = (size_t)(hi - lo);
+  return PHPSPY_OK;
+}
+
+/* Reads the executor globals along with, in the same batch, the frames of
+ * the last stack walked. Frames from valid_from down still hold the same
+ * function, opline and caller; if that is all of them and the current frame
+ * is the same, the stack is unchanged */
+static int copy_executor_globals(trace_context_t *context,
+                                 zend_executor_globals *executor_globals,
+                                 trace_last_stack_t *last, int *unchanged) {
+  int rv, i;
+  trace_read_plan_t plan;
+  zend_execute_data frames[MAX_STACK_DEPTH];
+
+  *unchanged = 0;
+  if (last != NULL && last->generation != context->strings.generation) {
+    last->depth = 0;
+  }
+  if (last != NULL) {
+    last->valid_from = last->depth;
+  }
+
   executor_globals->current_execute_data = NULL;
-  try_copy_proc_mem("executor_globals",
-                    (void *)context->target.executor_globals_addr,
-                    executor_globals, sizeof(*executor_globals));
+  read_plan_reset(&plan);
+  try_read_plan_add_projection("executor_globals",
+                               (void *)context->target.executor_globals_addr,
+                               executor_globals, &executor_globals_proj);
+  for (i = 0; last != NULL && i < last->depth; i++) {
+    try_read_plan_add_projection("last_execute_data", last->frames[i].raddr,
+                                 &frames[i], &execute_data_proj);
+  }
+  rv = copy_proc_mem_plan(&context->target, &plan);
+  if (rv != PHPSPY_OK && (rv & PHPSPY_ERR_PID_DEAD) == 0 && last != NULL &&
+      last->depth > 0) {
+    /* The last stack's frames may be unmapped by now */
+    last->depth = 0;
+    last->valid_from = 0;
+    return copy_executor_globals(context, executor_globals, last, unchanged);
+  } else if (rv != PHPSPY_OK) {
+    return rv;
+  }
+
+  if (last == NULL) {
+    return PHPSPY_OK;
+  }
+  for (i = last->depth; i > 0; i--) {
+    if (frames[i - 1].func != last->frames[i - 1].func ||
+        frames[i - 1].opline != last->frames[i - 1].opline ||
+        frames[i - 1].prev_execute_data != last->frames[i - 1].prev) {
+      break;
+    }
+  }
+  last->valid_from = i;
+  *unchanged = last->depth > 0 && last->valid_from == 0 &&
+               executor_globals->current_execute_data == last->frames[0].raddr;
   return PHPSPY_OK;
 }
 
+static void projections_init(void) {
+  projection_init(&executor_globals_proj, executor_globals_fields,
+                  PHPSPY_FIELDS_LEN(executor_globals_fields));
+  projection_init(&execute_data_proj, execute_data_fields,
+                  PHPSPY_FIELDS_LEN(execute_data_fields));
+  projection_init(&zfunc_proj, zfunc_fields, PHPSPY_FIELDS_LEN(zfunc_fields));
+  projection_init(&zce_proj, zce_fields, PHPSPY_FIELDS_LEN(zce_fields));
+  projection_init(&zstring_proj, zstring_fields,
+                  PHPSPY_FIELDS_LEN(zstring_fields));
+}
 static int sprint_zstring(trace_context_t *context, const char *what,
                           zend_string *rzstring, char *buf, size_t buf_size,
                           size_t *buf_len) {
@@ -0,0 +1,172 @@
+#include "phpspy.h"
+
+/* FPM workers are forked from one master after it has loaded php, so the
+ * binary is mapped at the same address in all of them and what initialize
+ * resolves for one worker holds for its siblings. Targets are grouped into
+ * pools by parent pid and binary mapping, and a target joining a pool takes
+ * the pool's addresses, read backend and opcache segment instead of finding
+ * them again */
+
+static trace_pool_t *pool_list = NULL;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static trace_pool_t *pool_find(pid_t ppid, const char *path, uint64_t start);
+static void pool_add_member(trace_pool_t *pool, trace_context_t *context);
+
+int pool_join(trace_context_t *context) {
+  int rv, i, n;
+  pid_t ppid;
+  trace_target_t *target = &context->target;
+  uint64_t start;
+  trace_pool_t *pool;
+  char path[PHPSPY_STR_SIZE];
+
+  if (get_ppid(target->pid, &ppid) != PHPSPY_OK) {
+    return PHPSPY_ERR;
+  }
+
+  /* Pools of one parent normally share a binary, but each one's path is
+   * tried in turn. Mappings are looked up without holding the lock */
+  for (i = 0, pool = NULL; pool == NULL; i++) {
+    path[0] = '\0';
+    n = 0;
+    pthread_mutex_lock(&pool_lock);
+    for (pool = pool_list; pool != NULL; pool = pool->next) {
+      if (pool->ppid == ppid && n++ == i) {
+        strcpy(path, pool->php_bin_path);
+        break;
+      }
+    }
+    pthread_mutex_unlock(&pool_lock);
+    if (path[0] == '\0') {
+      return PHPSPY_ERR;
+    }
+    if (get_php_start_addr(target->pid, path, &start) != 0) {
+      pool = NULL;
+      continue;
+    }
+
+    pthread_mutex_lock(&pool_lock);
+    if ((pool = pool_find(ppid, path, start)) != NULL) {
+      target->executor_globals_addr = pool->executor_globals_addr;
+      target->shm = shm_ref(pool->shm);
+      pool_add_member(pool, context);
+    }
+    pthread_mutex_unlock(&pool_lock);
+  }
+
+  /* Processes exec'd apart, rather than forked from one master, can share
+   * the key when the binary is not position independent. Their opcache
+   * segments differ then, even at one address */
+  rv = PHPSPY_OK;
+  if (target->shm != NULL && !shm_mapped_by(target->shm, target->pid)) {
+    shm_detach(target);
+    rv = opt_opcache_shm ? shm_attach(target) : PHPSPY_OK;
+  }
+  if (rv == PHPSPY_OK) {
+    rv = select_read_backend(target, pool->read_backend);
+  }
+  if (rv != PHPSPY_OK) {
+    pool_leave(context);
+    shm_detach(target);
+  }
+  return rv;
+}
+
+/* Makes what initialize found for target available to its siblings */
+void pool_publish(trace_context_t *context, addr_memo_t *memo) {
+  pid_t ppid;
+  trace_pool_t *pool;
+  trace_target_t *target = &context->target;
+
+  if (get_ppid(target->pid, &ppid) != PHPSPY_OK ||
+      memo->php_start_addr == 0) {
+    return;
+  }
+
+  pthread_mutex_lock(&pool_lock);
+  /* A sibling initialized at the same time may have published first */
+  pool = pool_find(ppid, memo->php_bin_path, memo->php_start_addr);
+  if (pool == NULL && (pool = calloc(1, sizeof(trace_pool_t))) != NULL) {
+    pool->ppid = ppid;
+    strcpy(pool->php_bin_path, memo->php_bin_path);
+    pool->php_start_addr = memo->php_start_addr;
+    pool->executor_globals_addr = target->executor_globals_addr;
+    pool->read_backend = target->read_backend;
+    pool->shm = shm_ref(target->shm);
+    pool->next = pool_list;
+    pool_list = pool;
+  }
+  if (pool != NULL) {
+    pool_add_member(pool, context);
+  }
+  pthread_mutex_unlock(&pool_lock);
+}
+
+void pool_leave(trace_context_t *context) {
+  trace_pool_t **iter, *pool = context->target.pool;
+
+  if (pool == NULL) {
+    return;
+  }
+  context->target.pool = NULL;
+  context->sibling = NULL;
+  context->sibling_pid = 0;
+  pthread_mutex_lock(&pool_lock);
+  if (pool->donor == context) {
+    pool->donor = NULL;
+    pool->donor_pid = 0;
+  }
+  if (--pool->refs == 0) {
+    for (iter = &pool_list; *iter != pool; iter = &(*iter)->next);
+    *iter = pool->next;
+    shm_unref(pool->shm);
+    free(pool);
+  }
+  pthread_mutex_unlock(&pool_lock);
+}
+
+/* The longest running member has the warmest caches, it stays the donor
+ * the others copy from until it leaves */
+static void pool_add_member(trace_pool_t *pool, trace_context_t *context) {
+  context->target.pool = pool;
+  context->sibling = pool->donor;
+  context->sibling_pid = pool->donor_pid;
+  if (pool->donor == NULL) {
+    pool->donor = context;
+    pool->donor_pid = context->target.pid;
+  }
+  pool->refs += 1;
+}
+
+static trace_pool_t *pool_find(pid_t ppid, const char *path, uint64_t start) {
+  trace_pool_t *pool;
+  for (pool = pool_list; pool != NULL; pool = pool->next) {
+    if (pool->ppid == ppid && pool->php_start_addr == start &&
+        strcmp(pool->php_bin_path, path) == 0) {
+      return pool;
+    }
+  }
+  return NULL;
+}
+
+/* The ppid follows the state after the comm, which may itself hold spaces
+ * and parens, so parsing starts at the last ')' */
+int get_ppid(pid_t pid, pid_t *ppid) {
+  FILE *fp;
+  char path[PATH_MAX], line[PHPSPY_STR_SIZE];
+  char *end;
+  int rv = PHPSPY_ERR;
+
+  snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+  if ((fp = fopen(path, "r")) == NULL) {
+    return PHPSPY_ERR;
+  }
+  if (fgets(line, sizeof(line), fp) != NULL &&
+      (end = strrchr(line, ')')) != NULL &&
+      sscanf(end + 1, " %*c %d", ppid) == 1) {
+    rv = PHPSPY_OK;
+  }
+  fclose(fp);
+  return rv;
+}
@@ -0,0 +1,314 @@
+#include "phpspy.h"
+
+/* Encodes a call tree as a pprof profile (perftools.profiles.Profile)
+ * without a protobuf library. Only frames still in the tree are written: a
+ * Location per frame, a Function per name and file, and a Sample per node
+ * with self samples, valued in samples and in wall nanoseconds */
+
+#define PPROF_PROFILE_SAMPLE_TYPE 1
+#define PPROF_PROFILE_SAMPLE 2
+#define PPROF_PROFILE_LOCATION 4
+#define PPROF_PROFILE_FUNCTION 5
+#define PPROF_PROFILE_STRING_TABLE 6
+#define PPROF_PROFILE_TIME_NANOS 9
+#define PPROF_PROFILE_DURATION_NANOS 10
+#define PPROF_PROFILE_PERIOD_TYPE 11
+#define PPROF_PROFILE_PERIOD 12
+
+/* Fixed entries of the string table, tree strings follow them */
+#define PPROF_STR_SAMPLES 1
+#define PPROF_STR_COUNT 2
+#define PPROF_STR_WALL 3
+#define PPROF_STR_NANOSECONDS 4
+#define PPROF_STR_FIXED 5
+
+static const char *pprof_fixed_strings[PPROF_STR_FIXED] = {
+    "", "samples", "count", "wall", "nanoseconds"};
+
+typedef struct pprof_writer_s {
+  char *ptr;
+  int len;
+  int written; /* keeps counting past len, to report the size needed */
+} pprof_writer_t;
+
+/* Maps a key onto dense ids starting at 1, in insertion order */
+typedef struct pprof_map_s {
+  uint64_t *keys;
+  uint32_t *ids; /* 0 marks a free slot */
+  uint32_t cap;
+  uint32_t len;
+} pprof_map_t;
+
+typedef struct pprof_encoder_s {
+  call_tree_t *tree;
+  pprof_map_t strings;       /* tree string id -> index past the fixed ones */
+  pprof_map_t functions;     /* name and file -> function id */
+  pprof_map_t locations;     /* frame id -> location id */
+  uint32_t *string_ids;      /* tree string ids by index */
+  uint32_t *function_frames; /* a frame of each function, by id */
+  uint32_t *location_frames; /* frame of each location, by id */
+} pprof_encoder_t;
+
+static int pprof_map_init(pprof_map_t *map, uint32_t n) {
+  map->len = 0;
+  for (map->cap = 64; map->cap < n * 2; map->cap *= 2);
+  map->keys = calloc(map->cap, sizeof(uint64_t));
+  map->ids = calloc(map->cap, sizeof(uint32_t));
+  return map->keys == NULL || map->ids == NULL ? PHPSPY_ERR : PHPSPY_OK;
+}
+
+static void pprof_map_free(pprof_map_t *map) {
+  free(map->keys);
+  free(map->ids);
+}
+
+/* The map is sized for every possible key up front and never grows */
+static uint32_t pprof_map_put(pprof_map_t *map, uint64_t key, int *added) {
+  uint32_t i = (uint32_t)((key * 0x9e3779b97f4a7c15ull) >> 32);
+  *added = 0;
+  for (;; i++) {
+    i &= map->cap - 1;
+    if (map->ids[i] == 0) {
+      map->keys[i] = key;
+      map->ids[i] = ++map->len;
+      *added = 1;
+      return map->ids[i];
+    } else if (map->keys[i] == key) {
+      return map->ids[i];
+    }
+  }
+}
+
+static int varint_size(uint64_t value) {
+  int size = 1;
+  while (value >= 0x80) {
+    value >>= 7;
+    size++;
+  }
+  return size;
+}
+
+static void write_byte(pprof_writer_t *w, uint8_t byte) {
+  if (w->written < w->len) {
+    w->ptr[w->written] = byte;
+  }
+  w->written++;
+}
+
+static void write_varint(pprof_writer_t *w, uint64_t value) {
+  while (value >= 0x80) {
+    write_byte(w, (uint8_t)(value | 0x80));
+    value >>= 7;
+  }
+  write_byte(w, (uint8_t)value);
+}
+
+static void write_bytes(pprof_writer_t *w, const char *bytes, int len) {
+  if (w->written < w->len) {
+    memcpy(w->ptr + w->written, bytes, PHPSPY_MIN(len, w->len - w->written));
+  }
+  w->written += len;
+}
+
+/* Wire types 0 (varint) and 2 (length delimited) */
+static void write_tag(pprof_writer_t *w, int field, int wire_type) {
+  write_varint(w, ((uint64_t)field << 3) | wire_type);
+}
+
+static int uint_field_size(int field, uint64_t value) {
+  return value == 0 ? 0 : varint_size(field << 3) + varint_size(value);
+}
+
+static void write_uint_field(pprof_writer_t *w, int field, uint64_t value) {
+  if (value != 0) {
+    write_tag(w, field, 0);
+    write_varint(w, value);
+  }
+}
+
+static void write_message_header(pprof_writer_t *w, int field, int size) {
+  write_tag(w, field, 2);
+  write_varint(w, size);
+}
+
+static void write_value_type(pprof_writer_t *w, int field, uint64_t type,
+                             uint64_t unit) {
+  write_message_header(w, field,
+                       uint_field_size(1, type) + uint_field_size(2, unit));
+  write_uint_field(w, 1, type);
+  write_uint_field(w, 2, unit);
+}
+
+static uint32_t string_index(pprof_encoder_t *enc, uint32_t id) {
+  int added;
+  uint32_t index;
+  if (id == 0) {
+    return 0;
+  }
+  index = pprof_map_put(&enc->strings, id, &added);
+  if (added) {
+    enc->string_ids[index - 1] = id;
+  }
+  return index + PPROF_STR_FIXED - 1;
+}
+
+/* Assigns locations, functions and strings to the frames in the tree */
+static void pprof_index(pprof_encoder_t *enc) {
+  uint32_t i, id, frame_id;
+  int added;
+  call_tree_frame_t *frame;
+  call_tree_t *tree = enc->tree;
+
+  for (i = 1; i < tree->nodes_len; i++) {
+    frame_id = tree->nodes[i].frame;
+    id = pprof_map_put(&enc->locations, frame_id, &added);
+    if (!added) continue;
+    enc->location_frames[id] = frame_id;
+
+    frame = &tree->frames[frame_id];
+    id = pprof_map_put(&enc->functions,
+                       ((uint64_t)frame->name << 32) | frame->file, &added);
+    if (!added) continue;
+    enc->function_frames[id] = frame_id;
+    string_index(enc, frame->name);
+    string_index(enc, frame->file);
+  }
+}
+
+static void write_samples(pprof_encoder_t *enc, pprof_writer_t *w,
+                          uint64_t period_ns) {
+  uint32_t i, iter, location;
+  int added, locations_size, values_size;
+  call_tree_node_t *node;
+  call_tree_t *tree = enc->tree;
+
+  for (i = 1; i < tree->nodes_len; i++) {
+    node = &tree->nodes[i];
+    if (node->self == 0) continue;
+
+    /* Locations go from the leaf up, both repeated fields are packed */
+    locations_size = 0;
+    for (iter = i; iter != 0; iter = tree->nodes[iter].parent) {
+      location =
+          pprof_map_put(&enc->locations, tree->nodes[iter].frame, &added);
+      locations_size += varint_size(location);
+    }
+    values_size =
+        varint_size(node->self) + varint_size(node->self * period_ns);
+    write_message_header(w, PPROF_PROFILE_SAMPLE,
+                         1 + varint_size(locations_size) + locations_size + 1 +
+                             varint_size(values_size) + values_size);
+    write_message_header(w, 1, locations_size);
+    for (iter = i; iter != 0; iter = tree->nodes[iter].parent) {
+      write_varint(w, pprof_map_put(&enc->locations, tree->nodes[iter].frame,
+                                    &added));
+    }
+    write_message_header(w, 2, values_size);
+    write_varint(w, node->self);
+    write_varint(w, node->self * period_ns);
+  }
+}
+
+static void write_locations(pprof_encoder_t *enc, pprof_writer_t *w) {
+  uint32_t id, function;
+  int added, line_size;
+  call_tree_frame_t *frame;
+
+  for (id = 1; id <= enc->locations.len; id++) {
+    frame = &enc->tree->frames[enc->location_frames[id]];
+    function = pprof_map_put(&enc->functions,
+                             ((uint64_t)frame->name << 32) | frame->file,
+                             &added);
+    /* Unknown line numbers are -1 here, pprof leaves them out */
+    line_size = uint_field_size(1, function) +
+                uint_field_size(2, PHPSPY_MAX(frame->lineno, 0));
+    write_message_header(w, PPROF_PROFILE_LOCATION,
+                         uint_field_size(1, id) + 1 + varint_size(line_size) +
+                             line_size);
+    write_uint_field(w, 1, id);
+    write_message_header(w, 4, line_size);
+    write_uint_field(w, 1, function);
+    write_uint_field(w, 2, PHPSPY_MAX(frame->lineno, 0));
+  }
+}
+
+static void write_functions(pprof_encoder_t *enc, pprof_writer_t *w) {
+  uint32_t id, name, file;
+  call_tree_frame_t *frame;
+
+  for (id = 1; id <= enc->functions.len; id++) {
+    frame = &enc->tree->frames[enc->function_frames[id]];
+    name = string_index(enc, frame->name);
+    file = string_index(enc, frame->file);
+    write_message_header(w, PPROF_PROFILE_FUNCTION,
+                         uint_field_size(1, id) + uint_field_size(2, name) +
+                             uint_field_size(3, name) +
+                             uint_field_size(4, file));
+    write_uint_field(w, 1, id);
+    write_uint_field(w, 2, name);
+    write_uint_field(w, 3, name);
+    write_uint_field(w, 4, file);
+  }
+}
+
+static void write_strings(pprof_encoder_t *enc, pprof_writer_t *w) {
+  uint32_t i, len;
+
+  for (i = 0; i < PPROF_STR_FIXED; i++) {
+    len = strlen(pprof_fixed_strings[i]);
+    write_message_header(w, PPROF_PROFILE_STRING_TABLE, len);
+    write_bytes(w, pprof_fixed_strings[i], len);
+  }
+  for (i = 0; i < enc->strings.len; i++) {
+    len = strings_len(&enc->tree->strings, enc->string_ids[i]);
+    write_message_header(w, PPROF_PROFILE_STRING_TABLE, len);
+    write_bytes(w, strings_get(&enc->tree->strings, enc->string_ids[i]), len);
+  }
+}
+
+int call_tree_pprof(call_tree_t *tree, uint64_t period_ns, uint64_t now_ns,
+                    char *ptr, int len, int *size) {
+  int rv = PHPSPY_ERR;
+  uint32_t n = PHPSPY_MAX(tree->nodes_len, 1);
+  pprof_encoder_t enc;
+  pprof_writer_t w = {ptr, len, 0};
+
+  memset(&enc, 0, sizeof(enc));
+  enc.tree = tree;
+  if (pprof_map_init(&enc.strings, n * 2) == PHPSPY_OK &&
+      pprof_map_init(&enc.functions, n) == PHPSPY_OK &&
+      pprof_map_init(&enc.locations, n) == PHPSPY_OK &&
+      (enc.string_ids = calloc(n * 2, sizeof(uint32_t))) != NULL &&
+      (enc.function_frames = calloc(n + 1, sizeof(uint32_t))) != NULL &&
+      (enc.location_frames = calloc(n + 1, sizeof(uint32_t))) != NULL) {
+    pprof_index(&enc);
+
+    write_value_type(&w, PPROF_PROFILE_SAMPLE_TYPE, PPROF_STR_SAMPLES,
+                     PPROF_STR_COUNT);
+    write_value_type(&w, PPROF_PROFILE_SAMPLE_TYPE, PPROF_STR_WALL,
+                     PPROF_STR_NANOSECONDS);
+    write_samples(&enc, &w, period_ns);
+    write_locations(&enc, &w);
+    write_functions(&enc, &w);
+    write_strings(&enc, &w);
+    if (tree->nodes_len > 0) {
+      write_uint_field(&w, PPROF_PROFILE_TIME_NANOS, tree->time_ns);
+      write_uint_field(&w, PPROF_PROFILE_DURATION_NANOS,
+                       now_ns > tree->time_ns ? now_ns - tree->time_ns : 0);
+    }
+    write_value_type(&w, PPROF_PROFILE_PERIOD_TYPE, PPROF_STR_WALL,
+                     PPROF_STR_NANOSECONDS);
+    write_uint_field(&w, PPROF_PROFILE_PERIOD, period_ns);
+
+    *size = w.written;
+    rv = w.written > len ? PHPSPY_ERR_BUF_FULL : PHPSPY_OK;
+  }
+
+  pprof_map_free(&enc.strings);
+  pprof_map_free(&enc.functions);
+  pprof_map_free(&enc.locations);
+  free(enc.string_ids);
+  free(enc.function_frames);
+  free(enc.location_frames);
+  return rv;
+}
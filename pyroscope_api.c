@@ -1,60 +1,348 @@
 #include "pyroscope_api.h"
 
+#include <sched.h>
 #include <unistd.h>
 
 #include "phpspy.h"
 #include "pyroscope_api_struct.h"
 
-pyroscope_context_t *first_ctx = NULL;
+/* Contexts indexed by pid in an open-addressing table of (pid, context)
+ * slots, so that probing never touches the contexts themselves. Repeated
+ * phpspy_init calls for one pid chain additional contexts behind the
+ * indexed one, oldest first.
+ *
+ * Snapshots look contexts up without taking pyroscope_registry.lock, which
+ * only serializes writers. Writers fill empty slots in place, retire removed
+ * slots as tombstones and publish a rebuilt table when it fills up, so a
+ * concurrent lookup always sees a consistent table. Retired tables and
+ * contexts are freed once every snapshot that could still see them has
+ * finished, see registry_synchronize */
+#define REGISTRY_TOMBSTONE ((pyroscope_context_t *)1)
+#define REGISTRY_STRIPES 64
 
-pyroscope_context_t *allocate_context() {
-  if (NULL == first_ctx) {
-    first_ctx = calloc(sizeof(pyroscope_context_t), 1);
-    return first_ctx;
+pyroscope_registry_t pyroscope_registry = {NULL, 0,
+                                           PTHREAD_MUTEX_INITIALIZER};
+
+/* Snapshots in flight, counted per epoch parity and spread over cache line
+ * sized stripes so that readers on different threads do not share a line */
+typedef struct registry_readers_s {
+  uint64_t count[2];
+} __attribute__((aligned(64))) registry_readers_t;
+
+static registry_readers_t registry_readers[REGISTRY_STRIPES];
+static unsigned int registry_epoch = 0;
+static unsigned int registry_stripe_next = 0;
+static __thread int registry_stripe = -1;
+
+static unsigned int registry_read_lock(void) {
+  unsigned int parity;
+  if (registry_stripe < 0) {
+    registry_stripe =
+        __atomic_fetch_add(&registry_stripe_next, 1, __ATOMIC_RELAXED) %
+        REGISTRY_STRIPES;
   }
+  parity = __atomic_load_n(&registry_epoch, __ATOMIC_SEQ_CST) & 1;
+  __atomic_fetch_add(&registry_readers[registry_stripe].count[parity], 1,
+                     __ATOMIC_SEQ_CST);
+  return parity;
+}
 
-  pyroscope_context_t *current = first_ctx;
-  while (1) {
-    if (NULL == current->next) {
-      current->next = calloc(sizeof(pyroscope_context_t), 1);
-      return current->next;
-    } else {
-      current = current->next;
+static void registry_read_unlock(unsigned int parity) {
+  __atomic_fetch_sub(&registry_readers[registry_stripe].count[parity], 1,
+                     __ATOMIC_RELEASE);
+}
+
+static void registry_synchronize(void) {
+  int i, flip;
+  uint64_t active;
+  unsigned int epoch = __atomic_load_n(&registry_epoch, __ATOMIC_SEQ_CST);
+
+  /* Move new readers to the other parity, then wait for the old one to
+   * drain. Doing it twice also covers readers that sampled the epoch right
+   * before a flip. Callers hold pyroscope_registry.lock */
+  for (flip = 0; flip < 2; flip++, epoch++) {
+    __atomic_store_n(&registry_epoch, epoch + 1, __ATOMIC_SEQ_CST);
+    do {
+      active = 0;
+      for (i = 0; i < REGISTRY_STRIPES; i++) {
+        active += __atomic_load_n(&registry_readers[i].count[epoch & 1],
+                                  __ATOMIC_SEQ_CST);
+      }
+      if (active > 0) {
+        sched_yield();
+      }
+    } while (active > 0);
+  }
+}
+
+static size_t registry_home(pid_t pid, size_t cap) {
+  return ((uint32_t)pid * 2654435761u) & (cap - 1);
+}
+
+static registry_slot_t *registry_find_slot(registry_table_t *table, pid_t pid,
+                                           pyroscope_context_t **ctx) {
+  size_t i;
+  pyroscope_context_t *iter;
+  if (NULL == table) {
+    return NULL;
+  }
+  i = registry_home(pid, table->cap);
+  while (NULL != (iter = __atomic_load_n(&table->slots[i].ctx,
+                                         __ATOMIC_SEQ_CST))) {
+    if (REGISTRY_TOMBSTONE != iter && table->slots[i].pid == pid) {
+      *ctx = iter;
+      return &table->slots[i];
     }
+    i = (i + 1) & (table->cap - 1);
   }
+  return NULL;
 }
 
-void deallocate_context(pyroscope_context_t *ctx) {
-  if (ctx == first_ctx) {
-    first_ctx = ctx->next;
+static void registry_put(registry_table_t *table, pid_t pid,
+                         pyroscope_context_t *ctx) {
+  size_t i = registry_home(pid, table->cap);
+  while (NULL != table->slots[i].ctx) {
+    i = (i + 1) & (table->cap - 1);
+  }
+  /* The pid must be visible before the slot is */
+  table->slots[i].pid = pid;
+  __atomic_store_n(&table->slots[i].ctx, ctx, __ATOMIC_SEQ_CST);
+  table->used += 1;
+}
+
+static registry_table_t *registry_rebuild(registry_table_t *table,
+                                          size_t len) {
+  size_t i, cap = 16;
+  registry_table_t *rebuilt;
+  pyroscope_context_t *ctx;
+
+  /* Start at most a quarter full, so rebuilds stay amortized O(1) */
+  while (len * 4 > cap) {
+    cap *= 2;
+  }
+  rebuilt = calloc(1, sizeof(registry_table_t) + cap * sizeof(registry_slot_t));
+  if (NULL == rebuilt) {
+    return NULL;
+  }
+  rebuilt->slots = (registry_slot_t *)(rebuilt + 1);
+  rebuilt->cap = cap;
+  for (i = 0; NULL != table && i < table->cap; i++) {
+    ctx = table->slots[i].ctx;
+    if (NULL != ctx && REGISTRY_TOMBSTONE != ctx) {
+      registry_put(rebuilt, table->slots[i].pid, ctx);
+    }
+  }
+  return rebuilt;
+}
+
+static void registry_publish(registry_table_t *table) {
+  registry_table_t *retired = pyroscope_registry.table;
+  __atomic_store_n(&pyroscope_registry.table, table, __ATOMIC_SEQ_CST);
+  if (NULL != retired) {
+    registry_synchronize();
+    free(retired);
+  }
+}
+
+static int registry_insert(pid_t pid, pyroscope_context_t *ctx) {
+  registry_table_t *table = pyroscope_registry.table;
+  if (NULL == table || (table->used + 1) * 2 > table->cap) {
+    /* Full of live or retired slots, rebuild without the tombstones */
+    table = registry_rebuild(table, pyroscope_registry.len + 1);
+    if (NULL == table) {
+      return PHPSPY_ERR;
+    }
+    registry_publish(table);
+  }
+  registry_put(table, pid, ctx);
+  pyroscope_registry.len += 1;
+  return PHPSPY_OK;
+}
+
+static void registry_remove(registry_slot_t *slot) {
+  __atomic_store_n(&slot->ctx, REGISTRY_TOMBSTONE, __ATOMIC_SEQ_CST);
+  pyroscope_registry.len -= 1;
+  if (0 == pyroscope_registry.len) {
+    registry_publish(NULL);
+  }
+}
+
+/* Contexts are carved out of slabs so that worker churn recycles the same
+ * memory instead of fragmenting the heap. Free slots are handed out again
+ * zeroed; at most PHPSPY_CONTEXT_POOL_SLABS entirely free slabs are kept */
+static context_pool_t context_pool = {PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0,
+                                      0};
+
+static void pool_link(context_slab_t *slab) {
+  slab->prev = NULL;
+  slab->next = context_pool.partial;
+  if (NULL != slab->next) {
+    slab->next->prev = slab;
+  }
+  context_pool.partial = slab;
+}
+
+static void pool_unlink(context_slab_t *slab) {
+  if (NULL != slab->prev) {
+    slab->prev->next = slab->next;
   } else {
-    pyroscope_context_t *iter = first_ctx;
-    while (1) {
-      if (iter->next == ctx) {
-        iter->next = ctx->next;
-        break;
-      }
-      iter = iter->next;
+    context_pool.partial = slab->next;
+  }
+  if (NULL != slab->next) {
+    slab->next->prev = slab->prev;
+  }
+}
+
+static pyroscope_context_t *pool_get(void) {
+  int i;
+  context_slab_t *slab;
+  pyroscope_context_t *ctx = NULL;
+
+  pthread_mutex_lock(&context_pool.lock);
+  slab = context_pool.partial;
+  if (NULL == slab && NULL != (slab = calloc(1, sizeof(context_slab_t)))) {
+    for (i = PHPSPY_CONTEXT_SLAB_SIZE - 1; i >= 0; i--) {
+      slab->slots[i].slab = slab;
+      slab->slots[i].next = slab->free;
+      slab->free = &slab->slots[i];
     }
+    pool_link(slab);
+    context_pool.slabs += 1;
+    context_pool.empty += 1;
   }
+  if (NULL != slab) {
+    ctx = slab->free;
+    slab->free = ctx->next;
+    if (0 == slab->used++) {
+      context_pool.empty -= 1;
+    }
+    if (NULL == slab->free) {
+      pool_unlink(slab);
+    }
+    context_pool.used += 1;
+  }
+  pthread_mutex_unlock(&context_pool.lock);
 
-  free(ctx);
+  if (NULL != ctx) {
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->slab = slab;
+  }
+  return ctx;
 }
 
-pyroscope_context_t *find_matching_context(pid_t pid) {
-  pyroscope_context_t *ctx = first_ctx;
+static void pool_put(pyroscope_context_t *ctx) {
+  context_slab_t *slab = ctx->slab;
 
-  while (1) {
-    if (NULL == ctx) {
-      return NULL;
+  pthread_mutex_lock(&context_pool.lock);
+  if (NULL == slab->free) {
+    pool_link(slab);
+  }
+  ctx->next = slab->free;
+  slab->free = ctx;
+  context_pool.used -= 1;
+  if (0 == --slab->used) {
+    if (context_pool.empty >= PHPSPY_CONTEXT_POOL_SLABS) {
+      pool_unlink(slab);
+      context_pool.slabs -= 1;
+      free(slab);
+    } else {
+      context_pool.empty += 1;
     }
+  }
+  pthread_mutex_unlock(&context_pool.lock);
+}
+
+static pyroscope_context_t *new_context(pid_t pid, const char *app_root_dir) {
+  pyroscope_context_t *ctx = pool_get();
+  if (NULL == ctx) {
+    return NULL;
+  }
+  if (NULL == (ctx->app_root_dir = strdup(app_root_dir))) {
+    pool_put(ctx);
+    return NULL;
+  }
+  ctx->pid = pid;
+  ctx->last = ctx;
+  pthread_mutex_init(&ctx->lock, NULL);
+  return ctx;
+}
+
+static void free_context(pyroscope_context_t *ctx) {
+  call_tree_free(&ctx->tree);
+  pthread_mutex_destroy(&ctx->lock);
+  free(ctx->app_root_dir);
+  pool_put(ctx);
+}
+
+static int register_context(pyroscope_context_t *ctx) {
+  int rv = PHPSPY_OK;
+  registry_slot_t *slot;
+  pyroscope_context_t *head = NULL;
+
+  pthread_mutex_lock(&pyroscope_registry.lock);
+  slot = registry_find_slot(pyroscope_registry.table, ctx->pid, &head);
+  if (NULL == slot) {
+    rv = registry_insert(ctx->pid, ctx);
+  } else {
+    head->last->next = ctx;
+    head->last = ctx;
+  }
+  pthread_mutex_unlock(&pyroscope_registry.lock);
+  return rv;
+}
+
+/* Takes ctx out of the registry and waits until no snapshot uses it.
+ * Callers hold pyroscope_registry.lock */
+static void unregister_context(pyroscope_context_t *ctx) {
+  pyroscope_context_t *head = NULL;
+  registry_slot_t *slot =
+      registry_find_slot(pyroscope_registry.table, ctx->pid, &head);
 
-    if (ctx->pid == pid) {
-      return ctx;
+  if (ctx == head) {
+    if (NULL != ctx->next) {
+      ctx->next->last = ctx->last;
+      __atomic_store_n(&slot->ctx, ctx->next, __ATOMIC_SEQ_CST);
     } else {
-      ctx = ctx->next;
+      registry_remove(slot);
     }
+  } else {
+    pyroscope_context_t *iter = head;
+    while (iter->next != ctx) {
+      iter = iter->next;
+    }
+    iter->next = ctx->next;
+    if (head->last == ctx) {
+      head->last = iter;
+    }
+  }
+  registry_synchronize();
+}
+
+pyroscope_context_t *allocate_context(pid_t pid) {
+  pyroscope_context_t *ctx = new_context(pid, "");
+  if (NULL == ctx) {
+    return NULL;
+  }
+  if (register_context(ctx) != PHPSPY_OK) {
+    free_context(ctx);
+    return NULL;
   }
+  return ctx;
+}
+
+void deallocate_context(pyroscope_context_t *ctx) {
+  pthread_mutex_lock(&pyroscope_registry.lock);
+  unregister_context(ctx);
+  pthread_mutex_unlock(&pyroscope_registry.lock);
+  free_context(ctx);
+}
+
+pyroscope_context_t *find_matching_context(pid_t pid) {
+  pyroscope_context_t *ctx = NULL;
+  registry_find_slot(__atomic_load_n(&pyroscope_registry.table,
+                                     __ATOMIC_SEQ_CST),
+                     pid, &ctx);
+  return ctx;
 }
 
 int event_handler(struct trace_context_s *context, int event_type) {
@@ -101,95 +389,715 @@ int formulate_error_msg(int rv, struct trace_context_s *context, char *err_ptr,
 void get_process_cwd(char *app_cwd, pid_t pid) {
   char buf[PATH_MAX];
   snprintf(buf, PATH_MAX, "/proc/%d/cwd", pid);
-  int app_cwd_len = readlink(buf, app_cwd, PATH_MAX);
+  int app_cwd_len = readlink(buf, app_cwd, PATH_MAX - 1);
+
+  app_cwd[app_cwd_len < 0 ? 0 : app_cwd_len] = '\0';
+}
 
-  if (app_cwd_len < 0) {
-    app_cwd[0] = '\0';
+static int render_segment(trace_context_t *context, const char *app_root_dir,
+                          trace_loc_t *loc, uint32_t *text) {
+  int rv, len;
+  size_t size;
+  char *buf;
+  trace_strings_t *strings = &context->strings;
+  const char *file = strings_get(strings, loc->file);
+  const char *class_name = strings_get(strings, loc->class_name);
+  const char *func = strings_get(strings, loc->func);
+
+  if (app_root_dir[0] != '\0') {
+    const int root_path_len = strlen(app_root_dir);
+    if (strncmp(file, app_root_dir, root_path_len) == 0 &&
+        file[root_path_len] != '\0') {
+      file += root_path_len + 1;
+    }
   }
+
+  size = strlen(file) + strings_len(strings, loc->class_name) +
+         strings_len(strings, loc->func) + sizeof(":-2147483648 - ::;");
+  try
+    (rv, strings_scratch(&context->segments.text, size, &buf));
+  if (loc->lineno == -1) {
+    len = snprintf(buf, size, "%s - %s%s%s;", file, class_name,
+                   class_name[0] != '\0' ? "::" : "", func);
+  } else {
+    len = snprintf(buf, size, "%s:%d - %s%s%s;", file, loc->lineno,
+                   class_name, class_name[0] != '\0' ? "::" : "", func);
+  }
+  return strings_intern(&context->segments.text, buf, len, text);
+}
+
+/* Looks up the rendered text of a frame, rendering it on a miss. Locs are
+ * ids into the context's strings, so the cache starts over whenever those
+ * are reset, and whenever it is half full */
+static int frame_segment(trace_context_t *context, const char *app_root_dir,
+                         trace_loc_t *loc, uint32_t *text) {
+  int rv;
+  uint32_t i;
+  trace_segment_t *slot;
+  trace_segments_t *segments = &context->segments;
+
+  if (segments->generation != context->strings.generation ||
+      segments->root != app_root_dir ||
+      segments->len >= PHPSPY_SEGMENT_CACHE_SIZE / 2 ||
+      segments->text.len > PHPSPY_STRINGS_MAX) {
+    segments_clear(segments);
+    segments->generation = context->strings.generation;
+    segments->root = app_root_dir;
+  }
+  if (segments->slots == NULL &&
+      (segments->slots = calloc(PHPSPY_SEGMENT_CACHE_SIZE,
+                                sizeof(trace_segment_t))) == NULL) {
+    return PHPSPY_ERR;
+  }
+
+  for (i = phpspy_hash(loc, sizeof(*loc));; i++) {
+    slot = &segments->slots[i & (PHPSPY_SEGMENT_CACHE_SIZE - 1)];
+    if (slot->text == 0) break;
+    if (memcmp(&slot->loc, loc, sizeof(*loc)) == 0) {
+      *text = slot->text;
+      return PHPSPY_OK;
+    }
+  }
+
+  try
+    (rv, render_segment(context, app_root_dir, loc, text));
+  slot->loc = *loc;
+  slot->text = *text;
+  segments->len += 1;
+  return PHPSPY_OK;
 }
 
 int formulate_output(struct trace_context_s *context, const char *app_root_dir,
                      char *data_ptr, int data_len, void *err_ptr, int err_len) {
-  int written = 0;
+  int written = 0, len;
+  uint32_t text;
   const int nof_frames = context->event.frame.depth;
+  trace_frame_t *frames = (trace_frame_t *)context->event_udata;
 
+  /* Each frame is a memcpy of its cached text */
   for (int current_frame_idx = (nof_frames - 1); current_frame_idx >= 0;
        current_frame_idx--) {
-    trace_frame_t *frames = (trace_frame_t *)context->event_udata;
-    trace_loc_t *loc = &frames[current_frame_idx].loc;
-
-    char *write_cursor = ((char *)data_ptr) + written;
-
-    int file_path_beginning = 0;
-    if (app_root_dir[0] != '\0') {
-      const int root_path_len = strlen(app_root_dir);
-      if (memcmp(loc->file, app_root_dir, root_path_len) == 0) {
-        file_path_beginning = root_path_len + 1;
-      }
+    if (frame_segment(context, app_root_dir, &frames[current_frame_idx].loc,
+                      &text) != PHPSPY_OK) {
+      return formulate_error_msg(PHPSPY_ERR, context, err_ptr, err_len);
     }
-
-    if (loc->lineno == -1) {
-      char out_fmt[] = "%s - %s%s%s;";
-      written += snprintf(write_cursor, data_len, out_fmt,
-                          &loc->file[file_path_beginning], loc->class_name,
-                          loc->class_len ? "::" : "", loc->func);
-    } else {
-      char out_fmt[] = "%s:%d - %s%s%s;";
-      written += snprintf(
-          write_cursor, data_len, out_fmt, &loc->file[file_path_beginning],
-          loc->lineno, loc->class_name, loc->class_len ? "::" : "", loc->func);
-    }
-
-    if (written > data_len) {
+    len = strings_len(&context->segments.text, text);
+    if (written + len > data_len) {
       int err_msg_len =
           snprintf((char *)err_ptr, err_len, "Not enough space! %d > %d",
-                   written, data_len);
+                   written + len, data_len);
       return -err_msg_len;
     }
+    memcpy(data_ptr + written, strings_get(&context->segments.text, text),
+           len);
+    written += len;
+  }
+  if (written < data_len) {
+    data_ptr[written] = '\0';
   }
   return written;
 }
 
+/* A worker joining a pool starts with the names its sibling resolved, so
+ * its first samples cost what later ones do. Failing to copy them only
+ * means resolving them again. The sibling may have been cleaned up since
+ * it was the pool's donor: it is used only if it is still registered, and
+ * so cannot go away before the read lock is released, and still a member
+ * of the pool rather than a new context that took its place */
+static void inherit_sibling(pyroscope_context_t *ctx) {
+  trace_context_t *context = &ctx->phpspy_context;
+  unsigned int parity = registry_read_lock();
+  pyroscope_context_t *sibling = find_matching_context(context->sibling_pid);
+
+  while (NULL != sibling && &sibling->phpspy_context != context->sibling) {
+    sibling = sibling->next;
+  }
+  if (NULL != sibling &&
+      sibling->phpspy_context.target.pool == context->target.pool) {
+    pthread_mutex_lock(&sibling->lock);
+    context_inherit(context, &sibling->phpspy_context);
+    pthread_mutex_unlock(&sibling->lock);
+  }
+  registry_read_unlock(parity);
+}
+
+/* Leaves *out NULL when no context could be allocated, otherwise it holds
+ * the context whether initializing it worked or not */
+static int init_context(pid_t pid, pyroscope_context_t **out, void *err_ptr,
+                        int err_len) {
+  char app_root_dir[PATH_MAX];
+  pyroscope_context_t *pyroscope_context;
+  int rv;
+
+  get_process_cwd(&app_root_dir[0], pid);
+  *out = pyroscope_context = new_context(pid, &app_root_dir[0]);
+  if (NULL == pyroscope_context) {
+    int err_msg_len = snprintf((char *)err_ptr, err_len,
+                               "Failed to allocate context for %d pid", pid);
+    return -err_msg_len;
+  }
+  rv = formulate_error_msg(
+      initialize(pid, &pyroscope_context->phpspy_context,
+                 &pyroscope_context->frames[0], event_handler),
+      &pyroscope_context->phpspy_context, err_ptr, err_len);
+  if (0 == rv && NULL != pyroscope_context->phpspy_context.sibling) {
+    inherit_sibling(pyroscope_context);
+  }
+  return rv;
+}
+
+pyroscope_context_t *attach_context(pid_t pid, void *err_ptr, int err_len) {
+  pyroscope_context_t *ctx;
+
+  if (0 != init_context(pid, &ctx, err_ptr, err_len)) {
+    if (NULL != ctx) {
+      deinitialize(&ctx->phpspy_context);
+      free_context(ctx);
+    }
+    return NULL;
+  }
+  if (register_context(ctx) != PHPSPY_OK) {
+    deinitialize(&ctx->phpspy_context);
+    free_context(ctx);
+    snprintf((char *)err_ptr, err_len, "Failed to allocate context for %d pid",
+             pid);
+    return NULL;
+  }
+  return ctx;
+}
+
+void detach_context(pyroscope_context_t *ctx) {
+  pthread_mutex_lock(&pyroscope_registry.lock);
+  unregister_context(ctx);
+  pthread_mutex_unlock(&pyroscope_registry.lock);
+  deinitialize(&ctx->phpspy_context);
+  free_context(ctx);
+}
+
 int phpspy_init(pid_t pid, void *err_ptr, int err_len) {
-  int rv = 0;
+  pyroscope_context_t *pyroscope_context;
+  int rv = init_context(pid, &pyroscope_context, err_ptr, err_len);
 
-  pyroscope_context_t *pyroscope_context = allocate_context();
-  pyroscope_context->pid = pid;
-  get_process_cwd(&pyroscope_context->app_root_dir[0], pid);
-  try
-    (rv, formulate_error_msg(
-             initialize(pid, &pyroscope_context->phpspy_context,
-                        &pyroscope_context->frames[0], event_handler),
-             &pyroscope_context->phpspy_context, err_ptr, err_len));
+  if (NULL == pyroscope_context) {
+    return rv;
+  }
+
+  /* Publish only once initialized, snapshots may pick it up right away */
+  if (register_context(pyroscope_context) != PHPSPY_OK) {
+    deinitialize(&pyroscope_context->phpspy_context);
+    free_context(pyroscope_context);
+    int err_msg_len = snprintf((char *)err_ptr, err_len,
+                               "Failed to allocate context for %d pid", pid);
+    return -err_msg_len;
+  }
 
   return rv;
 }
 
-int phpspy_snapshot(pid_t pid, void *ptr, int len, void *err_ptr, int err_len) {
+int phpspy_footprint(phpspy_footprint_t *footprint) {
+  size_t i;
+  registry_table_t *table;
+  pyroscope_context_t *ctx;
+
+  memset(footprint, 0, sizeof(*footprint));
+
+  /* Holding the writer lock keeps every context alive while it is looked at,
+   * and the context lock keeps snapshots from growing its buffers */
+  pthread_mutex_lock(&pyroscope_registry.lock);
+  table = pyroscope_registry.table;
+  if (NULL != table) {
+    footprint->bytes +=
+        sizeof(registry_table_t) + table->cap * sizeof(registry_slot_t);
+  }
+  for (i = 0; NULL != table && i < table->cap; i++) {
+    ctx = table->slots[i].ctx;
+    if (NULL == ctx || REGISTRY_TOMBSTONE == ctx) continue;
+    for (; NULL != ctx; ctx = ctx->next) {
+      pthread_mutex_lock(&ctx->lock);
+      footprint->bytes += context_footprint(&ctx->phpspy_context) +
+                          call_tree_footprint(&ctx->tree) +
+                          strlen(ctx->app_root_dir) + 1;
+      pthread_mutex_unlock(&ctx->lock);
+    }
+  }
+  pthread_mutex_unlock(&pyroscope_registry.lock);
+
+  pthread_mutex_lock(&context_pool.lock);
+  footprint->contexts = context_pool.used;
+  footprint->pooled =
+      context_pool.slabs * PHPSPY_CONTEXT_SLAB_SIZE - context_pool.used;
+  footprint->bytes += context_pool.slabs * sizeof(context_slab_t);
+  pthread_mutex_unlock(&context_pool.lock);
+
+  return 0;
+}
+
+static int aggregate_stack(trace_context_t *context, void *udata) {
+  pyroscope_context_t *ctx = (pyroscope_context_t *)udata;
+  return call_tree_add(&ctx->tree, context, ctx->frames,
+                       context->event.frame.depth, ctx->app_root_dir);
+}
+
+/* Names of lazily taken stacks are resolved while the target is still there
+ * to read them from; stacks that cannot be resolved any more are dropped */
+static int aggregate_raw_stacks(pyroscope_context_t *ctx) {
+  return trace_raw_resolve(&ctx->phpspy_context, aggregate_stack, ctx);
+}
+
+static int take_snapshot(pid_t pid, void *ptr, int len, void *err_ptr,
+                         int err_len, int *status, int mode) {
   int rv = 0;
+  unsigned int parity = registry_read_lock();
 
   pyroscope_context_t *pyroscope_context = find_matching_context(pid);
 
   if (NULL == pyroscope_context) {
+    registry_read_unlock(parity);
+    *status = PHPSPY_ERR | PHPSPY_SNAPSHOT_ERR_NOT_INITIALIZED;
     int err_msg_len = snprintf((char *)err_ptr, err_len,
                                "Phpspy not initialized for %d pid", pid);
     return -err_msg_len;
   }
 
-  try
-    (rv,
-     formulate_error_msg(do_trace(&pyroscope_context->phpspy_context),
-                         &pyroscope_context->phpspy_context, err_ptr, err_len));
+  /* Only snapshots of the same pid contend here */
+  pthread_mutex_lock(&pyroscope_context->lock);
+  if (SNAPSHOT_RAW == mode) {
+    *status = do_trace_raw(&pyroscope_context->phpspy_context);
+    if (PHPSPY_ERR_BUF_FULL == *status) {
+      aggregate_raw_stacks(pyroscope_context);
+      *status = do_trace_raw(&pyroscope_context->phpspy_context);
+    }
+  } else {
+    *status = do_trace(&pyroscope_context->phpspy_context);
+  }
+  rv = formulate_error_msg(*status, &pyroscope_context->phpspy_context,
+                           err_ptr, err_len);
+  if (0 == rv && SNAPSHOT_AGGREGATE == mode) {
+    rv = formulate_error_msg(
+        aggregate_stack(&pyroscope_context->phpspy_context, pyroscope_context),
+        &pyroscope_context->phpspy_context, err_ptr, err_len);
+  } else if (0 == rv && SNAPSHOT_FORMAT == mode) {
+    rv = formulate_output(&pyroscope_context->phpspy_context,
+                          pyroscope_context->app_root_dir, ptr, len,
+                          err_ptr, err_len);
+    if (rv < 0) {
+      *status = PHPSPY_ERR | PHPSPY_ERR_BUF_FULL;
+    }
+  }
+  pthread_mutex_unlock(&pyroscope_context->lock);
+  registry_read_unlock(parity);
 
-  int written = formulate_output(&pyroscope_context->phpspy_context,
-                                 &pyroscope_context->app_root_dir[0], ptr, len,
-                                 err_ptr, err_len);
+  return rv;
+}
+
+int phpspy_snapshot(pid_t pid, void *ptr, int len, void *err_ptr, int err_len) {
+  int status;
+  return take_snapshot(pid, ptr, len, err_ptr, err_len, &status,
+                       SNAPSHOT_FORMAT);
+}
+
+int phpspy_snapshot_aggregate(pid_t pid, void *err_ptr, int err_len) {
+  int status;
+  return take_snapshot(pid, NULL, 0, err_ptr, err_len, &status,
+                       SNAPSHOT_AGGREGATE);
+}
+
+int phpspy_snapshot_lazy(pid_t pid, void *err_ptr, int err_len) {
+  int status;
+  return take_snapshot(pid, NULL, 0, err_ptr, err_len, &status, SNAPSHOT_RAW);
+}
+
+static uint64_t clock_ns(clockid_t clock) {
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+lazy_uring_t lazy_uring = {PTHREAD_MUTEX_INITIALIZER, 0, {0}, 0,
+                           {UINT64_MAX, UINT64_MAX}};
+
+/* Reads of /proc/pid/mem are handed to io_uring's worker threads rather
+ * than done inline, which only pays off with cpus to spare. Unless told,
+ * the first batches are timed both ways and the cheaper way is kept.
+ * Callers hold lazy_uring.lock */
+static int lazy_uring_pick(int *probe) {
+  *probe = 0;
+  if (1 != lazy_uring.state) {
+    return 0;
+  } else if (opt_lazy_uring >= 0) {
+    return opt_lazy_uring;
+  } else if (lazy_uring.probes < PHPSPY_URING_PROBES) {
+    *probe = 1;
+    return lazy_uring.probes % 2 == 0;
+  }
+  return lazy_uring.best_ns[1] < lazy_uring.best_ns[0];
+}
+
+static int lazy_entry_cmp(const void *a, const void *b) {
+  uintptr_t x = (uintptr_t)((const lazy_entry_t *)a)->ctx;
+  uintptr_t y = (uintptr_t)((const lazy_entry_t *)b)->ctx;
+  return x < y ? -1 : x > y;
+}
+
+int phpspy_snapshot_lazy_many(const int *pids, int n, int *statuses,
+                              void *err_ptr, int err_len) {
+  int i, j, m, nctxs, use_ring, probe;
+  uint64_t start_ns, elapsed_ns;
+  unsigned int parity;
+  pyroscope_context_t *ctx;
+  lazy_entry_t *entries = malloc(PHPSPY_MAX(n, 1) * sizeof(lazy_entry_t));
+  trace_context_t **contexts =
+      malloc(PHPSPY_MAX(n, 1) * sizeof(trace_context_t *));
+  int *ctx_statuses = malloc(PHPSPY_MAX(n, 1) * sizeof(int));
+
+  if (NULL == entries || NULL == contexts || NULL == ctx_statuses) {
+    free(entries);
+    free(contexts);
+    free(ctx_statuses);
+    int err_msg_len = snprintf((char *)err_ptr, err_len,
+                               "Failed to allocate snapshot buffer");
+    return -err_msg_len;
+  }
+
+  parity = registry_read_lock();
+  m = 0;
+  for (i = 0; i < n; i++) {
+    if (NULL == (ctx = find_matching_context(pids[i]))) {
+      statuses[i] = PHPSPY_ERR | PHPSPY_SNAPSHOT_ERR_NOT_INITIALIZED;
+      continue;
+    }
+    entries[m].ctx = ctx;
+    entries[m++].index = i;
+  }
+
+  /* Contexts are locked in address order, so that batches sharing pids
+   * cannot deadlock. A pid listed twice is sampled once */
+  qsort(entries, m, sizeof(lazy_entry_t), lazy_entry_cmp);
+  nctxs = 0;
+  for (i = 0; i < m; i++) {
+    if (i > 0 && entries[i].ctx == entries[i - 1].ctx) continue;
+    pthread_mutex_lock(&entries[i].ctx->lock);
+    contexts[nctxs++] = &entries[i].ctx->phpspy_context;
+  }
+
+  /* The lock covers the shared ring and its stats, not the plain reads */
+  pthread_mutex_lock(&lazy_uring.lock);
+  if (0 == lazy_uring.state) {
+    lazy_uring.state =
+        uring_init(&lazy_uring.ring, PHPSPY_URING_ENTRIES) == PHPSPY_OK ? 1
+                                                                        : -1;
+  }
+  use_ring = lazy_uring_pick(&probe);
+  if (!use_ring) {
+    pthread_mutex_unlock(&lazy_uring.lock);
+  }
+  start_ns = clock_ns(CLOCK_MONOTONIC);
+  if (use_ring) {
+    do_trace_raw_many(contexts, nctxs, ctx_statuses, &lazy_uring.ring);
+    if (lazy_uring.ring.fd < 0) {
+      lazy_uring.state = -1; /* torn down after failing, see uring_read */
+    }
+    pthread_mutex_unlock(&lazy_uring.lock);
+  } else {
+    for (j = 0; j < nctxs; j++) {
+      ctx_statuses[j] = do_trace_raw(contexts[j]);
+    }
+  }
+  if (probe && nctxs > 0) {
+    elapsed_ns = (clock_ns(CLOCK_MONOTONIC) - start_ns) / nctxs;
+    pthread_mutex_lock(&lazy_uring.lock);
+    lazy_uring.best_ns[use_ring] =
+        PHPSPY_MIN(lazy_uring.best_ns[use_ring], elapsed_ns);
+    lazy_uring.probes += 1;
+    pthread_mutex_unlock(&lazy_uring.lock);
+  }
+
+  /* As in take_snapshot, full buffers are resolved and sampled again */
+  for (i = 0, j = -1; i < m; i++) {
+    if (0 == i || entries[i].ctx != entries[i - 1].ctx) {
+      j += 1;
+      if (PHPSPY_ERR_BUF_FULL == ctx_statuses[j]) {
+        aggregate_raw_stacks(entries[i].ctx);
+        ctx_statuses[j] = do_trace_raw(contexts[j]);
+      }
+      pthread_mutex_unlock(&entries[i].ctx->lock);
+    }
+    statuses[entries[i].index] = ctx_statuses[j];
+  }
+  registry_read_unlock(parity);
+
+  free(entries);
+  free(contexts);
+  free(ctx_statuses);
+  return 0;
+}
+
+int phpspy_flush(pid_t pid, void *ptr, int len, void *err_ptr, int err_len) {
+  int written;
+  unsigned int parity = registry_read_lock();
+
+  pyroscope_context_t *pyroscope_context = find_matching_context(pid);
+
+  if (NULL == pyroscope_context) {
+    registry_read_unlock(parity);
+    int err_msg_len = snprintf((char *)err_ptr, err_len,
+                               "Phpspy not initialized for %d pid", pid);
+    return -err_msg_len;
+  }
+
+  /* Lines that do not fit stay for the next flush */
+  pthread_mutex_lock(&pyroscope_context->lock);
+  aggregate_raw_stacks(pyroscope_context);
+  written = call_tree_collapsed(&pyroscope_context->tree, ptr, len);
+  pthread_mutex_unlock(&pyroscope_context->lock);
+  registry_read_unlock(parity);
 
   return written;
 }
 
+int phpspy_flush_pprof(pid_t pid, void *ptr, int len, uint64_t period_ns,
+                       void *err_ptr, int err_len) {
+  int rv, size = 0;
+  unsigned int parity = registry_read_lock();
+
+  pyroscope_context_t *pyroscope_context = find_matching_context(pid);
+
+  if (NULL == pyroscope_context) {
+    registry_read_unlock(parity);
+    int err_msg_len = snprintf((char *)err_ptr, err_len,
+                               "Phpspy not initialized for %d pid", pid);
+    return -err_msg_len;
+  }
+
+  /* A profile is all or nothing, the tree is kept until one fits */
+  pthread_mutex_lock(&pyroscope_context->lock);
+  aggregate_raw_stacks(pyroscope_context);
+  rv = call_tree_pprof(&pyroscope_context->tree, period_ns,
+                       clock_ns(CLOCK_REALTIME), ptr, len, &size);
+  if (PHPSPY_OK == rv) {
+    call_tree_clear(&pyroscope_context->tree);
+    rv = size;
+  } else if (PHPSPY_ERR_BUF_FULL == rv) {
+    rv = -snprintf((char *)err_ptr, err_len, "Not enough space! %d > %d",
+                   size, len);
+  } else {
+    rv = formulate_error_msg(rv, &pyroscope_context->phpspy_context, err_ptr,
+                             err_len);
+  }
+  pthread_mutex_unlock(&pyroscope_context->lock);
+  registry_read_unlock(parity);
+
+  return rv;
+}
+
+int phpspy_trace_stats(pid_t pid, phpspy_trace_stats_t *stats, void *err_ptr,
+                       int err_len) {
+  unsigned int parity = registry_read_lock();
+
+  pyroscope_context_t *pyroscope_context = find_matching_context(pid);
+
+  if (NULL == pyroscope_context) {
+    registry_read_unlock(parity);
+    int err_msg_len = snprintf((char *)err_ptr, err_len,
+                               "Phpspy not initialized for %d pid", pid);
+    return -err_msg_len;
+  }
+
+  pthread_mutex_lock(&pyroscope_context->lock);
+  stats->samples = pyroscope_context->phpspy_context.stats.samples;
+  stats->unchanged = pyroscope_context->phpspy_context.stats.unchanged;
+  stats->spliced = pyroscope_context->phpspy_context.stats.spliced;
+  stats->lineno_reads = pyroscope_context->phpspy_context.stats.lineno_reads;
+  stats->shm_reads = pyroscope_context->phpspy_context.target.shm_reads;
+  stats->frame_reads = pyroscope_context->phpspy_context.stats.frame_reads;
+  pthread_mutex_unlock(&pyroscope_context->lock);
+  registry_read_unlock(parity);
+
+  return 0;
+}
+
+_Static_assert(PHPSPY_SNAPSHOT_ERR == PHPSPY_ERR, "status bits");
+_Static_assert(PHPSPY_SNAPSHOT_ERR_PID_DEAD == PHPSPY_ERR_PID_DEAD,
+               "status bits");
+_Static_assert(PHPSPY_SNAPSHOT_ERR_BUF_FULL == PHPSPY_ERR_BUF_FULL,
+               "status bits");
+
+/* phpspy_snapshot_many spreads a batch over a lazily started pool of worker
+ * threads; the calling thread takes part too. One batch runs at a time, a
+ * concurrent caller samples its own batch inline instead of waiting */
+static snapshot_pool_t snapshot_pool = {
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER,
+    PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER, {0}, 0, -1, 0, 0, 0,
+    NULL};
+
+static int batch_reserve(snapshot_batch_t *batch, int size) {
+  int cursor = __atomic_load_n(&batch->cursor, __ATOMIC_RELAXED);
+  do {
+    if (size > batch->len - cursor) {
+      return -1;
+    }
+  } while (!__atomic_compare_exchange_n(&batch->cursor, &cursor,
+                                        cursor + size, 1, __ATOMIC_RELAXED,
+                                        __ATOMIC_RELAXED));
+  return cursor;
+}
+
+static void batch_run(snapshot_batch_t *batch, char *scratch) {
+  int i, rv, at;
+  phpspy_snapshot_result_t *result;
+
+  while ((i = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED)) <
+         batch->n) {
+    result = &batch->results[i];
+    result->pid = batch->pids[i];
+    result->status = PHPSPY_OK;
+    rv = take_snapshot(batch->pids[i], scratch, PHPSPY_SNAPSHOT_SCRATCH_SIZE,
+                       scratch, PHPSPY_SNAPSHOT_SCRATCH_SIZE,
+                       &result->status, SNAPSHOT_FORMAT);
+    /* Stacks and error messages alike are copied out of the scratch */
+    rv = PHPSPY_MIN(rv < 0 ? -rv : rv, PHPSPY_SNAPSHOT_SCRATCH_SIZE);
+    result->len = rv;
+    result->offset = 0;
+    if ((at = batch_reserve(batch, rv)) < 0) {
+      result->status |= PHPSPY_ERR | PHPSPY_ERR_BUF_FULL;
+      result->len = 0;
+      continue;
+    }
+    result->offset = batch->data - (char *)batch->results + at;
+    memcpy(batch->data + at, scratch, rv);
+  }
+}
+
+static void *snapshot_worker(void *arg) {
+  /* Started before the batch it is needed for is announced */
+  uint64_t seen = (uint64_t)(uintptr_t)arg;
+  snapshot_batch_t *batch;
+  char *scratch = malloc(PHPSPY_SNAPSHOT_SCRATCH_SIZE);
+
+  pthread_mutex_lock(&snapshot_pool.mutex);
+  while (1) {
+    while (!snapshot_pool.stop && snapshot_pool.generation == seen) {
+      pthread_cond_wait(&snapshot_pool.wake, &snapshot_pool.mutex);
+    }
+    if (snapshot_pool.stop) {
+      break;
+    }
+    seen = snapshot_pool.generation;
+    batch = snapshot_pool.batch;
+    pthread_mutex_unlock(&snapshot_pool.mutex);
+
+    if (NULL != scratch) {
+      batch_run(batch, scratch);
+    }
+
+    pthread_mutex_lock(&snapshot_pool.mutex);
+    if (0 == --snapshot_pool.running) {
+      pthread_cond_signal(&snapshot_pool.done);
+    }
+  }
+  pthread_mutex_unlock(&snapshot_pool.mutex);
+  free(scratch);
+  return NULL;
+}
+
+/* Callers hold snapshot_pool.lock */
+static void snapshot_pool_start(void) {
+  int i, want = snapshot_pool.want;
+  if (want < 0) {
+    want = PHPSPY_MIN(sysconf(_SC_NPROCESSORS_ONLN) - 1,
+                      PHPSPY_SNAPSHOT_MAX_WORKERS);
+  }
+  snapshot_pool.stop = 0;
+  for (i = snapshot_pool.nthreads; i < want; i++) {
+    if (pthread_create(&snapshot_pool.threads[i], NULL, snapshot_worker,
+                       (void *)(uintptr_t)snapshot_pool.generation) != 0) {
+      log_error("snapshot_pool_start: Failed to start worker %d\n", i);
+      break;
+    }
+  }
+  snapshot_pool.nthreads = i;
+}
+
+/* Callers hold snapshot_pool.lock */
+static void snapshot_pool_stop(void) {
+  int i;
+  pthread_mutex_lock(&snapshot_pool.mutex);
+  snapshot_pool.stop = 1;
+  pthread_cond_broadcast(&snapshot_pool.wake);
+  pthread_mutex_unlock(&snapshot_pool.mutex);
+  for (i = 0; i < snapshot_pool.nthreads; i++) {
+    pthread_join(snapshot_pool.threads[i], NULL);
+  }
+  snapshot_pool.nthreads = 0;
+}
+
+int phpspy_snapshot_workers(int nworkers) {
+  pthread_mutex_lock(&snapshot_pool.lock);
+  snapshot_pool_stop();
+  snapshot_pool.want = PHPSPY_MIN(nworkers, PHPSPY_SNAPSHOT_MAX_WORKERS);
+  pthread_mutex_unlock(&snapshot_pool.lock);
+  return 0;
+}
+
+int phpspy_snapshot_many(const int *pids, int n, void *ptr, int len,
+                         void *err_ptr, int err_len) {
+  snapshot_batch_t batch;
+  char *scratch;
+  size_t header = (size_t)PHPSPY_MAX(n, 0) * sizeof(phpspy_snapshot_result_t);
+
+  if (n < 0 || header > (size_t)len) {
+    int err_msg_len =
+        snprintf((char *)err_ptr, err_len, "Not enough space! %lu > %d",
+                 (unsigned long)header, len);
+    return -err_msg_len;
+  }
+  if (NULL == (scratch = malloc(PHPSPY_SNAPSHOT_SCRATCH_SIZE))) {
+    int err_msg_len = snprintf((char *)err_ptr, err_len,
+                               "Failed to allocate snapshot buffer");
+    return -err_msg_len;
+  }
+
+  batch.pids = pids;
+  batch.n = n;
+  batch.results = (phpspy_snapshot_result_t *)ptr;
+  batch.data = (char *)ptr + header;
+  batch.len = len - (int)header;
+  batch.cursor = 0;
+  batch.next = 0;
+
+  if (n > 1 && 0 == pthread_mutex_trylock(&snapshot_pool.lock)) {
+    snapshot_pool_start();
+    pthread_mutex_lock(&snapshot_pool.mutex);
+    snapshot_pool.batch = &batch;
+    snapshot_pool.running = snapshot_pool.nthreads;
+    snapshot_pool.generation += 1;
+    pthread_cond_broadcast(&snapshot_pool.wake);
+    pthread_mutex_unlock(&snapshot_pool.mutex);
+
+    batch_run(&batch, scratch);
+
+    pthread_mutex_lock(&snapshot_pool.mutex);
+    while (snapshot_pool.running > 0) {
+      pthread_cond_wait(&snapshot_pool.done, &snapshot_pool.mutex);
+    }
+    snapshot_pool.batch = NULL;
+    pthread_mutex_unlock(&snapshot_pool.mutex);
+    pthread_mutex_unlock(&snapshot_pool.lock);
+  } else {
+    batch_run(&batch, scratch);
+  }
+
+  free(scratch);
+  return (int)header + batch.cursor;
+}
+
 int phpspy_cleanup(pid_t pid, void *err_ptr, int err_len) {
+  pthread_mutex_lock(&pyroscope_registry.lock);
   pyroscope_context_t *pyroscope_context = find_matching_context(pid);
+  if (NULL != pyroscope_context) {
+    unregister_context(pyroscope_context);
+  }
+  pthread_mutex_unlock(&pyroscope_registry.lock);
 
   if (NULL == pyroscope_context) {
     int err_msg_len = snprintf((char *)err_ptr, err_len,
@@ -198,7 +1106,162 @@ int phpspy_cleanup(pid_t pid, void *err_ptr, int err_len) {
   }
 
   deinitialize(&pyroscope_context->phpspy_context);
-  deallocate_context(pyroscope_context);
+  free_context(pyroscope_context);
+
+  return 0;
+}
+
+_Static_assert(sizeof(phpspy_sample_t) == 4096, "samples are 4KB records");
+
+static void sampler_tick(phpspy_sampler_t *sampler) {
+  int i, rv, status;
+  uint64_t head, tail;
+  phpspy_sample_t *sample;
+
+  for (i = 0; i < sampler->npids; i++) {
+    /* Single producer: only this thread moves head */
+    head = sampler->head;
+    tail = __atomic_load_n(&sampler->tail, __ATOMIC_ACQUIRE);
+    if (head - tail > sampler->mask) {
+      __atomic_fetch_add(&sampler->dropped, 1, __ATOMIC_RELAXED);
+      continue;
+    }
+    sample = &sampler->ring[head & sampler->mask];
+    sample->pid = sampler->pids[i];
+    sample->timestamp_ns = clock_ns(CLOCK_REALTIME);
+    rv = take_snapshot(sample->pid, sample->data, sizeof(sample->data),
+                       sample->data, sizeof(sample->data), &status,
+                       SNAPSHOT_FORMAT);
+    sample->status = status;
+    sample->len = PHPSPY_MIN(rv < 0 ? -rv : rv, (int)sizeof(sample->data));
+    __atomic_store_n(&sampler->head, head + 1, __ATOMIC_RELEASE);
+    __atomic_fetch_add(&sampler->samples, 1, __ATOMIC_RELAXED);
+  }
+}
+
+static void *sampler_thread(void *arg) {
+  phpspy_sampler_t *sampler = (phpspy_sampler_t *)arg;
+  uint64_t next = clock_ns(CLOCK_MONOTONIC);
+  uint64_t now, behind;
+  struct timespec deadline;
+
+  pthread_mutex_lock(&sampler->mutex);
+  while (!sampler->stop) {
+    pthread_mutex_unlock(&sampler->mutex);
+    sampler_tick(sampler);
+
+    /* Ticks that passed while sampling are skipped, not made up for */
+    next += sampler->interval_ns;
+    now = clock_ns(CLOCK_MONOTONIC);
+    if (now > next) {
+      behind = (now - next) / sampler->interval_ns;
+      __atomic_fetch_add(&sampler->missed, behind, __ATOMIC_RELAXED);
+      next += behind * sampler->interval_ns;
+    }
+    deadline.tv_sec = next / 1000000000ull;
+    deadline.tv_nsec = next % 1000000000ull;
+
+    pthread_mutex_lock(&sampler->mutex);
+    while (!sampler->stop && pthread_cond_timedwait(&sampler->wake,
+                                                    &sampler->mutex,
+                                                    &deadline) != ETIMEDOUT) {
+    }
+  }
+  pthread_mutex_unlock(&sampler->mutex);
+  return NULL;
+}
+
+static void sampler_free(phpspy_sampler_t *sampler) {
+  pthread_cond_destroy(&sampler->wake);
+  pthread_mutex_destroy(&sampler->mutex);
+  pthread_mutex_destroy(&sampler->drain_lock);
+  free(sampler->ring);
+  free(sampler->pids);
+  free(sampler);
+}
+
+phpspy_sampler_t *phpspy_sampler_start(const int *pids, int n, int hz,
+                                       int capacity, void *err_ptr,
+                                       int err_len) {
+  uint64_t cap = 16;
+  pthread_condattr_t attr;
+  phpspy_sampler_t *sampler;
+
+  if (n < 1 || hz < 1 || hz > PHPSPY_SAMPLER_MAX_HZ || capacity < 1) {
+    snprintf((char *)err_ptr, err_len,
+             "Invalid sampler settings: %d pids at %d Hz, capacity %d", n, hz,
+             capacity);
+    return NULL;
+  }
+  while (cap < (uint64_t)capacity) {
+    cap *= 2;
+  }
+
+  /* calloc does not honour the cache line alignment of head and tail */
+  if (0 != posix_memalign((void **)&sampler, 64, sizeof(phpspy_sampler_t))) {
+    snprintf((char *)err_ptr, err_len, "Failed to allocate sampler");
+    return NULL;
+  }
+  memset(sampler, 0, sizeof(phpspy_sampler_t));
+  if (NULL == (sampler->pids = malloc(n * sizeof(int))) ||
+      NULL == (sampler->ring = malloc(cap * sizeof(phpspy_sample_t)))) {
+    free(sampler->pids);
+    free(sampler);
+    snprintf((char *)err_ptr, err_len, "Failed to allocate sampler");
+    return NULL;
+  }
+  memcpy(sampler->pids, pids, n * sizeof(int));
+  sampler->npids = n;
+  sampler->interval_ns = 1000000000ull / hz;
+  sampler->mask = cap - 1;
+  pthread_mutex_init(&sampler->mutex, NULL);
+  pthread_mutex_init(&sampler->drain_lock, NULL);
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&sampler->wake, &attr);
+  pthread_condattr_destroy(&attr);
+
+  if (pthread_create(&sampler->thread, NULL, sampler_thread, sampler) != 0) {
+    sampler_free(sampler);
+    snprintf((char *)err_ptr, err_len, "Failed to start sampler thread");
+    return NULL;
+  }
+  return sampler;
+}
+
+int phpspy_sampler_drain(phpspy_sampler_t *sampler, phpspy_sample_t *samples,
+                         int max) {
+  int i, n;
+  uint64_t head, tail;
+  phpspy_sample_t *sample;
+
+  pthread_mutex_lock(&sampler->drain_lock);
+  tail = sampler->tail;
+  head = __atomic_load_n(&sampler->head, __ATOMIC_ACQUIRE);
+  n = (int)PHPSPY_MIN(head - tail, (uint64_t)PHPSPY_MAX(max, 0));
+  for (i = 0; i < n; i++) {
+    sample = &sampler->ring[(tail + i) & sampler->mask];
+    memcpy(&samples[i], sample, offsetof(phpspy_sample_t, data) + sample->len);
+  }
+  __atomic_store_n(&sampler->tail, tail + n, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&sampler->drain_lock);
+  return n;
+}
+
+int phpspy_sampler_stats(phpspy_sampler_t *sampler,
+                         phpspy_sampler_stats_t *stats) {
+  stats->samples = __atomic_load_n(&sampler->samples, __ATOMIC_RELAXED);
+  stats->dropped = __atomic_load_n(&sampler->dropped, __ATOMIC_RELAXED);
+  stats->missed = __atomic_load_n(&sampler->missed, __ATOMIC_RELAXED);
+  return 0;
+}
 
+int phpspy_sampler_stop(phpspy_sampler_t *sampler) {
+  pthread_mutex_lock(&sampler->mutex);
+  sampler->stop = 1;
+  pthread_cond_signal(&sampler->wake);
+  pthread_mutex_unlock(&sampler->mutex);
+  pthread_join(sampler->thread, NULL);
+  sampler_free(sampler);
   return 0;
 }
@@ -1,11 +1,138 @@
 #ifndef __PYROSCOPE_API_H
 #define __PYROSCOPE_API_H
 
+#include <stdint.h>
 #include <sys/types.h>
 
+typedef struct phpspy_footprint_s {
+  uint64_t contexts; /* contexts in use */
+  uint64_t pooled;   /* free context slots kept for reuse */
+  uint64_t bytes;    /* heap held by contexts, their caches and the registry */
+} phpspy_footprint_t;
+
+/* Status bits of a phpspy_snapshot_many result */
+#define PHPSPY_SNAPSHOT_ERR 1
+#define PHPSPY_SNAPSHOT_ERR_PID_DEAD 2
+#define PHPSPY_SNAPSHOT_ERR_BUF_FULL 4
+#define PHPSPY_SNAPSHOT_ERR_NOT_INITIALIZED 8
+
+/* On success offset and len locate the stack, formatted as by
+ * phpspy_snapshot, otherwise the error message. Offsets are relative to the
+ * start of the caller's buffer */
+typedef struct phpspy_snapshot_result_s {
+  int pid;
+  int status;
+  int offset;
+  int len;
+} phpspy_snapshot_result_t;
+
+/* A sample as produced by the sampler thread, 4KB in total. data holds
+ * len bytes of stack, formatted as by phpspy_snapshot, or of error message
+ * when status is not 0 */
+#define PHPSPY_SAMPLE_DATA_SIZE 4072
+typedef struct phpspy_sample_s {
+  uint64_t timestamp_ns; /* CLOCK_REALTIME */
+  int pid;
+  int status;
+  int len;
+  char data[PHPSPY_SAMPLE_DATA_SIZE];
+} phpspy_sample_t;
+
+typedef struct phpspy_sampler_stats_s {
+  uint64_t samples; /* pushed into the ring */
+  uint64_t dropped; /* not taken because the ring was full */
+  uint64_t missed;  /* ticks skipped because sampling overran */
+} phpspy_sampler_stats_t;
+
+typedef struct phpspy_sampler_s phpspy_sampler_t;
+
+typedef struct phpspy_watcher_stats_s {
+  uint64_t attached; /* children phpspy_init succeeded for */
+  uint64_t failed;   /* children it failed for, they are not retried */
+  uint64_t detached; /* contexts cleaned up after their child went away */
+  uint64_t scans;    /* of /proc, alongside events or in place of them */
+  int proc_connector; /* 1 while events come from the proc connector */
+} phpspy_watcher_stats_t;
+
+typedef struct phpspy_watcher_s phpspy_watcher_t;
+
+typedef struct phpspy_trace_stats_s {
+  uint64_t samples;   /* stacks taken of the pid */
+  uint64_t unchanged; /* of them, re-emitted without walking the stack */
+  uint64_t spliced;   /* of them, walked only down to an unchanged frame */
+  uint64_t lineno_reads; /* oplines read for their line, when enabled */
+  uint64_t shm_reads; /* reads served from the opcache segment mapping */
+  uint64_t frame_reads; /* frames read on their own, not with the vm stack */
+} phpspy_trace_stats_t;
+
 extern int phpspy_init(int pid_i, void *err_ptr, int err_len);
 extern int phpspy_cleanup(int pid_i, void *err_ptr, int err_len);
 extern int phpspy_snapshot(int pid_i, void *ptr, int len, void *err_ptr,
                            int err_len);
+/* Samples n pids in one call. The buffer starts with n results, in the
+ * order of pids, followed by the data they refer to. Returns the number of
+ * bytes used, or a negative error message length */
+extern int phpspy_snapshot_many(const int *pids, int n, void *ptr, int len,
+                                void *err_ptr, int err_len);
+/* Sizes the worker pool used by phpspy_snapshot_many, 0 samples on the
+ * calling thread only. Defaults to one less than the number of cpus */
+extern int phpspy_snapshot_workers(int nworkers);
+/* Starts a thread sampling every pid in pids hz times per second into a
+ * ring of at least capacity samples. The sampler never waits for the
+ * consumer: when the ring is full samples are dropped and counted. Returns
+ * NULL and an error message on failure */
+extern phpspy_sampler_t *phpspy_sampler_start(const int *pids, int n, int hz,
+                                              int capacity, void *err_ptr,
+                                              int err_len);
+/* Moves up to max samples out of the ring, returns how many */
+extern int phpspy_sampler_drain(phpspy_sampler_t *sampler,
+                                phpspy_sample_t *samples, int max);
+extern int phpspy_sampler_stats(phpspy_sampler_t *sampler,
+                                phpspy_sampler_stats_t *stats);
+extern int phpspy_sampler_stop(phpspy_sampler_t *sampler);
+/* Starts a thread keeping a context for each child of master, e.g. the
+ * workers of an FPM master: children are initialized as they are forked
+ * and cleaned up as they exit. Events come from the netlink proc connector,
+ * which takes CAP_NET_ADMIN and the initial pid namespace; the children are
+ * also listed from /proc every interval_ms, to make up for what it misses or
+ * in place of it. Children already running are initialized before this
+ * returns. Returns NULL and an error message on failure */
+extern phpspy_watcher_t *phpspy_watcher_start(int master, int interval_ms,
+                                              void *err_ptr, int err_len);
+/* Copies up to max pids of the children initialized, returns how many */
+extern int phpspy_watcher_pids(phpspy_watcher_t *watcher, int *pids, int max);
+extern int phpspy_watcher_stats(phpspy_watcher_t *watcher,
+                                phpspy_watcher_stats_t *stats);
+/* Stops the thread and cleans up the contexts it initialized. Those are the
+ * watcher's: phpspy_cleanup is not to be called for the children it holds */
+extern int phpspy_watcher_stop(phpspy_watcher_t *watcher);
+/* Samples pid and counts its stack instead of returning it */
+extern int phpspy_snapshot_aggregate(int pid_i, void *err_ptr, int err_len);
+/* Like phpspy_snapshot_aggregate, but only the frame pointers are read.
+ * Their names are resolved in one batch by the next flush, each distinct
+ * function once */
+extern int phpspy_snapshot_lazy(int pid_i, void *err_ptr, int err_len);
+/* Takes a phpspy_snapshot_lazy of n pids at once. Where it is the cheaper
+ * way, their reads are batched through io_uring a level of pointers at a
+ * time, so a round costs about the same number of syscalls however many
+ * pids it covers. Each pid gets its PHPSPY_SNAPSHOT_ERR status in
+ * statuses. Returns 0, or a negative error message length if the batch
+ * could not be taken at all */
+extern int phpspy_snapshot_lazy_many(const int *pids, int n, int *statuses,
+                                     void *err_ptr, int err_len);
+/* Writes the stacks counted since the last flush, one "<stack> <count>\n"
+ * line each, and forgets them. Returns the number of bytes written; lines
+ * that do not fit are kept for the next flush */
+extern int phpspy_flush(int pid_i, void *ptr, int len, void *err_ptr,
+                        int err_len);
+/* Writes the stacks counted since the last flush as a protobuf encoded
+ * pprof profile and forgets them. Samples are valued in counts and in wall
+ * time, period_ns per sample. Returns the size of the profile; when it does
+ * not fit nothing is written and the counts are kept */
+extern int phpspy_flush_pprof(int pid_i, void *ptr, int len,
+                              uint64_t period_ns, void *err_ptr, int err_len);
+extern int phpspy_trace_stats(int pid_i, phpspy_trace_stats_t *stats,
+                              void *err_ptr, int err_len);
+extern int phpspy_footprint(phpspy_footprint_t *footprint);
 
 #endif
@@ -2,16 +2,155 @@
 #define __PYROSCOPE_API_STRUCT_H
 
 #include <limits.h>
+#include <pthread.h>
 #include <unistd.h>
 
 #include "phpspy.h"
+#include "pyroscope_api.h"
 
 typedef struct pyroscope_context_t {
   pid_t pid;
-  char app_root_dir[PATH_MAX];
+  struct context_slab_s *slab;
+  pthread_mutex_t lock; /* serializes snapshots of this context */
+  char *app_root_dir;
   trace_frame_t frames[MAX_STACK_DEPTH];
   struct trace_context_s phpspy_context;
+  call_tree_t tree; /* stacks aggregated since the last flush */
   struct pyroscope_context_t *next;
+  struct pyroscope_context_t *last;
 } pyroscope_context_t;
 
+/* What take_snapshot does with a stack */
+#define SNAPSHOT_FORMAT 0    /* formats it into the caller's buffer */
+#define SNAPSHOT_AGGREGATE 1 /* counts it in the context's call tree */
+#define SNAPSHOT_RAW 2       /* records its frame pointers, see trace_raw_t */
+
+#define PHPSPY_CONTEXT_SLAB_SIZE 32
+#define PHPSPY_CONTEXT_POOL_SLABS 2
+
+typedef struct context_slab_s {
+  struct context_slab_s *prev; /* slabs with free slots */
+  struct context_slab_s *next;
+  pyroscope_context_t *free; /* chained through pyroscope_context_t.next */
+  int used;
+  pyroscope_context_t slots[PHPSPY_CONTEXT_SLAB_SIZE];
+} context_slab_t;
+
+typedef struct context_pool_s {
+  pthread_mutex_t lock;
+  context_slab_t *partial;
+  size_t slabs;
+  size_t empty; /* slabs without used slots */
+  size_t used;
+} context_pool_t;
+
+typedef struct registry_slot_s {
+  pid_t pid;
+  pyroscope_context_t *ctx;
+} registry_slot_t;
+
+typedef struct registry_table_s {
+  registry_slot_t *slots;
+  size_t cap;
+  size_t used; /* live slots and tombstones */
+} registry_table_t;
+
+typedef struct pyroscope_registry_s {
+  registry_table_t *table;
+  size_t len;
+  pthread_mutex_t lock; /* serializes writers */
+} pyroscope_registry_t;
+
+#define PHPSPY_URING_ENTRIES 256
+#define PHPSPY_URING_PROBES 6 /* batches timed, alternating ring or not */
+
+/* The io_uring behind phpspy_snapshot_lazy_many, set up on first use */
+typedef struct lazy_uring_s {
+  pthread_mutex_t lock; /* held for the duration of a batch */
+  int state;            /* 0 not set up yet, 1 up, -1 unavailable */
+  trace_uring_t ring;
+  int probes;
+  uint64_t best_ns[2]; /* per pid, of the batches timed without and with */
+} lazy_uring_t;
+
+typedef struct lazy_entry_s {
+  pyroscope_context_t *ctx;
+  int index; /* of its pid in the batch */
+} lazy_entry_t;
+
+#define PHPSPY_SNAPSHOT_SCRATCH_SIZE (64 * 1024)
+#define PHPSPY_SNAPSHOT_MAX_WORKERS 64
+
+typedef struct snapshot_batch_s {
+  const int *pids;
+  int n;
+  phpspy_snapshot_result_t *results;
+  char *data; /* stacks and error messages, after the results */
+  int len;
+  int cursor; /* bytes of data handed out */
+  int next;   /* next pid to sample */
+} snapshot_batch_t;
+
+typedef struct snapshot_pool_s {
+  pthread_mutex_t lock; /* held for the duration of a batch */
+  pthread_mutex_t mutex;
+  pthread_cond_t wake;
+  pthread_cond_t done;
+  pthread_t threads[PHPSPY_SNAPSHOT_MAX_WORKERS];
+  int nthreads;
+  int want; /* -1 sizes the pool by the number of cpus */
+  int running;
+  int stop;
+  uint64_t generation;
+  snapshot_batch_t *batch;
+} snapshot_pool_t;
+
+#define PHPSPY_SAMPLER_MAX_HZ 10000
+
+struct phpspy_sampler_s {
+  pthread_t thread;
+  pthread_mutex_t mutex; /* guards stop, the sampler sleeps on wake */
+  pthread_cond_t wake;
+  int stop;
+  int *pids;
+  int npids;
+  uint64_t interval_ns;
+  phpspy_sample_t *ring;
+  uint64_t mask;
+  pthread_mutex_t drain_lock; /* serializes consumers only */
+  /* head is only written by the sampler and tail only by consumers, keep
+   * them on separate cache lines */
+  uint64_t head __attribute__((aligned(64)));
+  uint64_t tail __attribute__((aligned(64)));
+  uint64_t samples __attribute__((aligned(64)));
+  uint64_t dropped;
+  uint64_t missed;
+};
+
+#define PHPSPY_WATCHER_MSG_SIZE 8192
+
+typedef struct watcher_pids_s {
+  pid_t *pids;
+  pyroscope_context_t **contexts; /* the watcher's own, NULL unless attached */
+  int len;
+  int cap;
+} watcher_pids_t;
+
+struct phpspy_watcher_s {
+  pthread_t thread;
+  pid_t master;
+  int interval_ms;
+  int nl_fd;   /* proc connector socket, -1 when listing /proc instead */
+  int stop_fd; /* eventfd waking the thread to stop */
+  pthread_mutex_t lock; /* guards what readers see: children and stats */
+  watcher_pids_t children; /* initialized, only the thread changes them */
+  watcher_pids_t failed;   /* phpspy_init failed for these */
+  phpspy_watcher_stats_t stats;
+};
+
+/* Unlike phpspy_init, a context is only registered once initialized and is
+ * handed back, so the watcher cleans up its own and no other of the pid */
+pyroscope_context_t *attach_context(pid_t pid, void *err_ptr, int err_len);
+void detach_context(pyroscope_context_t *ctx);
+
 #endif
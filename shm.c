@@ -0,0 +1,181 @@
+#include <sys/mman.h>
+#include <sys/sysmacros.h>
+
+#include "phpspy.h"
+
+/* Opcache keeps interned strings and persisted scripts in a shared memory
+ * segment that every process forked from one FPM master maps at the same
+ * address. The segment is mapped here read-only, once for all of those
+ * processes, so that reads falling in it are served locally instead of
+ * going through the target */
+
+static trace_shm_t *shm_list = NULL;
+static pthread_mutex_t shm_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int shm_find(pid_t pid, trace_shm_t *found);
+static trace_shm_t *shm_map(pid_t pid, trace_shm_t *found);
+
+int shm_attach(trace_target_t *target) {
+  trace_shm_t found, *shm;
+
+  if (shm_find(target->pid, &found) != PHPSPY_OK) {
+    return PHPSPY_OK; /* no segment, every read goes to the target */
+  }
+
+  pthread_mutex_lock(&shm_lock);
+  for (shm = shm_list; shm != NULL; shm = shm->next) {
+    if (shm->dev == found.dev && shm->ino == found.ino &&
+        shm->raddr == found.raddr && shm->len == found.len) {
+      break;
+    }
+  }
+  if (shm == NULL && (shm = shm_map(target->pid, &found)) != NULL) {
+    shm->next = shm_list;
+    shm_list = shm;
+  }
+  if (shm != NULL) {
+    shm->refs += 1;
+  }
+  target->shm = shm;
+  pthread_mutex_unlock(&shm_lock);
+  return PHPSPY_OK;
+}
+
+void shm_detach(trace_target_t *target) {
+  shm_unref(target->shm);
+  target->shm = NULL;
+}
+
+/* Takes another reference on a segment already attached, see pool.c */
+trace_shm_t *shm_ref(trace_shm_t *shm) {
+  if (shm != NULL) {
+    pthread_mutex_lock(&shm_lock);
+    shm->refs += 1;
+    pthread_mutex_unlock(&shm_lock);
+  }
+  return shm;
+}
+
+void shm_unref(trace_shm_t *shm) {
+  trace_shm_t **iter;
+
+  if (shm == NULL) {
+    return;
+  }
+  pthread_mutex_lock(&shm_lock);
+  if (--shm->refs == 0) {
+    for (iter = &shm_list; *iter != shm; iter = &(*iter)->next);
+    *iter = shm->next;
+    munmap((void *)shm->laddr, shm->len);
+    free(shm);
+  }
+  pthread_mutex_unlock(&shm_lock);
+}
+
+/* Whether pid maps the very segment shm is a mapping of, where shm has it */
+int shm_mapped_by(trace_shm_t *shm, pid_t pid) {
+  FILE *fp;
+  char path[PATH_MAX], line[PHPSPY_STR_SIZE + PATH_MAX];
+  uint64_t start, end, ino;
+  unsigned int major, minor;
+  int found = 0;
+
+  snprintf(path, sizeof(path), "/proc/%d/maps", pid);
+  if ((fp = fopen(path, "r")) == NULL) {
+    return 0;
+  }
+  while (!found && fgets(line, sizeof(line), fp) != NULL) {
+    if (sscanf(line, "%lx-%lx %*4s %*x %x:%x %lu", &start, &end, &major,
+               &minor, &ino) < 5) {
+      continue;
+    }
+    found = (char *)start == shm->raddr && end - start == shm->len &&
+            makedev(major, minor) == shm->dev && ino == shm->ino;
+  }
+  fclose(fp);
+  return found;
+}
+
+/* Serves a read from the segment if it lies entirely inside it */
+int shm_copy(trace_target_t *target, void *raddr, void *laddr, size_t size) {
+  trace_shm_t *shm = target->shm;
+  char *addr = (char *)raddr;
+
+  if (shm == NULL || addr < shm->raddr || size > shm->len ||
+      (size_t)(addr - shm->raddr) > shm->len - size) {
+    return 0;
+  }
+  memcpy(laddr, shm->laddr + (addr - shm->raddr), size);
+  target->shm_reads += 1;
+  return 1;
+}
+
+/* The largest shared anonymous or SysV mapping of at least
+ * PHPSPY_SHM_MIN_SIZE is taken to be the opcache segment */
+static int shm_find(pid_t pid, trace_shm_t *found) {
+  FILE *fp;
+  char path[PATH_MAX], line[PHPSPY_STR_SIZE + PATH_MAX];
+  char perms[5], name[PATH_MAX];
+  uint64_t start, end, offset, ino;
+  unsigned int major, minor;
+
+  snprintf(path, sizeof(path), "/proc/%d/maps", pid);
+  if ((fp = fopen(path, "r")) == NULL) {
+    return PHPSPY_ERR;
+  }
+  memset(found, 0, sizeof(*found));
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    name[0] = '\0';
+    if (sscanf(line, "%lx-%lx %4s %lx %x:%x %lu %[^\n]", &start, &end, perms,
+               &offset, &major, &minor, &ino, name) < 7) {
+      continue;
+    }
+    if (perms[0] != 'r' || perms[3] != 's' ||
+        end - start < PHPSPY_SHM_MIN_SIZE || end - start <= found->len) {
+      continue;
+    }
+    if (strcmp(name, "/dev/zero (deleted)") != 0 &&
+        strncmp(name, "/SYSV", sizeof("/SYSV") - 1) != 0) {
+      continue;
+    }
+    found->raddr = (char *)start;
+    found->len = end - start;
+    found->offset = offset;
+    found->dev = makedev(major, minor);
+    found->ino = ino;
+  }
+  fclose(fp);
+  return found->len > 0 ? PHPSPY_OK : PHPSPY_ERR;
+}
+
+/* Maps the segment through /proc/pid/map_files, which takes
+ * CAP_CHECKPOINT_RESTORE or CAP_SYS_ADMIN; without them every read simply
+ * keeps going to the target */
+static trace_shm_t *shm_map(pid_t pid, trace_shm_t *found) {
+  int fd;
+  char path[PATH_MAX];
+  void *laddr;
+  trace_shm_t *shm;
+
+  snprintf(path, sizeof(path), "/proc/%d/map_files/%lx-%lx", pid,
+           (uint64_t)(uintptr_t)found->raddr,
+           (uint64_t)(uintptr_t)found->raddr + found->len);
+  if ((fd = open(path, O_RDONLY)) < 0) {
+    log_error("shm_map: Failed to open %s; err=%s\n", path, strerror(errno));
+    return NULL;
+  }
+  laddr = mmap(NULL, found->len, PROT_READ, MAP_SHARED, fd, found->offset);
+  close(fd);
+  if (laddr == MAP_FAILED) {
+    log_error("shm_map: Failed to map %s; err=%s\n", path, strerror(errno));
+    return NULL;
+  }
+  if ((shm = malloc(sizeof(trace_shm_t))) == NULL) {
+    munmap(laddr, found->len);
+    return NULL;
+  }
+  memcpy(shm, found, sizeof(*shm));
+  shm->laddr = laddr;
+  shm->refs = 0;
+  return shm;
+}
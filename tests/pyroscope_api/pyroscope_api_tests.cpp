@@ -1,20 +1,28 @@
 #include <gtest/gtest.h>
 
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <cstdio>
 #include <fstream>
 #include <iostream>
+#include <thread>
+
+#include <sys/mman.h>
+#include <sys/prctl.h>
 
 extern "C" {
 #include "phpspy.h"
 #include "pyroscope_api.h"
 #include "pyroscope_api_struct.h"
 
-extern pyroscope_context_t *first_ctx;
+extern pyroscope_registry_t pyroscope_registry;
+extern lazy_uring_t lazy_uring;
 
 void get_process_cwd(char *app_cwd, pid_t pid);
 int formulate_output(struct trace_context_s *context, const char *app_root_dir,
                      char *data_ptr, int data_len, void *err_ptr, int err_len);
-pyroscope_context_t *allocate_context();
+pyroscope_context_t *allocate_context(pid_t pid);
 void deallocate_context(pyroscope_context_t *ctx);
 pyroscope_context_t *find_matching_context(pid_t pid);
 }
@@ -25,6 +33,18 @@ using std::chrono::duration;
 using std::chrono::duration_cast;
 using std::chrono::high_resolution_clock;
 using std::chrono::microseconds;
+using std::chrono::nanoseconds;
+
+// Puts an option of phpspy back when a test ends, whichever assertion ends it
+class OptionGuard {
+ public:
+  explicit OptionGuard(int &option) : option(option), saved(option) {}
+  ~OptionGuard() { option = saved; }
+
+ private:
+  int &option;
+  int saved;
+};
 
 class PyroscopeApiTestsBase : public ::testing::Test {
   class App {
@@ -95,6 +115,26 @@ TEST_F(PyroscopeApiTestsSingleApp, phpspy_init_allocate_a_lot) {
   }
 }
 */
+TEST_F(PyroscopeApiTestsSingleApp, context_footprint) {
+  auto &app = apps[0];
+  ASSERT_EQ(phpspy_init(app.pid, &err_buf[0], err_len), 0);
+  pyroscope_context_t *ctx = find_matching_context(app.pid);
+  ASSERT_NE(ctx, nullptr);
+  // Caches are allocated on the first sample, not with the context
+  EXPECT_EQ(context_footprint(&ctx->phpspy_context), 0);
+
+  // One short stack fills the fixed size caches plus a few small tables
+  ASSERT_GT(
+      phpspy_snapshot(app.pid, &data_buf[0], data_len, &err_buf[0], err_len),
+      0);
+  size_t fixed = PHPSPY_SEGMENT_CACHE_SIZE * sizeof(trace_segment_t) +
+                 sizeof(trace_last_stack_t);
+  size_t footprint = context_footprint(&ctx->phpspy_context);
+  EXPECT_GE(footprint, fixed);
+  EXPECT_LE(footprint, fixed + 32 * 1024);
+  phpspy_cleanup(app.pid, &err_buf[0], err_len);
+}
+
 TEST_F(PyroscopeApiTestsSingleApp, phpspy_init_same_pid) {
   auto &app = apps[0];
   ASSERT_EQ(phpspy_init(app.pid, &err_buf[0], err_len), 0);
@@ -126,6 +166,242 @@ TEST_F(PyroscopeApiTestsSingleApp, phpspy_snapshot_ok) {
   phpspy_cleanup(app.pid, &err_buf[0], err_len);
 }
 
+TEST_F(PyroscopeApiTestsSingleApp, func_cache_full_keeps_stack_names) {
+  auto &app = apps[0];
+  ASSERT_EQ(phpspy_init(app.pid, &err_buf[0], err_len), 0);
+  phpspy_snapshot(app.pid, &data_buf[0], data_len, &err_buf[0], err_len);
+  trace_context_t *context = &find_matching_context(app.pid)->phpspy_context;
+
+  // Forget the top frame's function and fill the cache behind the others,
+  // so that storing it again evicts from the entries of the same stack
+  trace_func_cache_t *entry;
+  zend_function *top = context->last_stack->frames[0].func;
+  HASH_FIND_PTR(context->func_cache, &top, entry);
+  ASSERT_NE(entry, nullptr);
+  HASH_DEL(context->func_cache, entry);
+  free(entry);
+  ASSERT_GT(HASH_COUNT(context->func_cache), 0);
+  for (uintptr_t i = 1;
+       HASH_COUNT(context->func_cache) < PHPSPY_FUNC_CACHE_SIZE; i++) {
+    entry = (trace_func_cache_t *)calloc(1, sizeof(trace_func_cache_t));
+    entry->raddr = (zend_function *)(i * sizeof(zend_function));
+    HASH_ADD_PTR(context->func_cache, raddr, entry);
+  }
+
+  context->last_stack->depth = 0;
+  int rv =
+      phpspy_snapshot(app.pid, &data_buf[0], data_len, &err_buf[0], err_len);
+  EXPECT_EQ(rv, app.expected_stacktrace.size());
+  EXPECT_STREQ(data_buf, app.expected_stacktrace.c_str());
+  EXPECT_EQ(HASH_COUNT(context->func_cache), PHPSPY_FUNC_CACHE_SIZE);
+  phpspy_cleanup(app.pid, &err_buf[0], err_len);
+}
+
+TEST_F(PyroscopeApiTestsSingleApp, phpspy_snapshot_without_vm_stack_slurp) {
+  auto &app = apps[0];
+  OptionGuard slurp(opt_vm_stack_slurp);
+  phpspy_trace_stats_t stats{};
+
+  // Without the vm stack copied in one go, frames are read one by one
+  opt_vm_stack_slurp = 0;
+  phpspy_init(app.pid, &err_buf[0], err_len);
+  int rv =
+      phpspy_snapshot(app.pid, &data_buf[0], data_len, &err_buf[0], err_len);
+  EXPECT_EQ(rv, app.expected_stacktrace.size());
+  EXPECT_STREQ(data_buf, app.expected_stacktrace.c_str());
+  EXPECT_STREQ(err_buf, "");
+  ASSERT_EQ(phpspy_trace_stats(app.pid, &stats, &err_buf[0], err_len), 0);
+  EXPECT_EQ(stats.frame_reads, 3);
+  phpspy_cleanup(app.pid, &err_buf[0], err_len);
+
+  // With it, none of them is
+  opt_vm_stack_slurp = 1;
+  phpspy_init(app.pid, &err_buf[0], err_len);
+  rv = phpspy_snapshot(app.pid, &data_buf[0], data_len, &err_buf[0], err_len);
+  EXPECT_EQ(rv, app.expected_stacktrace.size());
+  ASSERT_EQ(phpspy_trace_stats(app.pid, &stats, &err_buf[0], err_len), 0);
+  EXPECT_EQ(stats.frame_reads, 0);
+  phpspy_cleanup(app.pid, &err_buf[0], err_len);
+}
+
+TEST_F(PyroscopeApiTestsSingleApp, phpspy_snapshot_func_cache) {
+  auto &app = apps[0];
+  phpspy_init(app.pid, &err_buf[0], err_len);
+  trace_context_t *context = &find_matching_context(app.pid)->phpspy_context;
+  EXPECT_EQ(HASH_COUNT(context->func_cache), 0);
+
+  for (int i = 0; i < 2; i++) {
+    int rv =
+        phpspy_snapshot(app.pid, &data_buf[0], data_len, &err_buf[0], err_len);
+    EXPECT_EQ(rv, app.expected_stacktrace.size());
+    EXPECT_STREQ(data_buf, app.expected_stacktrace.c_str());
+    // <main>, wait_a_moment and sleep
+    EXPECT_EQ(HASH_COUNT(context->func_cache), 3);
+  }
+
+  phpspy_cleanup(app.pid, &err_buf[0], err_len);
+}
+
+TEST_F(PyroscopeApiTestsSingleApp, phpspy_snapshot_unchanged_stack) {
+  auto &app = apps[0];
+  phpspy_trace_stats_t stats{};
+  ASSERT_EQ(phpspy_init(app.pid, &err_buf[0], err_len), 0);
+
+  // The app sleeps in the same frame, only the first sample walks it
+  for (int i = 0; i < 5; i++) {
+    int rv =
+        phpspy_snapshot(app.pid, &data_buf[0], data_len, &err_buf[0], err_len);
+    EXPECT_EQ(rv, app.expected_stacktrace.size());
+    EXPECT_STREQ(data_buf, app.expected_stacktrace.c_str());
+  }
+  ASSERT_EQ(phpspy_trace_stats(app.pid, &stats, &err_buf[0], err_len), 0);
+  EXPECT_EQ(stats.samples, 5);
+  EXPECT_EQ(stats.unchanged, 4);
+
+  // A frame that no longer matches makes the next sample walk again
+  trace_context_t *context = &find_matching_context(app.pid)->phpspy_context;
+  context->last_stack->frames[0].opline += 1;
+  phpspy_snapshot(app.pid, &data_buf[0], data_len, &err_buf[0], err_len);
+  EXPECT_STREQ(data_buf, app.expected_stacktrace.c_str());
+  ASSERT_EQ(phpspy_trace_stats(app.pid, &stats, &err_buf[0], err_len), 0);
+  EXPECT_EQ(stats.unchanged, 4);
+
+  phpspy_cleanup(app.pid, &err_buf[0], err_len);
+}
+
+TEST_F(PyroscopeApiTestsSingleApp, phpspy_snapshot_splices_unchanged_bottom) {
+  auto &app = apps[0];
+  phpspy_trace_stats_t stats{};
+  ASSERT_EQ(phpspy_init(app.pid, &err_buf[0], err_len), 0);
+  phpspy_snapshot(app.pid, &data_buf[0], data_len, &err_buf[0], err_len);
+  trace_context_t *context = &find_matching_context(app.pid)->phpspy_context;
+  ASSERT_EQ(context->last_stack->depth, 3);
+
+  // Frames above a changed one are walked again, the rest is reused
+  for (int changed = 0; changed < 3; changed++) {
+    context->last_stack->frames[changed].func += 1;
+    int rv =
+        phpspy_snapshot(app.pid, &data_buf[0], data_len, &err_buf[0], err_len);
+    EXPECT_EQ(rv, app.expected_stacktrace.size());
+    EXPECT_STREQ(data_buf, app.expected_stacktrace.c_str());
+    EXPECT_EQ(context->last_stack->depth, 3);
+  }
+  ASSERT_EQ(phpspy_trace_stats(app.pid, &stats, &err_buf[0], err_len), 0);
+  EXPECT_EQ(stats.samples, 4);
+  EXPECT_EQ(stats.unchanged, 0);
+  EXPECT_EQ(stats.spliced, 2);
+
+  phpspy_cleanup(app.pid, &err_buf[0], err_len);
+}
+
+TEST_F(PyroscopeApiTestsSingleApp, phpspy_snapshot_opline_lineno) {
+  auto &app = apps[0];
+  std::string expected =
+      "tests/pyroscope_api/main.php:6 - wait_a_moment;<internal> - sleep;";
+  phpspy_trace_stats_t stats{};
+  OptionGuard lineno(opt_opline_lineno);
+  opt_opline_lineno = 1;
+  ASSERT_EQ(phpspy_init(app.pid, &err_buf[0], err_len), 0);
+
+  // The line of the sleep() call rather than of the function declaration
+  int rv =
+      phpspy_snapshot(app.pid, &data_buf[0], data_len, &err_buf[0], err_len);
+  EXPECT_EQ(rv, expected.size());
+  EXPECT_STREQ(data_buf, expected.c_str());
+  ASSERT_EQ(phpspy_trace_stats(app.pid, &stats, &err_buf[0], err_len), 0);
+  uint64_t lineno_reads = stats.lineno_reads;
+  EXPECT_GT(lineno_reads, 0);
+
+  // A walked stack finds its lines in the cache, so do lazy ones
+  trace_context_t *context = &find_matching_context(app.pid)->phpspy_context;
+  context->last_stack->frames[0].func += 1;
+  phpspy_snapshot(app.pid, &data_buf[0], data_len, &err_buf[0], err_len);
+  EXPECT_STREQ(data_buf, expected.c_str());
+  EXPECT_EQ(phpspy_snapshot_lazy(app.pid, &err_buf[0], err_len), 0);
+  expected += " 1\n";
+  EXPECT_EQ(phpspy_flush(app.pid, &data_buf[0], data_len, &err_buf[0],
+                         err_len),
+            expected.size());
+  EXPECT_EQ(std::string(data_buf, expected.size()), expected);
+  ASSERT_EQ(phpspy_trace_stats(app.pid, &stats, &err_buf[0], err_len), 0);
+  EXPECT_EQ(stats.lineno_reads, lineno_reads);
+
+  phpspy_cleanup(app.pid, &err_buf[0], err_len);
+}
+
+TEST_F(PyroscopeApiTestsSingleApp, phpspy_snapshot_read_backends) {
+  auto &app = apps[0];
+  OptionGuard read_backend(opt_read_backend);
+
+  // Every backend reads the same stack, auto picks one of the cheap ones
+  for (int backend : {PHPSPY_READ_VM, PHPSPY_READ_MEM, PHPSPY_READ_PTRACE,
+                      PHPSPY_READ_AUTO}) {
+    opt_read_backend = backend;
+    ASSERT_EQ(phpspy_init(app.pid, &err_buf[0], err_len), 0) << backend;
+    trace_context_t *context = &find_matching_context(app.pid)->phpspy_context;
+    if (backend == PHPSPY_READ_AUTO) {
+      EXPECT_NE(context->target.read_backend, PHPSPY_READ_PTRACE);
+    } else {
+      EXPECT_EQ(context->target.read_backend, backend);
+    }
+    // Until a lazy batch goes through io_uring only the mem backend has it
+    EXPECT_EQ(context->target.mem_fd >= 0,
+              context->target.read_backend == PHPSPY_READ_MEM);
+    int rv =
+        phpspy_snapshot(app.pid, &data_buf[0], data_len, &err_buf[0], err_len);
+    EXPECT_EQ(rv, app.expected_stacktrace.size()) << backend;
+    EXPECT_STREQ(data_buf, app.expected_stacktrace.c_str());
+    phpspy_cleanup(app.pid, &err_buf[0], err_len);
+  }
+
+  // A backend out of range is refused instead of indexing past the table
+  opt_read_backend = PHPSPY_READ_PTRACE + 1;
+  EXPECT_LT(phpspy_init(app.pid, &err_buf[0], err_len), 0);
+  phpspy_cleanup(app.pid, &err_buf[0], err_len);
+}
+
+TEST_F(PyroscopeApiTestsSingleApp, init_inherits_sibling_names) {
+  auto &app = apps[0];
+  ASSERT_EQ(phpspy_init(app.pid, &err_buf[0], err_len), 0);
+  phpspy_snapshot(app.pid, &data_buf[0], data_len, &err_buf[0], err_len);
+  pyroscope_context_t *first = find_matching_context(app.pid);
+  trace_context_t *donor = &first->phpspy_context;
+
+  // A second context of the process joins the pool of the first one and
+  // starts with the names it resolved
+  ASSERT_EQ(phpspy_init(app.pid, &err_buf[0], err_len), 0);
+  ASSERT_NE(first->next, nullptr);
+  trace_context_t *context = &first->next->phpspy_context;
+  ASSERT_NE(context->target.pool, nullptr);
+  EXPECT_EQ(context->target.pool, donor->target.pool);
+  EXPECT_EQ(context->target.pool->refs, 2);
+  EXPECT_EQ(context->sibling, donor);
+  EXPECT_EQ(context->sibling_pid, app.pid);
+  EXPECT_EQ(context->target.executor_globals_addr,
+            donor->target.executor_globals_addr);
+  uint32_t count = context->strings.count;
+  EXPECT_GT(count, 0);
+  EXPECT_EQ(count, donor->strings.count);
+  EXPECT_EQ(HASH_COUNT(context->func_cache), HASH_COUNT(donor->func_cache));
+
+  // So its first sample has nothing left to resolve
+  EXPECT_EQ(do_trace(context), PHPSPY_OK);
+  EXPECT_EQ(context->strings.count, count);
+
+  // Once the donor is gone a context joining has nothing to copy, although
+  // the pid it was registered under still has a context
+  phpspy_cleanup(app.pid, &err_buf[0], err_len);
+  EXPECT_EQ(context->target.pool->donor, nullptr);
+  ASSERT_EQ(phpspy_init(app.pid, &err_buf[0], err_len), 0);
+  pyroscope_context_t *third = find_matching_context(app.pid)->next;
+  ASSERT_NE(third, nullptr);
+  EXPECT_EQ(third->phpspy_context.sibling, nullptr);
+  EXPECT_EQ(third->phpspy_context.strings.count, 0);
+
+  phpspy_cleanup(app.pid, &err_buf[0], err_len);
+  phpspy_cleanup(app.pid, &err_buf[0], err_len);
+}
+
 TEST_F(PyroscopeApiTestsSingleApp, phpspy_snapshot_without_init) {
   auto &app = apps[0];
   std::string expected_err_msg =
@@ -164,31 +440,53 @@ TEST_F(PyroscopeApiTestsSingleApp, get_process_cwd) {
   EXPECT_STREQ(buf, gtest_cwd.c_str());
 }
 
-class PyroscopeApiTestsLinkedList : public PyroscopeApiTestsBase {
-  void TearDown() { ASSERT_EQ(first_ctx, nullptr); }
+class PyroscopeApiTestsRegistry : public PyroscopeApiTestsBase {
+  void TearDown() { ASSERT_EQ(pyroscope_registry.len, 0); }
 
  public:
 };
 
-TEST_F(PyroscopeApiTestsLinkedList, allocate_context_first) {
-  ASSERT_EQ(first_ctx, nullptr);
-  pyroscope_context_t empty{};
+TEST_F(PyroscopeApiTestsRegistry, allocate_context_first) {
+  ASSERT_EQ(pyroscope_registry.len, 0);
 
-  pyroscope_context_t *ptr = allocate_context();
+  pyroscope_context_t *ptr = allocate_context(1);
 
-  EXPECT_EQ(ptr, first_ctx);
-  EXPECT_EQ(memcmp(first_ctx, &empty, sizeof(pyroscope_context_t)), 0);
+  EXPECT_EQ(pyroscope_registry.len, 1);
+  EXPECT_EQ(ptr->pid, 1);
+  EXPECT_EQ(ptr->next, nullptr);
+  EXPECT_EQ(find_matching_context(1), ptr);
 
   deallocate_context(ptr);
-  EXPECT_EQ(first_ctx, nullptr);
+  EXPECT_EQ(find_matching_context(1), nullptr);
+}
+
+TEST_F(PyroscopeApiTestsRegistry, allocate_few) {
+  pyroscope_context_t *first = allocate_context(1);
+  pyroscope_context_t *middle = allocate_context(2);
+  pyroscope_context_t *last = allocate_context(3);
+
+  EXPECT_EQ(pyroscope_registry.len, 3);
+  EXPECT_EQ(find_matching_context(1), first);
+  EXPECT_EQ(find_matching_context(2), middle);
+  EXPECT_EQ(find_matching_context(3), last);
+  EXPECT_EQ(find_matching_context(4), nullptr);
+
+  deallocate_context(middle);
+  EXPECT_EQ(find_matching_context(1), first);
+  EXPECT_EQ(find_matching_context(2), nullptr);
+  EXPECT_EQ(find_matching_context(3), last);
+
+  deallocate_context(first);
+  deallocate_context(last);
 }
 
-TEST_F(PyroscopeApiTestsLinkedList, allocate_few) {
-  pyroscope_context_t *first = allocate_context();
-  pyroscope_context_t *middle = allocate_context();
-  pyroscope_context_t *last = allocate_context();
+TEST_F(PyroscopeApiTestsRegistry, allocate_same_pid) {
+  pyroscope_context_t *first = allocate_context(1);
+  pyroscope_context_t *middle = allocate_context(1);
+  pyroscope_context_t *last = allocate_context(1);
 
-  EXPECT_EQ(first, first_ctx);
+  EXPECT_EQ(pyroscope_registry.len, 1);
+  EXPECT_EQ(find_matching_context(1), first);
   EXPECT_EQ(first->next, middle);
   EXPECT_EQ(middle->next, last);
   EXPECT_EQ(last->next, nullptr);
@@ -198,29 +496,30 @@ TEST_F(PyroscopeApiTestsLinkedList, allocate_few) {
   deallocate_context(last);
 }
 
-TEST_F(PyroscopeApiTestsLinkedList, allocate_few_deallocate_first) {
-  pyroscope_context_t *first = allocate_context();
-  pyroscope_context_t *middle = allocate_context();
-  pyroscope_context_t *last = allocate_context();
+TEST_F(PyroscopeApiTestsRegistry, allocate_same_pid_deallocate_first) {
+  pyroscope_context_t *first = allocate_context(1);
+  pyroscope_context_t *middle = allocate_context(1);
+  pyroscope_context_t *last = allocate_context(1);
 
   deallocate_context(first);
 
-  EXPECT_EQ(middle, first_ctx);
+  EXPECT_EQ(find_matching_context(1), middle);
   EXPECT_EQ(middle->next, last);
+  EXPECT_EQ(middle->last, last);
   EXPECT_EQ(last->next, nullptr);
 
   deallocate_context(middle);
   deallocate_context(last);
 }
 
-TEST_F(PyroscopeApiTestsLinkedList, allocate_few_deallocate_middle) {
-  pyroscope_context_t *first = allocate_context();
-  pyroscope_context_t *middle = allocate_context();
-  pyroscope_context_t *last = allocate_context();
+TEST_F(PyroscopeApiTestsRegistry, allocate_same_pid_deallocate_middle) {
+  pyroscope_context_t *first = allocate_context(1);
+  pyroscope_context_t *middle = allocate_context(1);
+  pyroscope_context_t *last = allocate_context(1);
 
   deallocate_context(middle);
 
-  EXPECT_EQ(first, first_ctx);
+  EXPECT_EQ(find_matching_context(1), first);
   EXPECT_EQ(first->next, last);
   EXPECT_EQ(last->next, nullptr);
 
@@ -228,56 +527,85 @@ TEST_F(PyroscopeApiTestsLinkedList, allocate_few_deallocate_middle) {
   deallocate_context(last);
 }
 
-TEST_F(PyroscopeApiTestsLinkedList, allocate_few_deallocate_last) {
-  pyroscope_context_t *first = allocate_context();
-  pyroscope_context_t *middle = allocate_context();
-  pyroscope_context_t *last = allocate_context();
+TEST_F(PyroscopeApiTestsRegistry, allocate_same_pid_deallocate_last) {
+  pyroscope_context_t *first = allocate_context(1);
+  pyroscope_context_t *middle = allocate_context(1);
+  pyroscope_context_t *last = allocate_context(1);
 
   deallocate_context(last);
 
-  EXPECT_EQ(first, first_ctx);
+  EXPECT_EQ(find_matching_context(1), first);
   EXPECT_EQ(first->next, middle);
+  EXPECT_EQ(first->last, middle);
   EXPECT_EQ(middle->next, nullptr);
 
+  pyroscope_context_t *again = allocate_context(1);
+  EXPECT_EQ(middle->next, again);
+
   deallocate_context(first);
   deallocate_context(middle);
+  deallocate_context(again);
 }
 
-TEST_F(PyroscopeApiTestsLinkedList, allocate_context_many) {
+TEST_F(PyroscopeApiTestsRegistry, allocate_context_many) {
   std::vector<pyroscope_context_t *> allocated;
 
-  for (int i = 0; i < 64; i++) {
-    pyroscope_context_t *ptr = allocate_context();
-
-    allocated.push_back(ptr);
+  for (int i = 0; i < 1024; i++) {
+    allocated.push_back(allocate_context(i + 1));
   }
 
   for (long unsigned int i = 0; i < allocated.size(); i++) {
-    pyroscope_context_t *current = allocated[i];
-    pyroscope_context_t *next = allocated[i + 1];
-
-    EXPECT_EQ(current->next, next);
+    EXPECT_EQ(find_matching_context(i + 1), allocated[i]);
   }
 
-  for (auto *current : allocated) {
-    pyroscope_context_t *next = current->next;
+  for (long unsigned int i = 1; i < allocated.size(); i += 2) {
+    deallocate_context(allocated[i]);
+    EXPECT_EQ(find_matching_context(i + 1), nullptr);
+  }
+  for (long unsigned int i = 0; i < allocated.size(); i += 2) {
+    EXPECT_EQ(find_matching_context(i + 1), allocated[i]);
+  }
+  for (long unsigned int i = 0; i < allocated.size(); i += 2) {
+    deallocate_context(allocated[i]);
+    EXPECT_EQ(find_matching_context(i + 1), nullptr);
+  }
+  EXPECT_EQ(pyroscope_registry.len, 0);
+}
 
-    deallocate_context(current);
+TEST_F(PyroscopeApiTestsRegistry, allocate_context_reuses_slots) {
+  pyroscope_context_t *first = allocate_context(1);
+  first->phpspy_context.event.frame.depth = 42;
+  deallocate_context(first);
 
-    if (current != allocated.back()) {
-      EXPECT_EQ(first_ctx, next);
-    }
-  }
-  EXPECT_EQ(first_ctx, nullptr);
+  pyroscope_context_t *again = allocate_context(2);
+  EXPECT_EQ(again, first);
+  EXPECT_EQ(again->pid, 2);
+  EXPECT_EQ(again->next, nullptr);
+  EXPECT_EQ(again->phpspy_context.event.frame.depth, 0);
+  deallocate_context(again);
 }
 
-TEST_F(PyroscopeApiTestsLinkedList, deallocate_context) {
-  pyroscope_context_t *ptr = allocate_context();
-  EXPECT_EQ(ptr, first_ctx);
+TEST_F(PyroscopeApiTestsRegistry, footprint) {
+  constexpr int nof = 1000;
+  phpspy_footprint_t before, during, after;
+  std::vector<pyroscope_context_t *> allocated;
 
-  deallocate_context(ptr);
+  ASSERT_EQ(phpspy_footprint(&before), 0);
+  for (int i = 0; i < nof; i++) {
+    allocated.push_back(allocate_context(i + 1));
+  }
+  ASSERT_EQ(phpspy_footprint(&during), 0);
+  EXPECT_EQ(during.contexts, before.contexts + nof);
+  EXPECT_GT(during.bytes, nof * sizeof(pyroscope_context_t));
 
-  ASSERT_EQ(first_ctx, nullptr);
+  for (auto ctx : allocated) {
+    deallocate_context(ctx);
+  }
+  ASSERT_EQ(phpspy_footprint(&after), 0);
+  EXPECT_EQ(after.contexts, before.contexts);
+  // Only a bounded number of free slabs is kept around
+  EXPECT_LE(after.pooled, PHPSPY_CONTEXT_POOL_SLABS * PHPSPY_CONTEXT_SLAB_SIZE);
+  EXPECT_LE(after.bytes, PHPSPY_CONTEXT_POOL_SLABS * sizeof(context_slab_t));
 }
 
 class PyroscopeApiTestsParseOutput : public PyroscopeApiTestsSingleApp {
@@ -287,17 +615,24 @@ class PyroscopeApiTestsParseOutput : public PyroscopeApiTestsSingleApp {
     memset(&frames, 0, sizeof(frames));
     context.event_udata = static_cast<void *>(&frames);
   }
+  void TearDown() {
+    strings_free(&context.strings);
+    segments_free(&context.segments);
+  }
 
   void prepare_frame(std::string func, std::string class_name, std::string file,
                      int lineno, int frameno) {
     ASSERT_LT(frameno, PyroscopeApiTestsParseOutput::max_frames);
     auto &frame = frames[frameno];
-    strcpy(frame.loc.func, func.c_str());
-    strcpy(frame.loc.class_name, class_name.c_str());
-    strcpy(frame.loc.file, file.c_str());
-    frame.loc.func_len = strlen(frame.loc.func);
-    frame.loc.file_len = strlen(frame.loc.file);
-    frame.loc.class_len = strlen(frame.loc.class_name);
+    ASSERT_EQ(strings_intern(&context.strings, func.c_str(), func.size(),
+                             &frame.loc.func),
+              PHPSPY_OK);
+    ASSERT_EQ(strings_intern(&context.strings, class_name.c_str(),
+                             class_name.size(), &frame.loc.class_name),
+              PHPSPY_OK);
+    ASSERT_EQ(strings_intern(&context.strings, file.c_str(), file.size(),
+                             &frame.loc.file),
+              PHPSPY_OK);
     frame.loc.lineno = lineno;
     context.event.frame.depth++;
   }
@@ -358,6 +693,285 @@ TEST_F(PyroscopeApiTestsParseOutput, formulate_output_not_enough_space) {
   EXPECT_STREQ(err_buf, expected_error.c_str());
 }
 
+TEST_F(PyroscopeApiTestsParseOutput, formulate_output_long_names) {
+  const char app_root_dir[] = "/app/root/dir/";
+  std::string klass = "Some\\" + std::string(300, 'N') + "\\Klass";
+  std::string file = "/" + std::string(1000, 'f') + ".php";
+  std::string expected_stacktrace = file + ":10 - " + klass + "::func1;";
+  prepare_frame("func1", klass, file, 10, 0);
+
+  EXPECT_EQ(formulate_output(&context, &app_root_dir[0], &data_buf[0], data_len,
+                             &err_buf[0], err_len),
+            expected_stacktrace.size());
+  EXPECT_STREQ(data_buf, expected_stacktrace.c_str());
+}
+
+TEST_F(PyroscopeApiTestsParseOutput, formulate_output_segment_cache) {
+  const char app_root_dir[] = "/app";
+  std::string expected_stacktrace = "file2:12 - func2;file1:10 - func1;";
+  prepare_frame("func1", "", "/app/file1", 10, 0);
+  prepare_frame("func2", "", "/app/file2", 12, 1);
+
+  for (int i = 0; i < 3; i++) {
+    EXPECT_EQ(formulate_output(&context, &app_root_dir[0], &data_buf[0],
+                               data_len, &err_buf[0], err_len),
+              expected_stacktrace.size());
+    EXPECT_STREQ(data_buf, expected_stacktrace.c_str());
+    EXPECT_EQ(context.segments.len, 2);
+  }
+
+  // Resetting the intern table invalidates every rendered frame
+  context.strings.generation += 1;
+  EXPECT_EQ(formulate_output(&context, &app_root_dir[0], &data_buf[0], 17,
+                             &err_buf[0], err_len),
+            -static_cast<int>(strlen("Not enough space! 34 > 17")));
+  EXPECT_STREQ(err_buf, "Not enough space! 34 > 17");
+  EXPECT_EQ(context.segments.len, 2);
+}
+
+TEST_F(PyroscopeApiTestsParseOutput, strings_intern_dedup) {
+  uint32_t first, second, other, empty;
+  for (int i = 0; i < 10000; i++) {
+    std::string name = "func" + std::to_string(i);
+    ASSERT_EQ(strings_intern(&context.strings, name.c_str(), name.size(),
+                             &other),
+              PHPSPY_OK);
+  }
+  ASSERT_EQ(strings_intern(&context.strings, "func42", 6, &first), PHPSPY_OK);
+  ASSERT_EQ(strings_intern(&context.strings, "func42", 6, &second), PHPSPY_OK);
+  ASSERT_EQ(strings_intern(&context.strings, "", 0, &empty), PHPSPY_OK);
+  EXPECT_EQ(first, second);
+  EXPECT_EQ(empty, 0);
+  EXPECT_EQ(context.strings.count, 10000);
+  EXPECT_STREQ(strings_get(&context.strings, first), "func42");
+  EXPECT_EQ(strings_len(&context.strings, first), 6);
+  EXPECT_STREQ(strings_get(&context.strings, empty), "");
+}
+
+TEST_F(PyroscopeApiTestsParseOutput, call_tree_shared_prefix) {
+  const char app_root_dir[] = "/app";
+  call_tree_t tree{};
+  prepare_frame("leaf1", "", "/app/file3", 3, 0);
+  prepare_frame("func", "Klass", "/app/file2", 2, 1);
+  prepare_frame("main", "", "/other/file1", 1, 2);
+  for (int i = 0; i < 3; i++) {
+    ASSERT_EQ(call_tree_add(&tree, &context, frames, 3, app_root_dir),
+              PHPSPY_OK);
+  }
+  prepare_frame("leaf2", "", "/app/file3", 4, 0);
+  ASSERT_EQ(call_tree_add(&tree, &context, frames, 3, app_root_dir),
+            PHPSPY_OK);
+
+  // root, main, Klass::func and the two leaves
+  EXPECT_EQ(tree.nodes_len, 5);
+  EXPECT_EQ(tree.nodes[0].total, 4);
+  EXPECT_EQ(tree.nodes[tree.nodes[0].first_child].total, 4);
+
+  std::string expected =
+      "/other/file1:1 - main;file2:2 - Klass::func;file3:4 - leaf2; 1\n"
+      "/other/file1:1 - main;file2:2 - Klass::func;file3:3 - leaf1; 3\n";
+  EXPECT_EQ(call_tree_collapsed(&tree, &data_buf[0], 10), 0);
+  EXPECT_EQ(call_tree_collapsed(&tree, &data_buf[0], data_len),
+            expected.size());
+  EXPECT_EQ(std::string(data_buf, expected.size()), expected);
+  EXPECT_EQ(tree.nodes_len, 0);
+  call_tree_free(&tree);
+}
+
+TEST_F(PyroscopeApiTestsParseOutput, call_tree_prune_cold_leaves) {
+  call_tree_t tree{};
+  prepare_frame("hot", "", "file", 1, 0);
+  prepare_frame("main", "", "file", 1, 1);
+  for (int i = 0; i < 10; i++) {
+    ASSERT_EQ(call_tree_add(&tree, &context, frames, 2, ""), PHPSPY_OK);
+  }
+  for (int i = 0; i < 100; i++) {
+    std::string name = "cold" + std::to_string(i);
+    ASSERT_EQ(strings_intern(&context.strings, name.c_str(), name.size(),
+                             &frames[0].loc.func),
+              PHPSPY_OK);
+    ASSERT_EQ(call_tree_add(&tree, &context, frames, 2, ""), PHPSPY_OK);
+  }
+  EXPECT_EQ(tree.nodes_len, 103);
+
+  call_tree_prune(&tree, 3);
+  EXPECT_EQ(tree.nodes_len, 3);
+  EXPECT_EQ(tree.pruned, 100);
+  EXPECT_EQ(tree.nodes[0].total, 110);
+
+  std::string expected = "file:1 - main; 100\nfile:1 - main;file:1 - hot; 10\n";
+  EXPECT_EQ(call_tree_collapsed(&tree, &data_buf[0], data_len),
+            expected.size());
+  EXPECT_EQ(std::string(data_buf, expected.size()), expected);
+  call_tree_free(&tree);
+}
+
+TEST_F(PyroscopeApiTestsParseOutput, call_tree_drops_samples_when_full) {
+  call_tree_t tree{};
+  prepare_frame("main", "", "file", 1, 0);
+  // Frames right below the root are never pruned, so these fill the tree
+  for (int i = 1; i < PHPSPY_CALL_TREE_NODES; i++) {
+    std::string name = "main" + std::to_string(i);
+    ASSERT_EQ(strings_intern(&context.strings, name.c_str(), name.size(),
+                             &frames[0].loc.func),
+              PHPSPY_OK);
+    ASSERT_EQ(call_tree_add(&tree, &context, frames, 1, ""), PHPSPY_OK);
+  }
+  ASSERT_EQ(tree.nodes_len, PHPSPY_CALL_TREE_NODES);
+
+  prepare_frame("leaf", "", "file", 1, 0);
+  prepare_frame("main1", "", "file", 1, 1);
+  ASSERT_EQ(call_tree_add(&tree, &context, frames, 2, ""), PHPSPY_OK);
+  EXPECT_EQ(tree.dropped, 1);
+  EXPECT_EQ(tree.pruned, 0);
+  EXPECT_EQ(tree.nodes_len, PHPSPY_CALL_TREE_NODES);
+  EXPECT_EQ(tree.nodes[0].total, PHPSPY_CALL_TREE_NODES - 1);
+  EXPECT_EQ(tree.nodes[1].total, 1);
+  EXPECT_EQ(tree.nodes[1].self, 1);
+  call_tree_free(&tree);
+}
+
+// Decodes a pprof profile with protoc, against the subset of profile.proto
+// in this directory
+static std::string decode_pprof(const char *buf, int len) {
+  std::string path = testing::TempDir() + "phpspy_test.pb";
+  std::ofstream(path, std::ios::binary).write(buf, len);
+  std::string cmd =
+      "protoc --proto_path=tests/pyroscope_api "
+      "--decode=perftools.profiles.Profile profile.proto < " +
+      path + " 2>&1";
+  std::string decoded;
+  char line[256];
+  FILE *out = popen(cmd.c_str(), "r");
+  while (out != nullptr && fgets(line, sizeof(line), out) != nullptr) {
+    decoded += line;
+  }
+  if (out != nullptr) pclose(out);
+  remove(path.c_str());
+  return decoded;
+}
+
+TEST_F(PyroscopeApiTestsParseOutput, call_tree_pprof) {
+  if (system("protoc --version > /dev/null 2>&1") != 0) {
+    GTEST_SKIP() << "protoc is needed to decode the profile";
+  }
+  call_tree_t tree{};
+  int size;
+  prepare_frame("leaf1", "", "/app/file3", 3, 0);
+  prepare_frame("func", "Klass", "/app/file2", 2, 1);
+  prepare_frame("main", "", "/other/file1", -1, 2);
+  for (int i = 0; i < 3; i++) {
+    ASSERT_EQ(call_tree_add(&tree, &context, frames, 3, "/app"), PHPSPY_OK);
+  }
+  prepare_frame("leaf2", "", "/app/file3", 4, 0);
+  ASSERT_EQ(call_tree_add(&tree, &context, frames, 3, "/app"), PHPSPY_OK);
+  tree.time_ns = 1000;
+
+  EXPECT_EQ(call_tree_pprof(&tree, 10000000, 1000001000, &data_buf[0], 10,
+                            &size),
+            PHPSPY_ERR_BUF_FULL);
+  EXPECT_GT(size, 10);
+  ASSERT_EQ(call_tree_pprof(&tree, 10000000, 1000001000, &data_buf[0],
+                            data_len, &size),
+            PHPSPY_OK);
+
+  std::string expected = R"(sample_type {
+  type: 1
+  unit: 2
+}
+sample_type {
+  type: 3
+  unit: 4
+}
+sample {
+  location_id: 3
+  location_id: 2
+  location_id: 1
+  value: 3
+  value: 30000000
+}
+sample {
+  location_id: 4
+  location_id: 2
+  location_id: 1
+  value: 1
+  value: 10000000
+}
+location {
+  id: 1
+  line {
+    function_id: 1
+  }
+}
+location {
+  id: 2
+  line {
+    function_id: 2
+    line: 2
+  }
+}
+location {
+  id: 3
+  line {
+    function_id: 3
+    line: 3
+  }
+}
+location {
+  id: 4
+  line {
+    function_id: 4
+    line: 4
+  }
+}
+function {
+  id: 1
+  name: 5
+  system_name: 5
+  filename: 6
+}
+function {
+  id: 2
+  name: 7
+  system_name: 7
+  filename: 8
+}
+function {
+  id: 3
+  name: 9
+  system_name: 9
+  filename: 10
+}
+function {
+  id: 4
+  name: 11
+  system_name: 11
+  filename: 10
+}
+string_table: ""
+string_table: "samples"
+string_table: "count"
+string_table: "wall"
+string_table: "nanoseconds"
+string_table: "main"
+string_table: "/other/file1"
+string_table: "Klass::func"
+string_table: "file2"
+string_table: "leaf1"
+string_table: "file3"
+string_table: "leaf2"
+time_nanos: 1000
+duration_nanos: 1000000000
+period_type {
+  type: 3
+  unit: 4
+}
+period: 10000000
+)";
+  EXPECT_EQ(decode_pprof(data_buf, size), expected);
+  call_tree_free(&tree);
+}
+
 class PyroscopeApiTestsProfiling : public PyroscopeApiTestsSingleApp {
  public:
   static constexpr float loops = 899;
@@ -366,11 +980,15 @@ class PyroscopeApiTestsProfiling : public PyroscopeApiTestsSingleApp {
 TEST_F(PyroscopeApiTestsProfiling, phpspy_init_profiling) {
   auto &app = apps[0];
 
-  constexpr float time_constraint_us = 30000.f;
+  // Without pools every init finds the addresses again, rather than joining
+  // the pool the first one published
+  OptionGuard pools(opt_pools);
+  opt_pools = 0;
+  constexpr float time_constraint_us = 2000.f;
 
   auto t1 = high_resolution_clock::now();
   for (int i = 0; i < loops; i++) {
-    phpspy_init(app.pid, &err_buf[0], err_len);
+    ASSERT_EQ(phpspy_init(app.pid, &err_buf[0], err_len), 0) << err_buf;
   }
   auto t2 = high_resolution_clock::now();
   auto total_us = duration_cast<microseconds>(t2 - t1).count();
@@ -406,6 +1024,33 @@ TEST_F(PyroscopeApiTestsProfiling, phpspy_snapshot_profiling) {
   phpspy_cleanup(app.pid, &err_buf[0], err_len);
 }
 
+TEST_F(PyroscopeApiTestsProfiling, find_matching_context_profiling) {
+  constexpr int lookups = 100000;
+  constexpr float time_constraint_ns = 1000.f;
+
+  for (int nof : {10, 1000, 100000}) {
+    std::vector<pyroscope_context_t *> allocated;
+    for (int i = 0; i < nof; i++) {
+      allocated.push_back(allocate_context(i + 1));
+    }
+
+    auto t1 = high_resolution_clock::now();
+    for (int i = 0; i < lookups; i++) {
+      int idx = (i * 7919) % nof;
+      EXPECT_EQ(find_matching_context(idx + 1), allocated[idx]);
+    }
+    auto t2 = high_resolution_clock::now();
+    auto total_ns = duration_cast<nanoseconds>(t2 - t1).count();
+    std::cout << "find_matching_context mean with " << nof
+              << " contexts: " << total_ns / lookups << " (ns)" << std::endl;
+    EXPECT_LT(total_ns / lookups, time_constraint_ns);
+
+    for (auto *ctx : allocated) {
+      deallocate_context(ctx);
+    }
+  }
+}
+
 class PyroscopeApiTestsChdir : public PyroscopeApiTestsSingleApp {};
 
 TEST_F(PyroscopeApiTestsChdir, init_ok) {
@@ -448,6 +1093,26 @@ TEST_F(PyroscopeApiTestsMultipleApp, init_ok) {
   }
 }
 
+TEST_F(PyroscopeApiTestsMultipleApp, init_shares_symbol_cache) {
+  uint64_t hits_before, misses_before, opens_before, hits, misses, opens;
+  symbol_cache_clear();
+  symbol_cache_stats(&hits_before, &misses_before, &opens_before);
+
+  for (auto const &app : apps) {
+    EXPECT_EQ(phpspy_init(app.pid, &err_buf[0], err_len), 0);
+  }
+  symbol_cache_stats(&hits, &misses, &opens);
+  // Both apps run the same php binary, only the first one resolves it and
+  // the second one finds its symbol without opening the binary again
+  EXPECT_EQ(misses - misses_before, 1);
+  EXPECT_EQ(hits - hits_before, apps.size() - 1);
+  EXPECT_EQ(opens - opens_before, 1);
+
+  for (auto const &app : apps) {
+    phpspy_cleanup(app.pid, &err_buf[0], err_len);
+  }
+}
+
 TEST_F(PyroscopeApiTestsMultipleApp, phpspy_snapshot_ok) {
   for (auto const &app : apps) {
     phpspy_init(app.pid, &err_buf[0], err_len);
@@ -465,3 +1130,859 @@ TEST_F(PyroscopeApiTestsMultipleApp, phpspy_snapshot_ok) {
     phpspy_cleanup(app.pid, &err_buf[0], err_len);
   }
 }
+
+TEST_F(PyroscopeApiTestsMultipleApp, phpspy_snapshot_many) {
+  std::vector<int> pids;
+  for (int i = 0; i < 64; i++) {
+    pids.push_back(apps[i % apps.size()].pid);
+  }
+  pids.push_back(0);  // not initialized
+  for (auto const &app : apps) {
+    ASSERT_EQ(phpspy_init(app.pid, &err_buf[0], err_len), 0);
+  }
+
+  for (int nworkers : {0, 1, 4}) {
+    std::vector<char> buf(64 * 1024);
+    phpspy_snapshot_workers(nworkers);
+    int rv = phpspy_snapshot_many(pids.data(), pids.size(), buf.data(),
+                                  buf.size(), &err_buf[0], err_len);
+    EXPECT_GT(rv, static_cast<int>(pids.size() *
+                                   sizeof(phpspy_snapshot_result_t)));
+    EXPECT_STREQ(err_buf, "");
+
+    auto results = reinterpret_cast<phpspy_snapshot_result_t *>(buf.data());
+    for (size_t i = 0; i < pids.size(); i++) {
+      std::string data(buf.data() + results[i].offset, results[i].len);
+      EXPECT_EQ(results[i].pid, pids[i]);
+      EXPECT_LE(results[i].offset + results[i].len, rv);
+      if (i == pids.size() - 1) {
+        EXPECT_EQ(results[i].status,
+                  PHPSPY_SNAPSHOT_ERR | PHPSPY_SNAPSHOT_ERR_NOT_INITIALIZED);
+        EXPECT_EQ(data, "Phpspy not initialized for 0 pid");
+      } else {
+        EXPECT_EQ(results[i].status, 0);
+        EXPECT_EQ(data, apps[i % apps.size()].expected_stacktrace);
+      }
+    }
+  }
+
+  for (auto const &app : apps) {
+    phpspy_cleanup(app.pid, &err_buf[0], err_len);
+  }
+}
+
+TEST_F(PyroscopeApiTestsMultipleApp, phpspy_snapshot_many_not_enough_space) {
+  int pids[] = {apps[0].pid, apps[1].pid};
+  char buf[2 * sizeof(phpspy_snapshot_result_t) + 10]{};
+  for (auto const &app : apps) {
+    ASSERT_EQ(phpspy_init(app.pid, &err_buf[0], err_len), 0);
+  }
+
+  EXPECT_LT(phpspy_snapshot_many(pids, 2, buf, sizeof(phpspy_snapshot_result_t),
+                                 &err_buf[0], err_len),
+            0);
+  EXPECT_STREQ(err_buf, "Not enough space! 32 > 16");
+
+  EXPECT_EQ(phpspy_snapshot_many(pids, 2, buf, sizeof(buf), &err_buf[0],
+                                 err_len),
+            2 * sizeof(phpspy_snapshot_result_t));
+  auto results = reinterpret_cast<phpspy_snapshot_result_t *>(buf);
+  for (int i = 0; i < 2; i++) {
+    EXPECT_EQ(results[i].status,
+              PHPSPY_SNAPSHOT_ERR | PHPSPY_SNAPSHOT_ERR_BUF_FULL);
+    EXPECT_EQ(results[i].len, 0);
+  }
+
+  for (auto const &app : apps) {
+    phpspy_cleanup(app.pid, &err_buf[0], err_len);
+  }
+}
+
+TEST_F(PyroscopeApiTestsMultipleApp, sampler_drops_when_full) {
+  std::vector<int> pids;
+  for (auto const &app : apps) {
+    ASSERT_EQ(phpspy_init(app.pid, &err_buf[0], err_len), 0);
+    pids.push_back(app.pid);
+  }
+
+  phpspy_sampler_t *sampler =
+      phpspy_sampler_start(pids.data(), pids.size(), 1000, 16, &err_buf[0],
+                           err_len);
+  ASSERT_NE(sampler, nullptr);
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+  phpspy_sampler_stats_t stats;
+  phpspy_sampler_stats(sampler, &stats);
+  EXPECT_EQ(stats.samples, 16);
+  EXPECT_GT(stats.dropped, 0);
+
+  std::vector<phpspy_sample_t> samples(32);
+  ASSERT_EQ(phpspy_sampler_drain(sampler, samples.data(), samples.size()), 16);
+  for (int i = 0; i < 16; i++) {
+    auto const &app = apps[i % apps.size()];
+    EXPECT_EQ(samples[i].pid, app.pid);
+    EXPECT_EQ(samples[i].status, 0);
+    EXPECT_EQ(std::string(samples[i].data, samples[i].len),
+              app.expected_stacktrace);
+  }
+  EXPECT_EQ(phpspy_sampler_stop(sampler), 0);
+
+  for (auto const &app : apps) {
+    phpspy_cleanup(app.pid, &err_buf[0], err_len);
+  }
+}
+
+TEST_F(PyroscopeApiTestsMultipleApp, sampler_drain_keeps_up) {
+  std::vector<int> pids;
+  for (auto const &app : apps) {
+    ASSERT_EQ(phpspy_init(app.pid, &err_buf[0], err_len), 0);
+    pids.push_back(app.pid);
+  }
+  EXPECT_EQ(phpspy_sampler_start(pids.data(), pids.size(), 0, 16, &err_buf[0],
+                                 err_len),
+            nullptr);
+  EXPECT_STREQ(err_buf,
+               "Invalid sampler settings: 2 pids at 0 Hz, capacity 16");
+
+  auto start = high_resolution_clock::now();
+  phpspy_sampler_t *sampler = phpspy_sampler_start(
+      pids.data(), pids.size(), 500, 256, &err_buf[0], err_len);
+  ASSERT_NE(sampler, nullptr);
+  std::vector<phpspy_sample_t> samples(64);
+  uint64_t drained = 0;
+  auto until = start + std::chrono::milliseconds(100);
+  while (high_resolution_clock::now() < until) {
+    drained += phpspy_sampler_drain(sampler, samples.data(), samples.size());
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  }
+  phpspy_sampler_stats_t stats;
+  phpspy_sampler_stats(sampler, &stats);
+  auto elapsed_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                        high_resolution_clock::now() - start)
+                        .count();
+  int n;
+  while (drained < stats.samples &&
+         (n = phpspy_sampler_drain(sampler, samples.data(), samples.size())) >
+             0) {
+    drained += n;
+  }
+  EXPECT_EQ(phpspy_sampler_stop(sampler), 0);
+
+  // Everything sampled was drained and nothing was dropped, however busy the
+  // machine. Ticks taken and ticks skipped together never run ahead of 500Hz
+  EXPECT_GT(stats.samples, 0);
+  EXPECT_GE(drained, stats.samples);
+  EXPECT_EQ(stats.dropped, 0);
+  uint64_t ticks = stats.samples / pids.size();
+  EXPECT_LE(ticks + stats.missed, (uint64_t)elapsed_ms * 500 / 1000 + 1);
+
+  for (auto const &app : apps) {
+    phpspy_cleanup(app.pid, &err_buf[0], err_len);
+  }
+}
+
+TEST_F(PyroscopeApiTestsMultipleApp, aggregate_and_flush) {
+  for (auto const &app : apps) {
+    ASSERT_EQ(phpspy_init(app.pid, &err_buf[0], err_len), 0);
+  }
+  for (int i = 0; i < 100; i++) {
+    EXPECT_EQ(phpspy_snapshot_aggregate(apps[0].pid, &err_buf[0], err_len), 0);
+  }
+  for (int i = 0; i < 7; i++) {
+    EXPECT_EQ(phpspy_snapshot_aggregate(apps[1].pid, &err_buf[0], err_len), 0);
+  }
+  EXPECT_STREQ(err_buf, "");
+
+  std::string expected = apps[0].expected_stacktrace + " 100\n";
+  EXPECT_EQ(phpspy_flush(apps[0].pid, &data_buf[0], data_len, &err_buf[0],
+                         err_len),
+            expected.size());
+  EXPECT_EQ(std::string(data_buf, expected.size()), expected);
+
+  // Too small a buffer keeps the counts for the next flush
+  EXPECT_EQ(phpspy_flush(apps[1].pid, &data_buf[0], 10, &err_buf[0], err_len),
+            0);
+  expected = apps[1].expected_stacktrace + " 7\n";
+  EXPECT_EQ(phpspy_flush(apps[1].pid, &data_buf[0], data_len, &err_buf[0],
+                         err_len),
+            expected.size());
+  EXPECT_EQ(std::string(data_buf, expected.size()), expected);
+
+  for (auto const &app : apps) {
+    EXPECT_EQ(phpspy_flush(app.pid, &data_buf[0], data_len, &err_buf[0],
+                           err_len),
+              0);
+    phpspy_cleanup(app.pid, &err_buf[0], err_len);
+  }
+}
+
+TEST_F(PyroscopeApiTestsMultipleApp, lazy_snapshot_and_flush) {
+  for (auto const &app : apps) {
+    ASSERT_EQ(phpspy_init(app.pid, &err_buf[0], err_len), 0);
+  }
+  for (int i = 0; i < 50; i++) {
+    for (auto const &app : apps) {
+      EXPECT_EQ(phpspy_snapshot_lazy(app.pid, &err_buf[0], err_len), 0);
+    }
+  }
+  EXPECT_STREQ(err_buf, "");
+
+  // Nothing is named until the flush
+  for (auto const &app : apps) {
+    trace_context_t *context = &find_matching_context(app.pid)->phpspy_context;
+    EXPECT_EQ(context->strings.count, 0);
+    EXPECT_EQ(context->raw.stacks, 50);
+  }
+  for (auto const &app : apps) {
+    std::string expected = app.expected_stacktrace + " 50\n";
+    EXPECT_EQ(phpspy_flush(app.pid, &data_buf[0], data_len, &err_buf[0],
+                           err_len),
+              expected.size());
+    EXPECT_EQ(std::string(data_buf, expected.size()), expected);
+    trace_context_t *context = &find_matching_context(app.pid)->phpspy_context;
+    EXPECT_EQ(context->raw.stacks, 0);
+    // <main>, wait_a_moment and sleep
+    EXPECT_EQ(HASH_COUNT(context->func_cache), 3);
+    phpspy_cleanup(app.pid, &err_buf[0], err_len);
+  }
+}
+
+TEST_F(PyroscopeApiTestsSingleApp, lazy_flush_drops_reused_functions) {
+  auto &app = apps[0];
+  ASSERT_EQ(phpspy_init(app.pid, &err_buf[0], err_len), 0);
+  ASSERT_EQ(phpspy_snapshot_lazy(app.pid, &err_buf[0], err_len), 0);
+  ASSERT_EQ(phpspy_snapshot_lazy(app.pid, &err_buf[0], err_len), 0);
+
+  // sleep, wait_a_moment, <main>: each frame is its function and opline.
+  // Point wait_a_moment of the second stack at <main>, as if it had been
+  // freed after the sample and <main> had been compiled into its memory
+  trace_raw_t *raw = &find_matching_context(app.pid)->phpspy_context.raw;
+  ASSERT_EQ(raw->stacks, 2);
+  ASSERT_EQ(raw->buf[0], 3);
+  uint64_t *stack = raw->buf + 1 + 2 * 3;
+  ASSERT_EQ(stack[0], 3);
+  stack[1 + 2 * 1] = stack[1 + 2 * 2];
+
+  ASSERT_GT(phpspy_flush(app.pid, &data_buf[0], data_len, &err_buf[0],
+                         err_len),
+            0);
+  // The stale frame is not named after what the memory holds now
+  std::string flushed(data_buf);
+  EXPECT_NE(flushed.find(app.expected_stacktrace + " 1\n"), std::string::npos)
+      << flushed;
+  EXPECT_NE(flushed.find("<internal> - <unknown>;<internal> - sleep; 1\n"),
+            std::string::npos)
+      << flushed;
+  phpspy_cleanup(app.pid, &err_buf[0], err_len);
+}
+
+TEST_F(PyroscopeApiTestsMultipleApp, lazy_snapshot_many) {
+  std::vector<int> pids;
+  for (auto const &app : apps) {
+    ASSERT_EQ(phpspy_init(app.pid, &err_buf[0], err_len), 0);
+    pids.push_back(app.pid);
+  }
+  // A pid listed twice is sampled once, an unknown one is reported
+  pids.push_back(apps[0].pid);
+  pids.push_back(INT_MAX);
+  std::vector<int> statuses(pids.size(), -1);
+  OptionGuard lazy(opt_lazy_uring);
+  opt_lazy_uring = 1;
+
+  ASSERT_EQ(phpspy_snapshot_lazy_many(pids.data(), pids.size(),
+                                      statuses.data(), &err_buf[0], err_len),
+            0);
+  uint64_t enters = lazy_uring.ring.enters;
+  for (int i = 0; i < 10; i++) {
+    ASSERT_EQ(phpspy_snapshot_lazy_many(pids.data(), pids.size(),
+                                        statuses.data(), &err_buf[0],
+                                        err_len),
+              0);
+  }
+  for (size_t i = 0; i + 1 < pids.size(); i++) {
+    EXPECT_EQ(statuses[i], PHPSPY_OK);
+  }
+  EXPECT_EQ(statuses.back(),
+            PHPSPY_SNAPSHOT_ERR | PHPSPY_SNAPSHOT_ERR_NOT_INITIALIZED);
+  // Executor globals, then vm stacks: two enters a round for every pid
+  if (lazy_uring.state == 1) {
+    EXPECT_EQ(lazy_uring.ring.enters - enters, 10 * 2);
+    // The batches keep /proc/pid/mem open whatever the backend reads with
+    for (auto const &app : apps) {
+      trace_context_t *context =
+          &find_matching_context(app.pid)->phpspy_context;
+      EXPECT_GE(context->target.mem_fd, 0);
+    }
+  }
+
+  for (auto const &app : apps) {
+    std::string expected = app.expected_stacktrace + " 11\n";
+    EXPECT_EQ(phpspy_flush(app.pid, &data_buf[0], data_len, &err_buf[0],
+                           err_len),
+              expected.size());
+    EXPECT_EQ(std::string(data_buf, expected.size()), expected);
+    phpspy_cleanup(app.pid, &err_buf[0], err_len);
+  }
+}
+
+TEST_F(PyroscopeApiTestsMultipleApp, flush_pprof) {
+  auto &app = apps[0];
+  ASSERT_EQ(phpspy_init(app.pid, &err_buf[0], err_len), 0);
+  for (int i = 0; i < 10; i++) {
+    EXPECT_EQ(phpspy_snapshot_aggregate(app.pid, &err_buf[0], err_len), 0);
+  }
+
+  // A profile that does not fit keeps the counts for the next flush
+  int rv = phpspy_flush_pprof(app.pid, &data_buf[0], 10, 10000000,
+                              &err_buf[0], err_len);
+  EXPECT_LT(rv, 0);
+  EXPECT_EQ(std::string(err_buf, 18), "Not enough space! ");
+  rv = phpspy_flush_pprof(app.pid, &data_buf[0], data_len, 10000000,
+                          &err_buf[0], err_len);
+  ASSERT_GT(rv, 0);
+  if (system("protoc --version > /dev/null 2>&1") == 0) {
+    std::string decoded = decode_pprof(data_buf, rv);
+    EXPECT_NE(decoded.find("  value: 10\n  value: 100000000\n"),
+              std::string::npos)
+        << decoded;
+  }
+  EXPECT_EQ(phpspy_flush(app.pid, &data_buf[0], data_len, &err_buf[0],
+                         err_len),
+            0);
+  phpspy_cleanup(app.pid, &err_buf[0], err_len);
+}
+
+TEST_F(PyroscopeApiTestsMultipleApp, concurrent_snapshot_init_cleanup) {
+  constexpr int nof_readers = 8;
+  constexpr int nof_snapshots = 2000;
+  constexpr int nof_writes = 200;
+  std::atomic<int> failures{0};
+
+  for (auto const &app : apps) {
+    ASSERT_EQ(phpspy_init(app.pid, &err_buf[0], err_len), 0);
+  }
+
+  std::vector<std::thread> readers;
+  for (int t = 0; t < nof_readers; t++) {
+    readers.emplace_back([&, t]() {
+      char data[data_len]{};
+      char err[err_len]{};
+      for (int i = 0; i < nof_snapshots; i++) {
+        auto const &app = apps[(t + i) % apps.size()];
+        int rv = phpspy_snapshot(app.pid, &data[0], data_len, &err[0], err_len);
+        if (rv != (int)app.expected_stacktrace.size() ||
+            app.expected_stacktrace != data) {
+          failures++;
+        }
+      }
+    });
+  }
+
+  // Re-initialize the apps and churn unrelated pids so that contexts are
+  // replaced and the table is rebuilt while snapshots are in flight
+  std::thread writer([&]() {
+    char err[err_len]{};
+    for (int i = 0; i < nof_writes; i++) {
+      auto const &app = apps[i % apps.size()];
+      if (phpspy_init(app.pid, &err[0], err_len) != 0 ||
+          phpspy_cleanup(app.pid, &err[0], err_len) != 0) {
+        failures++;
+      }
+      std::vector<pyroscope_context_t *> churn;
+      for (int j = 0; j < 64; j++) {
+        churn.push_back(allocate_context(1000000 + j));
+      }
+      for (auto ctx : churn) {
+        deallocate_context(ctx);
+      }
+    }
+  });
+
+  for (auto &reader : readers) {
+    reader.join();
+  }
+  writer.join();
+
+  EXPECT_EQ(failures, 0);
+  for (auto const &app : apps) {
+    EXPECT_EQ(phpspy_cleanup(app.pid, &err_buf[0], err_len), 0);
+  }
+  EXPECT_EQ(pyroscope_registry.len, 0);
+}
+
+// Children forked by a test are killed and reaped when it goes out of scope,
+// whichever assertion ends the test, and by the kernel if the test crashes
+class ChildGuard {
+ public:
+  ~ChildGuard() {
+    for (pid_t pid : pids) {
+      kill(pid, SIGKILL);
+      waitpid(pid, nullptr, 0);
+    }
+  }
+
+  // A child that waits to be killed
+  pid_t spawn() {
+    pid_t child = fork();
+    if (child == 0) {
+      prctl(PR_SET_PDEATHSIG, SIGKILL);
+      pause();
+      _exit(0);
+    }
+    return adopt(child);
+  }
+
+  pid_t adopt(pid_t child) {
+    if (child > 0) {
+      pids.push_back(child);
+    }
+    return child;
+  }
+
+  void reap(pid_t child) {
+    kill(child, SIGKILL);
+    waitpid(child, nullptr, 0);
+    pids.erase(std::remove(pids.begin(), pids.end(), child), pids.end());
+  }
+
+ private:
+  std::vector<pid_t> pids;
+};
+
+class PyroscopeApiTestsReadPlan : public PyroscopeApiTestsBase {
+ public:
+  void SetUp() {
+    memset(&target, 0, sizeof(target));
+    target.pid = getpid();
+    target.mem_fd = open("/proc/self/mem", O_RDONLY);
+    read_plan_reset(&plan);
+  }
+  void TearDown() { close(target.mem_fd); }
+
+  trace_target_t target{};
+  trace_read_plan_t plan{};
+};
+
+TEST_F(PyroscopeApiTestsReadPlan, copy_proc_mem_plan_ok) {
+  const char first[] = "first";
+  const uint64_t second = 0xdeadbeef;
+  char first_copy[sizeof(first)]{};
+  uint64_t second_copy = 0;
+
+  ASSERT_EQ(read_plan_add(&plan, "first", (void *)&first[0], &first_copy[0],
+                          sizeof(first)),
+            PHPSPY_OK);
+  ASSERT_EQ(read_plan_add(&plan, "second", (void *)&second, &second_copy,
+                          sizeof(second)),
+            PHPSPY_OK);
+  EXPECT_EQ(plan.len, 2);
+
+  EXPECT_EQ(copy_proc_mem_plan(&target, &plan), PHPSPY_OK);
+  EXPECT_STREQ(first_copy, first);
+  EXPECT_EQ(second_copy, second);
+}
+
+TEST_F(PyroscopeApiTestsReadPlan, copy_proc_mem_plan_mem_backend) {
+  const uint64_t words[4] = {1, 2, 3, 4};
+  const uint64_t other = 0xdeadbeef;
+  uint64_t copies[5]{};
+
+  // Three neighbours and a stray, then one that cannot be read
+  target.read_backend = PHPSPY_READ_MEM;
+  for (int i = 0; i < 3; i++) {
+    ASSERT_EQ(read_plan_add(&plan, "word", (void *)&words[i], &copies[i],
+                            sizeof(uint64_t)),
+              PHPSPY_OK);
+  }
+  ASSERT_EQ(read_plan_add(&plan, "other", (void *)&other, &copies[3],
+                          sizeof(other)),
+            PHPSPY_OK);
+  EXPECT_EQ(copy_proc_mem_plan(&target, &plan), PHPSPY_OK);
+  EXPECT_EQ(copies[0], 1);
+  EXPECT_EQ(copies[2], 3);
+  EXPECT_EQ(copies[3], other);
+
+  ASSERT_EQ(read_plan_add(&plan, "unmapped", (void *)8, &copies[4],
+                          sizeof(uint64_t)),
+            PHPSPY_OK);
+  EXPECT_EQ(copy_proc_mem_plan(&target, &plan), PHPSPY_ERR);
+}
+
+TEST_F(PyroscopeApiTestsReadPlan, copy_proc_mem_ptrace_short_reads) {
+  // Values end right before an unmapped page, ptrace reads whole words and
+  // must not reach into it
+  const size_t page = sysconf(_SC_PAGESIZE);
+  char *pages = (char *)mmap(nullptr, 2 * page, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  ASSERT_NE(pages, MAP_FAILED);
+  ASSERT_EQ(munmap(pages + page, page), 0);
+  memcpy(pages + page - 11, "0123456789", 11);
+  ChildGuard children;
+  target.pid = children.spawn();
+  target.read_backend = PHPSPY_READ_PTRACE;
+
+  char copy[11]{};
+  for (size_t size : {3, 11}) {
+    memset(copy, 0, sizeof(copy));
+    EXPECT_EQ(copy_proc_mem(&target, "tail", pages + page - size, &copy[0],
+                            size),
+              PHPSPY_OK)
+        << size;
+    EXPECT_EQ(std::string(copy, size),
+              std::string("0123456789\0", 11).substr(11 - size));
+  }
+  munmap(pages, page);
+}
+
+TEST_F(PyroscopeApiTestsReadPlan, read_plan_add_null) {
+  uint64_t copy = 0;
+  EXPECT_EQ(read_plan_add(&plan, "null", nullptr, &copy, sizeof(copy)),
+            PHPSPY_ERR);
+  EXPECT_EQ(plan.len, 0);
+}
+
+TEST_F(PyroscopeApiTestsReadPlan, projection_init_coalesces_fields) {
+  struct sample_s {
+    char type;
+    void *name;
+    void *scope;
+    char padding[200];
+    void *filename;
+    uint32_t line_start;
+  };
+  const trace_field_t fields[] = {
+      PHPSPY_FIELD(struct sample_s, line_start),
+      PHPSPY_FIELD(struct sample_s, scope),
+      PHPSPY_FIELD(struct sample_s, type),
+      PHPSPY_FIELD(struct sample_s, filename),
+      PHPSPY_FIELD(struct sample_s, name),
+  };
+  trace_projection_t proj{};
+
+  projection_init(&proj, fields, sizeof(fields) / sizeof(fields[0]));
+
+  ASSERT_EQ(proj.len, 2);
+  EXPECT_EQ(proj.spans[0].offset, offsetof(struct sample_s, type));
+  EXPECT_EQ(proj.spans[0].size, offsetof(struct sample_s, padding));
+  EXPECT_EQ(proj.spans[1].offset, offsetof(struct sample_s, filename));
+  EXPECT_EQ(proj.spans[1].size, offsetof(struct sample_s, line_start) +
+                                    sizeof(uint32_t) -
+                                    offsetof(struct sample_s, filename));
+
+  struct sample_s remote {}, local {};
+  remote.name = &remote;
+  remote.line_start = 42;
+  memset(remote.padding, 'x', sizeof(remote.padding));
+  ASSERT_EQ(read_plan_add_projection(&plan, "sample", &remote, &local, &proj),
+            PHPSPY_OK);
+  EXPECT_EQ(copy_proc_mem_plan(&target, &plan), PHPSPY_OK);
+  EXPECT_EQ(local.name, &remote);
+  EXPECT_EQ(local.line_start, 42);
+  EXPECT_EQ(local.padding[0], '\0');
+}
+
+class PyroscopeApiTestsShm : public PyroscopeApiTestsReadPlan {};
+
+TEST_F(PyroscopeApiTestsShm, opcache_shm_served_locally) {
+  const size_t len = 4 * 1024 * 1024;
+  char *segment = (char *)mmap(nullptr, len, PROT_READ | PROT_WRITE,
+                               MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  ASSERT_NE(segment, MAP_FAILED);
+  strcpy(segment + 4096, "wait_a_moment");
+  const uint64_t outside = 0xdeadbeef;
+  ChildGuard children;
+  pid_t child = children.spawn();
+
+  // A forked sibling maps the same segment, it is mapped here only once
+  trace_target_t sibling{};
+  sibling.pid = child;
+  sibling.mem_fd = -1;
+  ASSERT_EQ(shm_attach(&target), PHPSPY_OK);
+  if (target.shm == nullptr) {
+    munmap(segment, len);
+    GTEST_SKIP() << "/proc/pid/map_files cannot be opened";
+  }
+  ASSERT_EQ(shm_attach(&sibling), PHPSPY_OK);
+  ASSERT_NE(sibling.shm, nullptr);
+  EXPECT_EQ(sibling.shm, target.shm);
+  EXPECT_EQ(sibling.shm->raddr, segment);
+  EXPECT_EQ(sibling.shm->refs, 2);
+
+  char name[32]{};
+  uint64_t outside_copy = 0;
+  ASSERT_EQ(read_plan_add(&plan, "name", segment + 4096, &name[0],
+                          sizeof("wait_a_moment")),
+            PHPSPY_OK);
+  ASSERT_EQ(read_plan_add(&plan, "outside", (void *)&outside, &outside_copy,
+                          sizeof(outside)),
+            PHPSPY_OK);
+  EXPECT_EQ(copy_proc_mem_plan(&sibling, &plan), PHPSPY_OK);
+  EXPECT_STREQ(name, "wait_a_moment");
+  EXPECT_EQ(outside_copy, outside);
+  EXPECT_EQ(sibling.shm_reads, 1);
+
+  // Writes to the segment after it was mapped show through
+  strcpy(segment + 4096, "sleep");
+  EXPECT_EQ(copy_proc_mem(&sibling, "name", segment + 4096, &name[0],
+                          sizeof("sleep")),
+            PHPSPY_OK);
+  EXPECT_STREQ(name, "sleep");
+  EXPECT_EQ(sibling.shm_reads, 2);
+
+  shm_detach(&sibling);
+  shm_detach(&target);
+  munmap(segment, len);
+}
+
+class PyroscopeApiTestsPool : public PyroscopeApiTestsReadPlan {};
+
+TEST_F(PyroscopeApiTestsPool, pool_joined_by_forked_siblings) {
+  static uint64_t executor_globals;
+  ChildGuard guard;
+  pid_t children[3];
+  for (auto &child : children) {
+    child = guard.spawn();
+  }
+
+  // The binary of the test stands in for php, mapped where the parent has it
+  addr_memo_t memo{};
+  ASSERT_GT(readlink("/proc/self/exe", memo.php_bin_path,
+                     sizeof(memo.php_bin_path) - 1),
+            0);
+  ASSERT_EQ(get_php_start_addr(getpid(), memo.php_bin_path,
+                               &memo.php_start_addr),
+            0);
+  trace_context_t first{}, second{}, self{};
+  first.target.pid = children[0];
+  first.target.mem_fd = second.target.mem_fd = -1;
+  first.target.executor_globals_addr = (uint64_t)&executor_globals;
+  first.target.read_backend = PHPSPY_READ_VM;
+  pool_publish(&first, &memo);
+  ASSERT_NE(first.target.pool, nullptr);
+  EXPECT_EQ(first.sibling, nullptr);
+
+  second.target.pid = children[1];
+  ASSERT_EQ(pool_join(&second), PHPSPY_OK);
+  EXPECT_EQ(second.target.pool, first.target.pool);
+  EXPECT_EQ(second.target.pool->refs, 2);
+  EXPECT_EQ(second.sibling, &first);
+  EXPECT_EQ(second.sibling_pid, children[0]);
+  EXPECT_EQ(second.target.executor_globals_addr,
+            first.target.executor_globals_addr);
+  EXPECT_EQ(second.target.read_backend, PHPSPY_READ_VM);
+
+  // The parent of the pool is no member of it
+  self.target.pid = getpid();
+  self.target.mem_fd = -1;
+  EXPECT_EQ(pool_join(&self), PHPSPY_ERR);
+  EXPECT_EQ(self.target.pool, nullptr);
+
+  // Members joining after the donor left have nobody to copy from
+  trace_pool_t *pool = first.target.pool;
+  pool_leave(&first);
+  EXPECT_EQ(pool->donor, nullptr);
+  EXPECT_EQ(pool->refs, 1);
+
+  // A segment the pool has but the joiner does not map is not taken, even
+  // at the same address. The children were forked before it was mapped
+  const size_t len = 4 * 1024 * 1024;
+  void *segment = mmap(nullptr, len, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  ASSERT_NE(segment, MAP_FAILED);
+  EXPECT_EQ(shm_attach(&target), PHPSPY_OK);
+  if (target.shm != nullptr) {
+    pool->shm = shm_ref(target.shm);
+    trace_context_t third{};
+    third.target.pid = children[2];
+    third.target.mem_fd = -1;
+    ASSERT_EQ(pool_join(&third), PHPSPY_OK);
+    EXPECT_EQ(third.target.pool, pool);
+    EXPECT_EQ(third.target.shm, nullptr);
+    EXPECT_EQ(target.shm->refs, 2);
+    pool_leave(&third);
+  }
+
+  pool_leave(&second);
+  EXPECT_EQ(pool_join(&second), PHPSPY_ERR);
+  if (target.shm != nullptr) {
+    EXPECT_EQ(target.shm->refs, 1);
+  }
+  shm_detach(&target);
+  munmap(segment, len);
+}
+
+TEST_F(PyroscopeApiTestsPool, pool_join_tries_every_binary) {
+  static uint64_t executor_globals;
+  ChildGuard guard;
+  pid_t children[3];
+  for (auto &child : children) {
+    child = guard.spawn();
+  }
+
+  addr_memo_t memo{};
+  ASSERT_GT(readlink("/proc/self/exe", memo.php_bin_path,
+                     sizeof(memo.php_bin_path) - 1),
+            0);
+  ASSERT_EQ(get_php_start_addr(getpid(), memo.php_bin_path,
+                               &memo.php_start_addr),
+            0);
+  trace_context_t first{}, other{}, joiner{};
+  first.target.pid = children[0];
+  first.target.mem_fd = other.target.mem_fd = joiner.target.mem_fd = -1;
+  first.target.executor_globals_addr = (uint64_t)&executor_globals;
+  first.target.read_backend = PHPSPY_READ_VM;
+  pool_publish(&first, &memo);
+  ASSERT_NE(first.target.pool, nullptr);
+
+  // A pool of the same parent for a binary the children do not map comes
+  // first in the list, the joiner still finds the one it belongs to
+  addr_memo_t other_memo = memo;
+  strcpy(other_memo.php_bin_path, "/nonexistent/php");
+  other.target.pid = children[1];
+  pool_publish(&other, &other_memo);
+  ASSERT_NE(other.target.pool, nullptr);
+  ASSERT_NE(other.target.pool, first.target.pool);
+
+  joiner.target.pid = children[2];
+  ASSERT_EQ(pool_join(&joiner), PHPSPY_OK);
+  EXPECT_EQ(joiner.target.pool, first.target.pool);
+  EXPECT_EQ(joiner.target.executor_globals_addr, (uint64_t)&executor_globals);
+
+  pool_leave(&joiner);
+  pool_leave(&other);
+  pool_leave(&first);
+}
+
+class PyroscopeApiTestsWatcher : public PyroscopeApiTestsBase {};
+
+TEST_F(PyroscopeApiTestsWatcher, watcher_follows_children) {
+  static uint64_t executor_globals;
+  ChildGuard children;
+  auto wait_for = [](phpspy_watcher_t *watcher, uint64_t attached,
+                     uint64_t detached) {
+    phpspy_watcher_stats_t stats{};
+    for (int i = 0; i < 2000; i++) {
+      phpspy_watcher_stats(watcher, &stats);
+      if (stats.attached == attached && stats.detached == detached) {
+        return true;
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return false;
+  };
+
+  // Children of the test join a pool standing in for an FPM master's, so
+  // phpspy_init succeeds for them without a php binary
+  addr_memo_t memo{};
+  ASSERT_GT(readlink("/proc/self/exe", memo.php_bin_path,
+                     sizeof(memo.php_bin_path) - 1),
+            0);
+  ASSERT_EQ(get_php_start_addr(getpid(), memo.php_bin_path,
+                               &memo.php_start_addr),
+            0);
+
+  // With events from the proc connector, then listing /proc
+  OptionGuard proc_connector(opt_proc_connector);
+  for (int connector : {1, 0}) {
+    opt_proc_connector = connector;
+    trace_context_t member{};
+    member.target.pid = children.spawn();
+    member.target.mem_fd = -1;
+    member.target.executor_globals_addr = (uint64_t)&executor_globals;
+    member.target.read_backend = PHPSPY_READ_VM;
+    pool_publish(&member, &memo);
+    ASSERT_NE(member.target.pool, nullptr);
+    // Someone else's context of the member is left to them
+    pyroscope_context_t *held = allocate_context(member.target.pid);
+    ASSERT_NE(held, nullptr);
+
+    // A child running something else than php fails to attach
+    pid_t stranger = fork();
+    if (stranger == 0) {
+      prctl(PR_SET_PDEATHSIG, SIGKILL);
+      execlp("sleep", "sleep", "100", nullptr);
+      _exit(1);
+    }
+    children.adopt(stranger);
+    char exe[PATH_MAX];
+    std::string stranger_exe = "/proc/" + std::to_string(stranger) + "/exe";
+    for (int i = 0; i < 2000; i++) {
+      ssize_t len = readlink(stranger_exe.c_str(), exe, sizeof(exe) - 1);
+      if (len > 0 && std::string(exe, len) != memo.php_bin_path) break;
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    // Children already running are attached before start returns
+    phpspy_watcher_t *watcher =
+        phpspy_watcher_start(getpid(), 5, &err_buf[0], err_len);
+    ASSERT_NE(watcher, nullptr) << err_buf;
+    phpspy_watcher_stats_t stats{};
+    phpspy_watcher_stats(watcher, &stats);
+    EXPECT_EQ(stats.attached, 1) << connector;
+    EXPECT_EQ(stats.failed, 1);
+
+    // The watcher dropped its context of the stranger, one made since by
+    // someone else outlives the stranger
+    pyroscope_context_t *own = allocate_context(stranger);
+    ASSERT_NE(own, nullptr);
+    children.reap(stranger);
+    if (!connector) {
+      EXPECT_EQ(stats.proc_connector, 0);
+    }
+    int pids[4];
+    ASSERT_EQ(phpspy_watcher_pids(watcher, &pids[0], 4), 1);
+    EXPECT_EQ(pids[0], member.target.pid);
+    EXPECT_NE(find_matching_context(member.target.pid), nullptr);
+
+    // A respawned worker is attached, the one it replaces detached
+    pid_t child = children.spawn();
+    EXPECT_TRUE(wait_for(watcher, 2, 0)) << connector;
+    EXPECT_NE(find_matching_context(child), nullptr);
+    children.reap(child);
+    EXPECT_TRUE(wait_for(watcher, 2, 1)) << connector;
+    EXPECT_EQ(find_matching_context(child), nullptr);
+    EXPECT_EQ(phpspy_watcher_pids(watcher, &pids[0], 4), 1);
+    EXPECT_EQ(find_matching_context(stranger), own);
+    deallocate_context(own);
+
+    // Events or not, /proc is listed again every interval
+    uint64_t scans = 0;
+    for (int i = 0; i < 2000 && scans < 3; i++) {
+      phpspy_watcher_stats(watcher, &stats);
+      scans = stats.scans;
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    EXPECT_GE(scans, 3) << connector;
+
+    EXPECT_EQ(phpspy_watcher_stop(watcher), 0);
+    EXPECT_EQ(find_matching_context(member.target.pid), held);
+    EXPECT_EQ(held->next, nullptr);
+    deallocate_context(held);
+    pool_leave(&member);
+    children.reap(member.target.pid);
+  }
+}
+
+class PyroscopeApiTestsUring : public PyroscopeApiTestsReadPlan {};
+
+TEST_F(PyroscopeApiTestsUring, uring_read_failure_tears_down) {
+  trace_uring_t ring;
+  if (uring_init(&ring, 8) != PHPSPY_OK) {
+    GTEST_SKIP() << "io_uring unavailable";
+  }
+
+  // Entering a file that is no ring fails, the read offered must not stay
+  // queued for the next call to submit
+  int ring_fd = ring.fd;
+  ring.fd = open("/dev/null", O_RDONLY);
+  uint64_t value = 42, copy = 0;
+  trace_uring_read_t read{};
+  read.local.iov_base = &copy;
+  read.local.iov_len = sizeof(copy);
+  read.raddr = (uint64_t)&value;
+  read.fd = target.mem_fd;
+  EXPECT_EQ(uring_read(&ring, &read, 1), PHPSPY_ERR);
+  EXPECT_EQ(ring.fd, -1);
+  EXPECT_EQ(copy, 0);
+  close(ring_fd);
+}
@@ -0,0 +1,176 @@
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "phpspy.h"
+
+/* A minimal io_uring driven through the raw syscalls, used to read the
+ * memory of many targets at once through their /proc/pid/mem fds. Reads
+ * are submitted a ring's worth at a time and waited for together, so a
+ * batch of reads costs one io_uring_enter however many targets it spans */
+
+static int uring_reap(trace_uring_t *ring, trace_uring_read_t *reads, int n);
+static void uring_drain(trace_uring_t *ring, trace_uring_read_t *reads, int n,
+                        int inflight);
+
+static int uring_enter(trace_uring_t *ring, unsigned submit, unsigned wait) {
+  int rv;
+  do {
+    rv = syscall(__NR_io_uring_enter, ring->fd, submit, wait,
+                 wait > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+  } while (rv == -1 && errno == EINTR);
+  ring->enters += 1;
+  return rv;
+}
+
+int uring_init(trace_uring_t *ring, unsigned entries) {
+  struct io_uring_params params;
+  char *sq, *cq;
+
+  memset(ring, 0, sizeof(*ring));
+  memset(&params, 0, sizeof(params));
+  ring->sq_ptr = ring->cq_ptr = ring->sqes = MAP_FAILED;
+  ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+  if (ring->fd < 0) {
+    log_error("uring_init: Failed to set up io_uring; err=%s\n",
+              strerror(errno));
+    return PHPSPY_ERR;
+  }
+
+  ring->entries = params.sq_entries;
+  ring->sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring->cq_len =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    ring->sq_len = ring->cq_len = PHPSPY_MAX(ring->sq_len, ring->cq_len);
+  }
+  ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (ring->sq_ptr != MAP_FAILED) {
+    ring->cq_ptr = params.features & IORING_FEAT_SINGLE_MMAP
+                       ? ring->sq_ptr
+                       : mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE,
+                              MAP_SHARED | MAP_POPULATE, ring->fd,
+                              IORING_OFF_CQ_RING);
+  }
+  if (ring->cq_ptr != MAP_FAILED) {
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  }
+  if (ring->sqes == MAP_FAILED) {
+    log_error("uring_init: Failed to map io_uring; err=%s\n", strerror(errno));
+    uring_free(ring);
+    return PHPSPY_ERR;
+  }
+
+  sq = ring->sq_ptr;
+  cq = ring->cq_ptr;
+  ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+  ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+  ring->sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+  ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+  ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+  ring->cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+  return PHPSPY_OK;
+}
+
+void uring_free(trace_uring_t *ring) {
+  if (ring->sqes != MAP_FAILED && ring->sqes != NULL) {
+    munmap(ring->sqes, ring->sqes_len);
+  }
+  if (ring->cq_ptr != MAP_FAILED && ring->cq_ptr != NULL &&
+      ring->cq_ptr != ring->sq_ptr) {
+    munmap(ring->cq_ptr, ring->cq_len);
+  }
+  if (ring->sq_ptr != MAP_FAILED && ring->sq_ptr != NULL) {
+    munmap(ring->sq_ptr, ring->sq_len);
+  }
+  if (ring->fd >= 0) {
+    close(ring->fd);
+  }
+  memset(ring, 0, sizeof(*ring));
+  ring->fd = -1;
+}
+
+/* Reaps what completed, returns how many of reads it was for */
+static int uring_reap(trace_uring_t *ring, trace_uring_read_t *reads, int n) {
+  int reaped = 0;
+  unsigned head = *ring->cq_head;
+  struct io_uring_cqe *cqe;
+
+  while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+    cqe = &ring->cqes[head & ring->cq_mask];
+    if (cqe->user_data < (uint64_t)n) {
+      reads[cqe->user_data].res = cqe->res;
+      reaped++;
+    }
+    head++;
+  }
+  __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+  return reaped;
+}
+
+/* Reads every entry of reads, leaving what each got in its res. Fails only
+ * if the ring itself does; reads that fail are for the caller to judge.
+ * Whatever happens, nothing is left in flight to write into reads once it
+ * returns: when even that cannot be waited for the ring is torn down, and
+ * its fd is -1 after */
+int uring_read(trace_uring_t *ring, trace_uring_read_t *reads, int n) {
+  int i, batch, submitted, reaped, rv;
+  unsigned tail, idx;
+  struct io_uring_sqe *sqe;
+
+  for (i = 0; i < n; i += batch) {
+    batch = PHPSPY_MIN(n - i, (int)ring->entries);
+    tail = *ring->sq_tail;
+    for (idx = 0; idx < (unsigned)batch; idx++) {
+      sqe = &ring->sqes[tail & ring->sq_mask];
+      memset(sqe, 0, sizeof(*sqe));
+      sqe->opcode = IORING_OP_READV;
+      sqe->fd = reads[i + idx].fd;
+      sqe->addr = (uint64_t)(uintptr_t)&reads[i + idx].local;
+      sqe->len = 1;
+      sqe->off = reads[i + idx].raddr;
+      sqe->user_data = i + idx;
+      ring->sq_array[tail & ring->sq_mask] = tail & ring->sq_mask;
+      tail++;
+    }
+    __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+    /* The kernel may take fewer entries than offered, then it returns
+     * without waiting and the rest is offered again */
+    for (submitted = 0, reaped = 0; reaped < batch;) {
+      rv = uring_enter(ring, batch - submitted, batch - reaped);
+      if (rv < 0) {
+        log_error("uring_read: Failed to enter io_uring; err=%s\n",
+                  strerror(errno));
+        uring_drain(ring, reads, n, submitted - reaped);
+        return PHPSPY_ERR;
+      }
+      submitted += rv;
+      reaped += uring_reap(ring, reads, n);
+    }
+  }
+  return PHPSPY_OK;
+}
+
+/* Waits for the inflight reads submitted before a failure. Entries offered
+ * but not submitted are left in the ring, which is torn down as well */
+static void uring_drain(trace_uring_t *ring, trace_uring_read_t *reads, int n,
+                        int inflight) {
+  while (inflight > 0) {
+    if (uring_enter(ring, 0, inflight) < 0 && errno != EBUSY &&
+        errno != EAGAIN) {
+      break;
+    }
+    inflight -= uring_reap(ring, reads, n);
+  }
+  if (inflight > 0 ||
+      *ring->sq_tail != __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE)) {
+    log_error("uring_drain: Tearing down io_uring\n");
+    uring_free(ring);
+  }
+}
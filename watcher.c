@@ -0,0 +1,441 @@
+#include <dirent.h>
+#include <linux/cn_proc.h>
+#include <linux/connector.h>
+#include <linux/netlink.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#include "pyroscope_api.h"
+#include "pyroscope_api_struct.h"
+
+/* Keeps a context for every child of a master process. The proc connector
+ * reports every fork, exec and exit on the system as it happens, so workers
+ * respawned by the master are sampled from their first moment and contexts
+ * of dead ones are dropped without waiting for a read to fail. The
+ * children are also listed from /proc every interval_ms, which catches what
+ * the connector missed, dropped on overflow, or cannot report at all */
+
+static int watcher_subscribe(void);
+static int watcher_recv(phpspy_watcher_t *watcher);
+static void watcher_scan(phpspy_watcher_t *watcher);
+static void watcher_attach(phpspy_watcher_t *watcher, pid_t pid);
+static void watcher_detach(phpspy_watcher_t *watcher, pid_t pid);
+static void *watcher_thread(void *arg);
+static uint64_t watcher_now_ms(void);
+static int list_children(pid_t master, watcher_pids_t *children);
+static int list_children_by_ppid(pid_t master, watcher_pids_t *children);
+static int pids_find(watcher_pids_t *set, pid_t pid);
+static int pids_add(watcher_pids_t *set, pid_t pid, pyroscope_context_t *ctx);
+static void pids_remove(watcher_pids_t *set, int i);
+static void pids_free(watcher_pids_t *set);
+
+phpspy_watcher_t *phpspy_watcher_start(int master, int interval_ms,
+                                       void *err_ptr, int err_len) {
+  phpspy_watcher_t *watcher;
+
+  if (master < 1 || interval_ms < 1) {
+    snprintf((char *)err_ptr, err_len,
+             "Invalid watcher settings: master %d every %d ms", master,
+             interval_ms);
+    return NULL;
+  }
+  if (NULL == (watcher = calloc(1, sizeof(phpspy_watcher_t)))) {
+    snprintf((char *)err_ptr, err_len, "Failed to allocate watcher");
+    return NULL;
+  }
+  watcher->master = master;
+  watcher->interval_ms = interval_ms;
+  if ((watcher->stop_fd = eventfd(0, EFD_CLOEXEC)) < 0) {
+    free(watcher);
+    snprintf((char *)err_ptr, err_len, "Failed to create eventfd: %s",
+             strerror(errno));
+    return NULL;
+  }
+  pthread_mutex_init(&watcher->lock, NULL);
+
+  /* Subscribed before listing, so no child forked in between is missed */
+  watcher->nl_fd = opt_proc_connector ? watcher_subscribe() : -1;
+  watcher->stats.proc_connector = watcher->nl_fd >= 0;
+  watcher_scan(watcher);
+
+  if (pthread_create(&watcher->thread, NULL, watcher_thread, watcher) != 0) {
+    phpspy_watcher_stop(watcher);
+    snprintf((char *)err_ptr, err_len, "Failed to start watcher thread");
+    return NULL;
+  }
+  return watcher;
+}
+
+int phpspy_watcher_pids(phpspy_watcher_t *watcher, int *pids, int max) {
+  int n;
+  pthread_mutex_lock(&watcher->lock);
+  n = PHPSPY_MIN(max, watcher->children.len);
+  memcpy(pids, watcher->children.pids, n * sizeof(int));
+  pthread_mutex_unlock(&watcher->lock);
+  return n;
+}
+
+int phpspy_watcher_stats(phpspy_watcher_t *watcher,
+                         phpspy_watcher_stats_t *stats) {
+  pthread_mutex_lock(&watcher->lock);
+  *stats = watcher->stats;
+  pthread_mutex_unlock(&watcher->lock);
+  return 0;
+}
+
+int phpspy_watcher_stop(phpspy_watcher_t *watcher) {
+  uint64_t one = 1;
+
+  /* Also called by a start that could not create the thread */
+  if (0 != watcher->thread) {
+    if (write(watcher->stop_fd, &one, sizeof(one)) != sizeof(one)) {
+      log_error("phpspy_watcher_stop: Failed to wake watcher; err=%s\n",
+                strerror(errno));
+    }
+    pthread_join(watcher->thread, NULL);
+  }
+  while (watcher->children.len > 0) {
+    watcher_detach(watcher, watcher->children.pids[0]);
+  }
+  if (watcher->nl_fd >= 0) {
+    close(watcher->nl_fd);
+  }
+  close(watcher->stop_fd);
+  pthread_mutex_destroy(&watcher->lock);
+  pids_free(&watcher->children);
+  pids_free(&watcher->failed);
+  free(watcher);
+  return 0;
+}
+
+static uint64_t watcher_now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000ull + ts.tv_nsec / 1000000;
+}
+
+/* /proc is listed every interval_ms even while events come in: inside a
+ * container the connector reports pids of the initial pid namespace, if
+ * anything, and none of them then match the master */
+static void *watcher_thread(void *arg) {
+  phpspy_watcher_t *watcher = (phpspy_watcher_t *)arg;
+  struct pollfd fds[2];
+  uint64_t now, next_scan;
+
+  fds[0].fd = watcher->stop_fd;
+  fds[0].events = POLLIN;
+  fds[1].events = POLLIN;
+  next_scan = watcher_now_ms() + watcher->interval_ms;
+  for (;;) {
+    fds[1].fd = watcher->nl_fd;
+    fds[1].revents = 0;
+    now = watcher_now_ms();
+    if (poll(fds, watcher->nl_fd >= 0 ? 2 : 1,
+             next_scan > now ? (int)(next_scan - now) : 0) < 0 &&
+        errno != EINTR) {
+      log_error("watcher_thread: Failed to poll; err=%s\n", strerror(errno));
+      break;
+    }
+    if (fds[0].revents & POLLIN) {
+      break;
+    }
+    if (fds[1].revents != 0 && watcher_recv(watcher) != PHPSPY_OK) {
+      /* The socket is of no more use, carry on listing /proc */
+      close(watcher->nl_fd);
+      watcher->nl_fd = -1;
+      pthread_mutex_lock(&watcher->lock);
+      watcher->stats.proc_connector = 0;
+      pthread_mutex_unlock(&watcher->lock);
+      next_scan = 0;
+    }
+    if ((now = watcher_now_ms()) >= next_scan) {
+      watcher_scan(watcher);
+      next_scan = now + watcher->interval_ms;
+    }
+  }
+  return NULL;
+}
+
+/* Joins the proc connector's multicast group and asks it to start sending */
+static int watcher_subscribe(void) {
+  int fd, size = 1 << 20;
+  struct sockaddr_nl addr;
+  enum proc_cn_mcast_op op = PROC_CN_MCAST_LISTEN;
+  char msg[NLMSG_SPACE(sizeof(struct cn_msg) + sizeof(op))];
+  struct nlmsghdr *nl = (struct nlmsghdr *)msg;
+  struct cn_msg *cn = (struct cn_msg *)NLMSG_DATA(nl);
+
+  fd = socket(PF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_CONNECTOR);
+  if (fd < 0) {
+    log_error("watcher_subscribe: Failed to open socket; err=%s\n",
+              strerror(errno));
+    return -1;
+  }
+  setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+  memset(&addr, 0, sizeof(addr));
+  addr.nl_family = AF_NETLINK;
+  addr.nl_groups = CN_IDX_PROC;
+  memset(msg, 0, sizeof(msg));
+  nl->nlmsg_len = NLMSG_LENGTH(sizeof(*cn) + sizeof(op));
+  nl->nlmsg_type = NLMSG_DONE;
+  cn->id.idx = CN_IDX_PROC;
+  cn->id.val = CN_VAL_PROC;
+  cn->len = sizeof(op);
+  memcpy(cn->data, &op, sizeof(op));
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+      send(fd, msg, nl->nlmsg_len, 0) < 0) {
+    log_error("watcher_subscribe: Failed to listen to the proc connector; "
+              "err=%s\n",
+              strerror(errno));
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/* Handles the events queued on the socket. Events of other processes than
+ * the master and its children are most of them and are skipped */
+static int watcher_recv(phpspy_watcher_t *watcher) {
+  char buf[PHPSPY_WATCHER_MSG_SIZE] __attribute__((aligned(8)));
+  struct nlmsghdr *nl;
+  struct cn_msg *cn;
+  struct proc_event event, *ev = &event;
+  ssize_t len;
+  pid_t pid;
+
+  for (;;) {
+    len = recv(watcher->nl_fd, buf, sizeof(buf), MSG_DONTWAIT);
+    if (len < 0 && errno == ENOBUFS) {
+      /* Events were dropped, what they said is found in /proc instead */
+      watcher_scan(watcher);
+      continue;
+    } else if (len < 0) {
+      if (errno == EAGAIN || errno == EINTR) {
+        return PHPSPY_OK;
+      }
+      log_error("watcher_recv: Failed to receive; err=%s\n", strerror(errno));
+      return PHPSPY_ERR;
+    }
+
+    for (nl = (struct nlmsghdr *)buf; NLMSG_OK(nl, (size_t)len);
+         nl = NLMSG_NEXT(nl, len)) {
+      cn = (struct cn_msg *)NLMSG_DATA(nl);
+      if (cn->id.idx != CN_IDX_PROC || cn->id.val != CN_VAL_PROC) {
+        continue;
+      }
+      /* The event follows the 20 byte cn_msg header, off its alignment */
+      memset(&event, 0, sizeof(event));
+      memcpy(&event, cn->data, PHPSPY_MIN(cn->len, sizeof(event)));
+      switch (ev->what) {
+      case PROC_EVENT_FORK:
+        /* Threads are forks too, only new processes are children */
+        pid = ev->event_data.fork.child_tgid;
+        if (ev->event_data.fork.parent_tgid == watcher->master &&
+            ev->event_data.fork.child_pid == pid &&
+            pids_find(&watcher->children, pid) < 0 &&
+            pids_find(&watcher->failed, pid) < 0) {
+          watcher_attach(watcher, pid);
+        }
+        break;
+      case PROC_EVENT_EXEC:
+        /* Whatever the child runs now has to be initialized anew */
+        pid = ev->event_data.exec.process_tgid;
+        if (pids_find(&watcher->children, pid) >= 0 ||
+            pids_find(&watcher->failed, pid) >= 0) {
+          watcher_detach(watcher, pid);
+          watcher_attach(watcher, pid);
+        }
+        break;
+      case PROC_EVENT_EXIT:
+        pid = ev->event_data.exit.process_tgid;
+        if (ev->event_data.exit.process_pid == pid) {
+          watcher_detach(watcher, pid);
+        }
+        break;
+      default:
+        break;
+      }
+    }
+  }
+}
+
+/* Brings the children initialized in line with the ones in /proc */
+static void watcher_scan(phpspy_watcher_t *watcher) {
+  int i;
+  watcher_pids_t seen;
+
+  memset(&seen, 0, sizeof(seen));
+  if (list_children(watcher->master, &seen) != PHPSPY_OK) {
+    pids_free(&seen);
+    return;
+  }
+  for (i = 0; i < seen.len; i++) {
+    if (pids_find(&watcher->children, seen.pids[i]) < 0 &&
+        pids_find(&watcher->failed, seen.pids[i]) < 0) {
+      watcher_attach(watcher, seen.pids[i]);
+    }
+  }
+  for (i = watcher->children.len - 1; i >= 0; i--) {
+    if (pids_find(&seen, watcher->children.pids[i]) < 0) {
+      watcher_detach(watcher, watcher->children.pids[i]);
+    }
+  }
+  for (i = watcher->failed.len - 1; i >= 0; i--) {
+    if (pids_find(&seen, watcher->failed.pids[i]) < 0) {
+      watcher_detach(watcher, watcher->failed.pids[i]);
+    }
+  }
+  pids_free(&seen);
+  pthread_mutex_lock(&watcher->lock);
+  watcher->stats.scans += 1;
+  pthread_mutex_unlock(&watcher->lock);
+}
+
+/* Others may hold contexts of the same pid, the watcher only ever cleans up
+ * the one it attached */
+static void watcher_attach(phpspy_watcher_t *watcher, pid_t pid) {
+  char err[PHPSPY_STR_SIZE];
+  pyroscope_context_t *ctx = attach_context(pid, &err[0], sizeof(err));
+
+  pthread_mutex_lock(&watcher->lock);
+  if (pids_add(ctx ? &watcher->children : &watcher->failed, pid, ctx) !=
+      PHPSPY_OK) {
+    watcher->stats.failed += 1;
+  } else if (ctx) {
+    watcher->stats.attached += 1;
+    ctx = NULL;
+  } else {
+    watcher->stats.failed += 1;
+  }
+  pthread_mutex_unlock(&watcher->lock);
+  if (ctx) {
+    detach_context(ctx);
+  }
+}
+
+static void watcher_detach(phpspy_watcher_t *watcher, pid_t pid) {
+  pyroscope_context_t *ctx = NULL;
+  int i;
+
+  pthread_mutex_lock(&watcher->lock);
+  if ((i = pids_find(&watcher->failed, pid)) >= 0) {
+    pids_remove(&watcher->failed, i);
+  } else if ((i = pids_find(&watcher->children, pid)) >= 0) {
+    ctx = watcher->children.contexts[i];
+    pids_remove(&watcher->children, i);
+    watcher->stats.detached += 1;
+  }
+  pthread_mutex_unlock(&watcher->lock);
+  if (ctx) {
+    detach_context(ctx);
+  }
+}
+
+/* The children of each thread of master, as the kernel keeps them. Kernels
+ * built without CONFIG_PROC_CHILDREN lack the files, then every process is
+ * looked at instead */
+static int list_children(pid_t master, watcher_pids_t *children) {
+  char path[PATH_MAX];
+  struct dirent *entry;
+  DIR *dir;
+  FILE *fp;
+  pid_t pid;
+  int rv = PHPSPY_OK;
+
+  snprintf(path, sizeof(path), "/proc/%d/task", master);
+  if ((dir = opendir(path)) == NULL) {
+    return PHPSPY_OK; /* the master is gone, so are its children */
+  }
+  while (rv == PHPSPY_OK && (entry = readdir(dir)) != NULL) {
+    if (entry->d_name[0] == '.') {
+      continue;
+    }
+    snprintf(path, sizeof(path), "/proc/%d/task/%s/children", master,
+             entry->d_name);
+    if ((fp = fopen(path, "r")) == NULL) {
+      /* Unless the thread exited and took its directory along */
+      snprintf(path, sizeof(path), "/proc/%d/task/%s", master,
+               entry->d_name);
+      if (access(path, F_OK) == 0) {
+        closedir(dir);
+        children->len = 0;
+        return list_children_by_ppid(master, children);
+      }
+      continue;
+    }
+    while (rv == PHPSPY_OK && fscanf(fp, "%d", &pid) == 1) {
+      rv = pids_add(children, pid, NULL);
+    }
+    fclose(fp);
+  }
+  closedir(dir);
+  return rv;
+}
+
+static int list_children_by_ppid(pid_t master, watcher_pids_t *children) {
+  struct dirent *entry;
+  DIR *dir;
+  pid_t pid, ppid;
+  int rv = PHPSPY_OK;
+
+  if ((dir = opendir("/proc")) == NULL) {
+    log_error("list_children_by_ppid: Failed to open /proc; err=%s\n",
+              strerror(errno));
+    return PHPSPY_ERR;
+  }
+  while (rv == PHPSPY_OK && (entry = readdir(dir)) != NULL) {
+    if ((pid = atoi(entry->d_name)) > 0 &&
+        get_ppid(pid, &ppid) == PHPSPY_OK && ppid == master) {
+      rv = pids_add(children, pid, NULL);
+    }
+  }
+  closedir(dir);
+  return rv;
+}
+
+static int pids_find(watcher_pids_t *set, pid_t pid) {
+  int i;
+  for (i = 0; i < set->len; i++) {
+    if (set->pids[i] == pid) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static int pids_add(watcher_pids_t *set, pid_t pid, pyroscope_context_t *ctx) {
+  pid_t *pids;
+  pyroscope_context_t **contexts;
+  int cap;
+  if (set->len == set->cap) {
+    cap = PHPSPY_MAX(set->cap * 2, 16);
+    if ((pids = realloc(set->pids, cap * sizeof(pid_t))) != NULL) {
+      set->pids = pids;
+    }
+    contexts = realloc(set->contexts, cap * sizeof(pyroscope_context_t *));
+    if (contexts != NULL) {
+      set->contexts = contexts;
+    }
+    if (pids == NULL || contexts == NULL) {
+      log_error("pids_add: Failed to grow to %d pids\n", cap);
+      return PHPSPY_ERR;
+    }
+    set->cap = cap;
+  }
+  set->contexts[set->len] = ctx;
+  set->pids[set->len++] = pid;
+  return PHPSPY_OK;
+}
+
+static void pids_remove(watcher_pids_t *set, int i) {
+  set->len -= 1;
+  set->pids[i] = set->pids[set->len];
+  set->contexts[i] = set->contexts[set->len];
+}
+
+static void pids_free(watcher_pids_t *set) {
+  free(set->pids);
+  free(set->contexts);
+}